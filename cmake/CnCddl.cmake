@@ -0,0 +1,37 @@
+#
+#
+# cn_cbor_cddl_generate(<var> <file.cddl>...)
+#
+# Generate a C decoder and encoder for each CDDL file with cn-cddl-gen,
+# as <name>-cddl.h and <name>-cddl.c in the current binary directory, and
+# set <var> to the list of generated files, for add_executable or
+# add_library.  The generated code needs the current binary directory on
+# the include path and links against cn-cbor.
+
+function ( cn_cbor_cddl_generate var )
+  if ( TARGET cn-cddl-gen )
+    set ( gen cn-cddl-gen )
+  else ()
+    find_program ( CN_CDDL_GEN cn-cddl-gen )
+    if ( NOT CN_CDDL_GEN )
+      message ( FATAL_ERROR "cn-cddl-gen not found" )
+    endif ()
+    set ( gen ${CN_CDDL_GEN} )
+  endif ()
+
+  set ( outputs "" )
+  foreach ( cddl IN LISTS ARGN )
+    get_filename_component ( cddl_abs ${cddl} ABSOLUTE )
+    get_filename_component ( name ${cddl} NAME_WE )
+    set ( h ${CMAKE_CURRENT_BINARY_DIR}/${name}-cddl.h )
+    set ( c ${CMAKE_CURRENT_BINARY_DIR}/${name}-cddl.c )
+    add_custom_command (
+      OUTPUT ${h} ${c}
+      COMMAND ${gen} ${cddl_abs} ${h} ${c}
+      DEPENDS ${gen} ${cddl_abs}
+      COMMENT "Generating C code from ${cddl}"
+      VERBATIM )
+    list ( APPEND outputs ${h} ${c} )
+  endforeach ()
+  set ( ${var} ${outputs} PARENT_SCOPE )
+endfunction ()
@@ -18,6 +18,7 @@ extern "C" {
 #include <stdbool.h>
 #include <stdint.h>
 #include <unistd.h>
+#include <sys/uio.h>
 
 /**
  * All of the different kinds of CBOR values.
@@ -55,6 +56,17 @@ typedef enum cn_cbor_type {
   CN_CBOR_DOUBLE,
   /** Floats, and half-floats */
   CN_CBOR_FLOAT,
+  /** Unsigned integer too large for `v.uint`: the big-endian magnitude,
+      without leading zeros, is at `v.bytes`, `length` bytes long */
+  CN_CBOR_BIGNUM,
+  /** Negative integer too small for `v.sint`: -1 minus the big-endian
+      number at `v.bytes`, `length` bytes long, without leading zeros.
+      Major type 1 integers below INT64_MIN always decode to this. */
+  CN_CBOR_NEGBIGNUM,
+  /** A complete data item that is already encoded: its encoding is at
+      `v.bytes`, `length` bytes long, and is written out unchanged.  It
+      has no children; decode it to look inside. */
+  CN_CBOR_RAW,
   /** An error has occurred */
   CN_CBOR_INVALID
 } cn_cbor_type;
@@ -68,8 +80,17 @@ typedef enum cn_cbor_flags {
   CN_CBOR_FL_COUNT = 1,
   /** An indefinite number of children */
   CN_CBOR_FL_INDEF = 2,
-  /** Not used yet; the structure must free the v.str pointer when the
-     structure is freed */
+  /** The original encoding of this array or map is at `v.bytes`, and
+      neither it nor its children have been changed since decoding */
+  CN_CBOR_FL_SPAN = 4,
+  /** The root of a tree decoded with CN_CBOR_DECODE_ARENA: all of its
+      nodes are in blocks that `cn_cbor_free` releases without a walk */
+  CN_CBOR_FL_ARENA = 8,
+  /** Allocated in one block with its parent by a bulk constructor, such
+      as `cn_cbor_int_array_create`, and freed along with it */
+  CN_CBOR_FL_BLOCK = 16,
+  /** The string at `v.str` belongs to the node: it is either in `x.str`,
+      or was allocated along with the node and is freed with it */
   CN_CBOR_FL_OWNER = 0x80,            /* of str */
 } cn_cbor_flags;
 
@@ -89,16 +110,16 @@ typedef struct cn_cbor {
     /** CN_CBOR_TEXT */
     const char* str;
     /** CN_CBOR_INT */
-    long sint;
+    int64_t sint;
     /** CN_CBOR_UINT */
-    unsigned long uint;
+    uint64_t uint;
     /** CN_CBOR_DOUBLE */
     double dbl;
     /** CN_CBOR_FLOAT */
     float f;
     /** for use during parsing */
-    unsigned long count;
-  } v;                          /* TBD: optimize immediate */
+    uint64_t count;
+  } v;
   /** Number of children.
     * @note: for maps, this is 2x the number of entries */
   int length;
@@ -110,6 +131,20 @@ typedef struct cn_cbor {
   struct cn_cbor* next;
   /** The parent of this value, or NULL if this is the root */
   struct cn_cbor* parent;
+  /** Additional data associated with the value; different branches of
+      the union are used depending on the `type` and `flags` fields. */
+  union {
+    /** CN_CBOR_ARRAY, CN_CBOR_MAP with CN_CBOR_FL_SPAN: the number of
+        bytes of the original encoding */
+    uint32_t span;
+    /** CN_CBOR_TEXT map keys decoded with `cn_cbor_decode_options.keys`:
+        the key's id plus one, or UINT32_MAX if it is not in the
+        dictionary; 0 if not looked up */
+    uint32_t key_id;
+    /** CN_CBOR_BYTES, CN_CBOR_TEXT with CN_CBOR_FL_OWNER, if short
+        enough: the content, NUL-terminated, which `v.str` points at */
+    char str[8];
+  } x;
 } cn_cbor;
 
 /**
@@ -141,7 +176,23 @@ typedef enum cn_cbor_error {
   CN_CBOR_ERR_OUT_OF_MEMORY,
   /** A float was encountered during parse but the library was built without
       support for float types. */
-  CN_CBOR_ERR_FLOAT_NOT_SUPPORTED
+  CN_CBOR_ERR_FLOAT_NOT_SUPPORTED,
+  /** Containers were nested deeper than `cn_cbor_limits.max_depth` */
+  CN_CBOR_ERR_MAX_DEPTH,
+  /** The input had more items than `cn_cbor_limits.max_items` */
+  CN_CBOR_ERR_MAX_ITEMS,
+  /** Decoding would allocate more than `cn_cbor_limits.max_bytes` */
+  CN_CBOR_ERR_MAX_BYTES,
+  /** A string was longer than `cn_cbor_limits.max_string_length` */
+  CN_CBOR_ERR_MAX_STRING_LENGTH,
+  /** An item did not have the type the schema requires */
+  CN_CBOR_ERR_WRONG_TYPE,
+  /** A map did not have a key the schema requires */
+  CN_CBOR_ERR_MISSING_FIELD,
+  /** A stringref (tag 25) did not refer to a string of its namespace */
+  CN_CBOR_ERR_INVALID_STRINGREF,
+  /** A map has the same key twice (see CN_CBOR_DECODE_UNIQUE_KEYS) */
+  CN_CBOR_ERR_DUPLICATE_KEY
 } cn_cbor_error;
 
 /**
@@ -187,6 +238,15 @@ typedef void* (*cn_calloc_func)(size_t count, size_t size, void *context);
  */
 typedef void (*cn_free_func)(void *ptr, void *context);
 
+/**
+ * Free a whole tree at once, for allocators that can release everything
+ * they handed out for it in bulk, such as by resetting a pool.
+ *
+ * @param[in] root    The root of the tree being freed
+ * @param[in] context The allocation context
+ */
+typedef void (*cn_free_tree_func)(cn_cbor *root, void *context);
+
 /**
  * The allocation context.
  */
@@ -198,6 +258,9 @@ typedef struct cn_cbor_context {
     /** Typically, the pool object, to be used when calling `calloc_func`
       * and `free_func` */
     void *context;
+    /** Optional: if set, `cn_cbor_free` calls it once for the root instead
+      * of calling `free_func` for every node */
+    cn_free_tree_func free_tree_func;
 } cn_cbor_context;
 
 /** When USE_CBOR_CONTEXT is defined, many functions take an extra `context`
@@ -225,6 +288,545 @@ typedef struct cn_cbor_context {
  */
 cn_cbor* cn_cbor_decode(const uint8_t *buf, size_t len CBOR_CONTEXT, cn_cbor_errback *errp);
 
+/**
+ * Limits on the resources a single decode may use, to protect against
+ * hostile input.  A zero field means no limit.
+ */
+typedef struct cn_cbor_limits {
+  /** The maximum number of containers (arrays, maps, tags, chunked
+      strings) enclosing any item */
+  int max_depth;
+  /** The maximum number of items, counting each chunk of a chunked string */
+  size_t max_items;
+  /** The maximum number of bytes allocated for the result */
+  size_t max_bytes;
+  /** The maximum length of a byte or text string, or of one chunk */
+  size_t max_string_length;
+} cn_cbor_limits;
+
+/**
+ * Decode an array of CBOR bytes into structures, failing with a
+ * CN_CBOR_ERR_MAX_* error as soon as one of the limits is exceeded.
+ *
+ * @param[in]  buf          The array of bytes to parse
+ * @param[in]  len          The number of bytes in the array
+ * @param[in]  limits       The limits to apply, or NULL for none
+ * @param[in]  CBOR_CONTEXT Allocation context (only if USE_CBOR_CONTEXT is defined)
+ * @param[out] errp         Error, if NULL is returned
+ * @return                  The parsed CBOR structure, or NULL on error
+ */
+cn_cbor* cn_cbor_decode_limited(const uint8_t *buf, size_t len,
+                                const cn_cbor_limits *limits
+                                CBOR_CONTEXT,
+                                cn_cbor_errback *errp);
+
+/** The largest number of keys in one `cn_cbor_keydict` */
+#define CN_CBOR_KEYDICT_MAX 256
+
+/**
+ * A dictionary of text map keys, prepared by `cn_cbor_keydict_init`.
+ * Text keys decoded with the dictionary are matched against it once, so
+ * that `cn_cbor_mapget_key` can compare ids instead of strings.
+ */
+typedef struct cn_cbor_keydict {
+  /** The keys; the id of a key is its index */
+  const char * const *keys;
+  /** The number of keys */
+  size_t count;
+  /** The size of `index`, minus one */
+  unsigned int mask;
+  /** The hash of each key */
+  uint32_t hash[CN_CBOR_KEYDICT_MAX];
+  /** Open-addressed hash table of key ids plus one; 0 is empty */
+  uint16_t index[2 * CN_CBOR_KEYDICT_MAX];
+} cn_cbor_keydict;
+
+/**
+ * Prepare a key dictionary.  The keys are not copied, and must outlive
+ * the dictionary.
+ *
+ * @param[out] dict         The dictionary to prepare
+ * @param[in]  keys         The keys
+ * @param[in]  count        The number of keys, at most CN_CBOR_KEYDICT_MAX
+ * @param[out] errp         Error, if false is returned
+ * @return                  True on success; false for too many keys or a
+ *                          key that appears twice
+ */
+bool cn_cbor_keydict_init(cn_cbor_keydict *dict,
+                          const char * const *keys,
+                          size_t count,
+                          cn_cbor_errback *errp);
+
+/**
+ * Get the id of a key, to use with `cn_cbor_mapget_key`.
+ *
+ * @param[in]  dict         The dictionary
+ * @param[in]  key          The key
+ * @return                  The id, or -1 if the key is not in the dictionary
+ */
+int cn_cbor_keydict_find(const cn_cbor_keydict *dict, const char *key);
+
+/**
+ * Flags for `cn_cbor_decode_options`.
+ */
+typedef enum cn_cbor_decode_flags {
+  /** Remember where each array and map came from in the input, so that
+      re-encoding an unchanged container is a single copy of the original
+      bytes.  The input must outlive the result, as it does for strings. */
+  CN_CBOR_DECODE_SPANS = 1,
+  /** Resolve stringrefs (tag 25) inside stringref namespaces (tag 256)
+      into the strings they refer to, pointing at their first occurrence
+      in the input.  The namespace tags are kept. */
+  CN_CBOR_DECODE_STRINGREFS = 2,
+  /** Fail with CN_CBOR_ERR_DUPLICATE_KEY when a map has two keys that
+      are `cn_cbor_equal`, counting a chunked string as the string it
+      spells out, so that no two readers of a map can disagree on which
+      value a key has.  Each key is checked as it is decoded, and the
+      check takes time linear in the size of the input, however keys
+      are nested in keys. */
+  CN_CBOR_DECODE_UNIQUE_KEYS = 4,
+  /** Keep half and single precision values as CN_CBOR_FLOAT in `v.f`,
+      rather than widening them to CN_CBOR_DOUBLE.  No precision is lost
+      either way, and re-encoding gives the same width back. */
+  CN_CBOR_DECODE_FLOATS = 8,
+  /** Decode bignums (tags 2 and 3 on a definite length byte string)
+      into a single node: CN_CBOR_UINT or CN_CBOR_INT if the value fits,
+      and CN_CBOR_BIGNUM or CN_CBOR_NEGBIGNUM pointing into the input
+      otherwise.  Inside a stringref namespace, they are left as tags. */
+  CN_CBOR_DECODE_BIGNUMS = 16,
+  /** Allocate the nodes in a few large blocks instead of one by one, so
+      that `cn_cbor_free` only has to release the blocks.  Nodes must not
+      be added to or moved out of the resulting tree. */
+  CN_CBOR_DECODE_ARENA = 32
+} cn_cbor_decode_flags;
+
+/**
+ * Options for `cn_cbor_decode_opts`.  Zero-initialize, then set the
+ * fields of interest.
+ */
+typedef struct cn_cbor_decode_options {
+  /** The limits to apply, or NULL for none */
+  const cn_cbor_limits *limits;
+  /** Any of the `cn_cbor_decode_flags`, or'ed together */
+  unsigned int flags;
+  /** The dictionary to match text map keys against, or NULL; it must
+      outlive the result */
+  const cn_cbor_keydict *keys;
+  /** If greater than zero, arrays, maps and tags nested this deep (the
+      root is at depth 0) are not decoded into nodes, but each kept as one
+      CN_CBOR_RAW node pointing into the input.  They are still checked to
+      be well-formed and within the limits, however deep they nest (unlike
+      cn_cbor_skip, which stops at CN_CBOR_WALK_MAX_DEPTH).  Not inside
+      stringref namespaces, where they are decoded as usual. */
+  int raw_depth;
+} cn_cbor_decode_options;
+
+/**
+ * Decode an array of CBOR bytes into structures, with options.
+ *
+ * @param[in]  buf          The array of bytes to parse
+ * @param[in]  len          The number of bytes in the array
+ * @param[in]  opts         The options, or NULL for the defaults
+ * @param[in]  CBOR_CONTEXT Allocation context (only if USE_CBOR_CONTEXT is defined)
+ * @param[out] errp         Error, if NULL is returned
+ * @return                  The parsed CBOR structure, or NULL on error
+ */
+cn_cbor* cn_cbor_decode_opts(const uint8_t *buf, size_t len,
+                             const cn_cbor_decode_options *opts
+                             CBOR_CONTEXT,
+                             cn_cbor_errback *errp);
+
+/**
+ * Decode CBOR that arrived in fragments, such as a chain of network
+ * buffers, without joining them first.  Heads may be split anywhere.
+ * Strings within one fragment point into it, as with `cn_cbor_decode`,
+ * so the fragments must outlive the result; only strings that cross a
+ * fragment boundary are copied.  The tree is allocated as with
+ * CN_CBOR_DECODE_ARENA, and the copies are freed along with it.  Error
+ * positions count from the start of the first fragment.
+ *
+ * Of the options, `limits`, `keys`, CN_CBOR_DECODE_UNIQUE_KEYS and
+ * CN_CBOR_DECODE_FLOATS are supported; the others need the input in one
+ * piece, and fail with CN_CBOR_ERR_INVALID_PARAMETER.
+ *
+ * @param[in]  iov          The fragments, in order; any may be empty
+ * @param[in]  iovcnt       The number of fragments
+ * @param[in]  opts         The options, or NULL for the defaults; the
+ *                          copies count towards `limits->max_bytes`
+ * @param[in]  CBOR_CONTEXT Allocation context (only if USE_CBOR_CONTEXT is defined)
+ * @param[out] errp         Error, if NULL is returned
+ * @return                  The parsed CBOR structure, or NULL on error
+ */
+cn_cbor* cn_cbor_decode_iov(const struct iovec *iov, int iovcnt,
+                            const cn_cbor_decode_options *opts
+                            CBOR_CONTEXT,
+                            cn_cbor_errback *errp);
+
+/**
+ * The head of an encoded CBOR item: its initial byte, split up, and the
+ * argument that follows it.
+ */
+typedef struct cn_cbor_head {
+  /** The major type, 0-7 */
+  int mt;
+  /** The additional information, 0-31; 31 is indefinite length, or a
+      break if `mt` is 7 */
+  int ai;
+  /** The argument: the value, length, count, tag or simple value; the
+      raw bits for floats */
+  uint64_t val;
+} cn_cbor_head;
+
+/**
+ * Decode only the head of the CBOR item at the start of a buffer.  This
+ * is the primitive for parsing known structures without building a tree.
+ *
+ * @param[in]  buf          The array of bytes to parse
+ * @param[in]  len          The number of bytes in the array
+ * @param[out] head         The decoded head
+ * @param[out] errp         Error, if 0 is returned
+ * @return                  The number of bytes in the head, or 0 on error
+ */
+size_t cn_cbor_head_decode(const uint8_t *buf, size_t len,
+                           cn_cbor_head *head,
+                           cn_cbor_errback *errp);
+
+/**
+ * The deepest nesting that `cn_cbor_skip` and `cn_cbor_validate` accept.
+ * They keep a small frame per open container on the C stack, so this
+ * bounds their stack usage.  Define before building the library to
+ * change it.
+ */
+#ifndef CN_CBOR_WALK_MAX_DEPTH
+#define CN_CBOR_WALK_MAX_DEPTH 64
+#endif
+
+/**
+ * Skip over the complete CBOR item at the start of a buffer, including
+ * all of its children, checking that it is well-formed.  Nothing is
+ * allocated; the nesting depth is limited to CN_CBOR_WALK_MAX_DEPTH.
+ *
+ * @param[in]  buf          The array of bytes to parse
+ * @param[in]  len          The number of bytes in the array
+ * @param[out] errp         Error, if 0 is returned
+ * @return                  The number of bytes in the item, or 0 on error
+ */
+size_t cn_cbor_skip(const uint8_t *buf, size_t len, cn_cbor_errback *errp);
+
+/**
+ * What `cn_cbor_validate` found out about a well-formed input, for sizing
+ * the allocations of a later decode.
+ */
+typedef struct cn_cbor_stats {
+  /** The number of items, counted as for `cn_cbor_limits.max_items` */
+  size_t items;
+  /** The largest number of containers enclosing any item, as for
+      `cn_cbor_limits.max_depth` */
+  int max_depth;
+} cn_cbor_stats;
+
+/**
+ * Check that a buffer holds exactly one well-formed CBOR item, within the
+ * limits, without allocating anything.  The errors and their positions
+ * are the same as `cn_cbor_decode_limited` would report, except that
+ * nesting deeper than CN_CBOR_WALK_MAX_DEPTH fails with
+ * CN_CBOR_ERR_MAX_DEPTH.
+ *
+ * @param[in]  buf          The array of bytes to check
+ * @param[in]  len          The number of bytes in the array
+ * @param[in]  limits       The limits to apply, or NULL for none
+ * @param[out] stats        The size of the item, or NULL
+ * @param[out] errp         Error, if false is returned
+ * @return                  True if the input is well-formed
+ */
+bool cn_cbor_validate(const uint8_t *buf, size_t len,
+                      const cn_cbor_limits *limits,
+                      cn_cbor_stats *stats,
+                      cn_cbor_errback *errp);
+
+/**
+ * A decoded item as a flat array of 64-bit words instead of a tree of
+ * nodes.  Each item has one word: its `cn_cbor_type` in the top 8 bits,
+ * and the offset of its head in the input in the low 56 bits.  Arrays,
+ * maps, tags and chunked strings are followed by a second word, the index
+ * just past their last descendant, and their children come right after
+ * that.  The root is at index 0, so 0 never names a child.  Values are
+ * read from the input, which must outlive the tape.
+ */
+typedef struct cn_cbor_tape {
+  /** The input */
+  const uint8_t *buf;
+  /** The number of bytes in the input */
+  size_t len;
+  /** The words */
+  uint64_t *words;
+  /** The number of words */
+  size_t count;
+} cn_cbor_tape;
+
+/** The type of the item in a tape word */
+#define CN_CBOR_TAPE_TYPE(word) ((cn_cbor_type)((word) >> 56))
+/** The offset of the item's head in the input, from a tape word */
+#define CN_CBOR_TAPE_OFFSET(word) ((size_t)((word) & 0xffffffffffffffULL))
+
+/**
+ * Decode a buffer holding exactly one CBOR item into a tape.  The input
+ * is validated first, as `cn_cbor_validate` does, which also sizes the
+ * single allocation the tape needs.  A tape takes at most 16 bytes per
+ * item, so `cn_cbor_limits.max_bytes` bounds it as well.
+ *
+ * @param[in]  buf          The array of bytes to parse
+ * @param[in]  len          The number of bytes in the array
+ * @param[in]  limits       The limits to apply, or NULL for none
+ * @param[out] tape         The tape, to be freed with `cn_cbor_tape_free`
+ * @param[in]  CBOR_CONTEXT Allocation context (only if USE_CBOR_CONTEXT is defined)
+ * @param[out] errp         Error, if false is returned
+ * @return                  True on success
+ */
+bool cn_cbor_tape_decode(const uint8_t *buf, size_t len,
+                         const cn_cbor_limits *limits,
+                         cn_cbor_tape *tape
+                         CBOR_CONTEXT,
+                         cn_cbor_errback *errp);
+
+/**
+ * Free the words of a tape.
+ *
+ * @param[in]  tape         The tape
+ * @param[in]  CBOR_CONTEXT Allocation context (only if USE_CBOR_CONTEXT is defined)
+ */
+void cn_cbor_tape_free(cn_cbor_tape *tape CBOR_CONTEXT);
+
+/**
+ * Get the type of an item on a tape.
+ *
+ * @param[in]  tape         The tape
+ * @param[in]  at           The index of the item
+ * @return                  The type
+ */
+cn_cbor_type cn_cbor_tape_type(const cn_cbor_tape *tape, size_t at);
+
+/**
+ * Skip an item on a tape, with all of its children.  The children of a
+ * container are the items from `at + 2` up to its next index.
+ *
+ * @param[in]  tape         The tape
+ * @param[in]  at           The index of the item
+ * @return                  The index just past the item
+ */
+size_t cn_cbor_tape_next(const cn_cbor_tape *tape, size_t at);
+
+/**
+ * Get an item on a tape as a single node, without children: the type,
+ * the value and the length are those `cn_cbor_decode` would give it.
+ *
+ * @param[in]  tape         The tape
+ * @param[in]  at           The index of the item
+ * @param[out] out          The node
+ */
+void cn_cbor_tape_get(const cn_cbor_tape *tape, size_t at, cn_cbor *out);
+
+/**
+ * Get a value from a map on a tape that has the given string as a key,
+ * like `cn_cbor_mapget_string`.
+ *
+ * @param[in]  tape         The tape
+ * @param[in]  at           The index of the map
+ * @param[in]  key          The string to look up in the map
+ * @return                  The index of the value, or 0 if not found
+ */
+size_t cn_cbor_tape_mapget_string(const cn_cbor_tape *tape, size_t at,
+                                  const char *key);
+
+/**
+ * Get a value from a map on a tape that has the given integer as a key,
+ * like `cn_cbor_mapget_int`.
+ *
+ * @param[in]  tape         The tape
+ * @param[in]  at           The index of the map
+ * @param[in]  key          The int to look up in the map
+ * @return                  The index of the value, or 0 if not found
+ */
+size_t cn_cbor_tape_mapget_int(const cn_cbor_tape *tape, size_t at, int key);
+
+/**
+ * Get the child with the given index from an array on a tape, like
+ * `cn_cbor_index`.
+ *
+ * @param[in]  tape         The tape
+ * @param[in]  at           The index of the array
+ * @param[in]  idx          The array index
+ * @return                  The index of the child, or 0 if invalid
+ */
+size_t cn_cbor_tape_index(const cn_cbor_tape *tape, size_t at,
+                          unsigned int idx);
+
+/**
+ * The number of bytes `cn_cbor_tape_image_write` needs for a tape.
+ *
+ * @param[in]  tape         The tape
+ * @return                  The size of the image
+ */
+size_t cn_cbor_tape_image_size(const cn_cbor_tape *tape);
+
+/**
+ * Write a tape and its input into one position-independent image: a
+ * small header, the words, then the input.  The image holds no pointers,
+ * so it can be stored in a file and `mmap`ed, or placed in shared
+ * memory, and opened with `cn_cbor_tape_image_open` without decoding.
+ * To make an image of a tree, encode it and decode the result into a
+ * tape first.  The words are in host byte order.
+ *
+ * @param[out] buf          The buffer for the image, 8-byte aligned
+ * @param[in]  buf_size     The size of the buffer
+ * @param[in]  tape         The tape
+ * @return                  The size of the image, or -1 if it does not fit
+ */
+ssize_t cn_cbor_tape_image_write(uint8_t *buf, size_t buf_size,
+                                 const cn_cbor_tape *tape);
+
+/**
+ * Make a tape that reads directly from an image written by
+ * `cn_cbor_tape_image_write`, without copying or allocating.  Only the
+ * header is checked, so the image must come from a trusted writer; it
+ * must stay mapped for as long as the tape is used, and the tape must
+ * not be freed.
+ *
+ * @param[in]  image        The image, 8-byte aligned
+ * @param[in]  len          The number of bytes in the image
+ * @param[out] tape         The tape
+ * @param[out] errp         Error, if false is returned
+ * @return                  True on success
+ */
+bool cn_cbor_tape_image_open(const uint8_t *image, size_t len,
+                             cn_cbor_tape *tape,
+                             cn_cbor_errback *errp);
+
+#ifndef CBOR_NO_FLOAT
+/**
+ * Convert an array of big-endian half precision values, such as the
+ * content of a byte string tagged 84 (RFC 8746), to floats.  The
+ * conversion is exact.  It uses F16C or NEON instructions when the
+ * compiler targets them.
+ *
+ * @param[in]  buf          The halves, two bytes each
+ * @param[in]  count        The number of halves in `buf`
+ * @param[out] out          The floats, `count` of them
+ */
+void cn_cbor_half_array_decode(const uint8_t *buf, size_t count, float *out);
+#endif /* CBOR_NO_FLOAT */
+
+/**
+ * The C types that `cn_cbor_decode_into` can store into.
+ */
+typedef enum cn_cbor_field_type {
+  /** A uint64_t, from an unsigned integer */
+  CN_CBOR_FIELD_UINT64,
+  /** An int64_t, from an integer */
+  CN_CBOR_FIELD_INT64,
+  /** An int, from an integer that fits */
+  CN_CBOR_FIELD_INT,
+  /** A bool, from true or false */
+  CN_CBOR_FIELD_BOOL,
+  /** A cn_cbor_string, pointing into the input, from a text string */
+  CN_CBOR_FIELD_TEXT,
+  /** A cn_cbor_string, pointing into the input, from a byte string */
+  CN_CBOR_FIELD_BYTES,
+  /** A double, from a float */
+  CN_CBOR_FIELD_DOUBLE,
+  /** A float, from a float */
+  CN_CBOR_FIELD_FLOAT
+} cn_cbor_field_type;
+
+/**
+ * A definite-length byte or text string in an encoded buffer, or to be
+ * encoded.  Text is not NULL-terminated.
+ */
+typedef struct cn_cbor_string {
+  /** The first byte */
+  const uint8_t *ptr;
+  /** The number of bytes */
+  size_t length;
+} cn_cbor_string;
+
+/** The field must be in the map */
+#define CN_CBOR_FIELD_REQUIRED 1
+
+/**
+ * One entry of a field-descriptor table: which map key goes into which
+ * member of a C struct.
+ */
+typedef struct cn_cbor_field {
+  /** The text key, or NULL for an integer key */
+  const char *key;
+  /** The integer key, if `key` is NULL */
+  int64_t int_key;
+  /** The C type of the member */
+  cn_cbor_field_type type;
+  /** The offset of the member in the struct, from offsetof() */
+  size_t offset;
+  /** CN_CBOR_FIELD_REQUIRED, or 0 */
+  unsigned int flags;
+} cn_cbor_field;
+
+/** The largest number of fields in one table */
+#define CN_CBOR_FIELDS_MAX 64
+
+/**
+ * A field-descriptor table, prepared by `cn_cbor_fields_init` for
+ * hashed key lookup.  Prepare each table once and share it.
+ */
+typedef struct cn_cbor_fields {
+  /** The fields, in the order they are encoded */
+  const cn_cbor_field *fields;
+  /** The number of fields */
+  size_t count;
+  /** The size of `index`, minus one */
+  unsigned int mask;
+  /** The key hash of each field */
+  uint32_t hash[CN_CBOR_FIELDS_MAX];
+  /** Open-addressed hash table of field numbers plus one; 0 is empty */
+  uint8_t index[2 * CN_CBOR_FIELDS_MAX];
+} cn_cbor_fields;
+
+/**
+ * Prepare a field-descriptor table.  The fields are not copied, and must
+ * outlive the table.
+ *
+ * @param[out] desc         The table to prepare
+ * @param[in]  fields       The fields
+ * @param[in]  count        The number of fields, at most CN_CBOR_FIELDS_MAX
+ * @param[out] errp         Error, if false is returned
+ * @return                  True on success; false for too many fields or
+ *                          a key that appears twice
+ */
+bool cn_cbor_fields_init(cn_cbor_fields *desc,
+                         const cn_cbor_field *fields,
+                         size_t count,
+                         cn_cbor_errback *errp);
+
+/**
+ * Decode the CBOR map at the start of a buffer straight into a struct,
+ * without allocating.  The map can be of definite or indefinite length.
+ * Keys that are not in the table are skipped.  The
+ * struct is not cleared first, so members of missing optional fields keep
+ * their values, which can be defaults.
+ *
+ * @param[in]  buf          The array of bytes to parse
+ * @param[in]  len          The number of bytes in the array
+ * @param[in]  desc         The prepared field-descriptor table
+ * @param[out] out          The struct to fill in
+ * @param[out] present      Set to a bitmap of the fields found (bit `i` for
+ *                          `desc->fields[i]`), or NULL
+ * @param[out] errp         Error, if 0 is returned
+ * @return                  The number of bytes in the map, or 0 on error
+ */
+size_t cn_cbor_decode_into(const uint8_t *buf, size_t len,
+                           const cn_cbor_fields *desc,
+                           void *out,
+                           uint64_t *present,
+                           cn_cbor_errback *errp);
+
 /**
  * Get a value from a CBOR map that has the given string as a key.
  *
@@ -234,6 +836,20 @@ cn_cbor* cn_cbor_decode(const uint8_t *buf, size_t len CBOR_CONTEXT, cn_cbor_err
  */
 cn_cbor* cn_cbor_mapget_string(const cn_cbor* cb, const char* key);
 
+/**
+ * Get a value from a CBOR map that has the given dictionary key.  Keys
+ * that were matched against the dictionary while decoding are compared
+ * by id; other text keys are compared as strings.
+ *
+ * @param[in]  cb           The CBOR map
+ * @param[in]  dict         The dictionary used for decoding
+ * @param[in]  key_id       The id of the key, from `cn_cbor_keydict_find`
+ * @return                  The matching value, or NULL if the key is not found
+ */
+cn_cbor* cn_cbor_mapget_key(const cn_cbor* cb,
+                            const cn_cbor_keydict *dict,
+                            int key_id);
+
 /**
  * Get a value from a CBOR map that has the given integer as a key.
  *
@@ -252,16 +868,177 @@ cn_cbor* cn_cbor_mapget_int(const cn_cbor* cb, int key);
  */
 cn_cbor* cn_cbor_index(const cn_cbor* cb, unsigned int idx);
 
+/**
+ * Compare two CBOR values, including all of their children.  Values that
+ * only differ in encoding are equal: floats compare as doubles (with all
+ * NaNs equal), definite and indefinite length containers are not
+ * distinguished, and a chunked string equals the string its chunks spell
+ * out.  The comparison stops at the first difference, and does
+ * not recurse, so it is safe for arbitrarily deep trees.
+ *
+ * @param[in]  a            The first value, or NULL
+ * @param[in]  b            The second value, or NULL
+ * @return                  True if the values are equal
+ */
+bool cn_cbor_equal(const cn_cbor* a, const cn_cbor* b);
+
+/**
+ * Compute a fast, non-cryptographic hash of a CBOR value, including all
+ * of its children.  Values that are `cn_cbor_equal` have the same hash,
+ * so it is suitable for keying caches of decoded documents, and it does
+ * not depend on the host's byte order.  Do not use
+ * it where an attacker could benefit from collisions.
+ *
+ * @param[in]  cb           The value, or NULL
+ * @return                  The hash
+ */
+uint64_t cn_cbor_hash(const cn_cbor* cb);
+
 /**
  * Free the given CBOR structure.
  * You MUST NOT try to free a cn_cbor structure with a parent (i.e., one
- * that is not a root in the tree).
+ * that is not a root in the tree).  Trees decoded with
+ * CN_CBOR_DECODE_ARENA, and trees allocated from a context with a
+ * `free_tree_func`, are freed without visiting their nodes.
  *
  * @param[in]  cb           The CBOR value to free.  May be NULL, or a root object.
  * @param[in]  CBOR_CONTEXT Allocation context (only if USE_CBOR_CONTEXT is defined)
  */
 void cn_cbor_free(cn_cbor* cb CBOR_CONTEXT);
 
+#ifdef CBOR_PUBLISH
+/**
+ * A reader's slot in a `cn_cbor_published`, aligned to a cache line so
+ * that readers do not slow each other down.  Only its own reader thread
+ * and the updating thread touch it.  Static and automatic arrays of slots
+ * get the alignment from the compiler; allocate arrays on the heap with
+ * `aligned_alloc` or `posix_memalign`, as `malloc` may not align them.
+ */
+typedef struct cn_cbor_reader {
+  /** The epoch the reader entered in, or 0 outside of a read section */
+  uint64_t epoch;
+  uint64_t pad[7];
+} __attribute__((aligned(64))) cn_cbor_reader;
+
+/**
+ * A tree that readers can use while another thread replaces it, in the
+ * style of RCU.  The library never modifies a tree through a
+ * `const cn_cbor *`, so any number of threads may read the same tree at
+ * once with the functions that take one; this handle adds a way to
+ * replace the tree and free the old one once no reader can still see it.
+ * Readers never lock, and never write anything but their own slot.
+ */
+typedef struct cn_cbor_published {
+  /** The current tree */
+  cn_cbor *tree;
+  /** Incremented by every update */
+  uint64_t epoch;
+  /** One slot per reader thread */
+  cn_cbor_reader *readers;
+  /** The number of slots */
+  size_t reader_count;
+} cn_cbor_published;
+
+/**
+ * Set up a published tree.
+ *
+ * @param[out] pub          The handle
+ * @param[in]  readers      One slot per reader thread, which must outlive
+ *                          the handle
+ * @param[in]  reader_count The number of slots
+ * @param[in]  tree         The first tree, or NULL
+ */
+void cn_cbor_published_init(cn_cbor_published *pub,
+                            cn_cbor_reader *readers,
+                            size_t reader_count,
+                            cn_cbor *tree);
+
+/**
+ * Start a read section: get the current tree, which stays valid until
+ * `cn_cbor_published_exit`.  Read sections of the same reader must not
+ * nest.  This never blocks.
+ *
+ * @param[in]  pub          The handle
+ * @param[in]  reader       The index of the calling thread's slot
+ * @return                  The current tree, or NULL
+ */
+const cn_cbor *cn_cbor_published_enter(cn_cbor_published *pub,
+                                       size_t reader);
+
+/**
+ * End a read section.  The tree from `cn_cbor_published_enter` must not
+ * be used afterwards.
+ *
+ * @param[in]  pub          The handle
+ * @param[in]  reader       The index of the calling thread's slot
+ */
+void cn_cbor_published_exit(cn_cbor_published *pub, size_t reader);
+
+/**
+ * Publish a new tree, wait until every reader that could still see the
+ * old one has left its read section, and free the old one.  Readers that
+ * enter from now on get the new tree.  Only one thread may update a
+ * handle at a time, and not from inside a read section.  Updating to NULL
+ * frees the last tree, before the handle is discarded.
+ *
+ * @param[in]  pub          The handle
+ * @param[in]  tree         The new tree, or NULL
+ * @param[in]  CBOR_CONTEXT Allocation context for freeing the old tree (only if USE_CBOR_CONTEXT is defined)
+ */
+void cn_cbor_published_update(cn_cbor_published *pub, cn_cbor *tree
+                              CBOR_CONTEXT);
+#endif /* CBOR_PUBLISH */
+
+/**
+ * How many open containers the encoder keeps on the C stack (or in a
+ * `cn_cbor_encoder_stream`), which bounds its stack usage.  Containers
+ * nested deeper are still written, and are climbed out of through their
+ * `parent` pointers.  Define before building the library to change it.
+ */
+#ifndef CN_CBOR_ENCODER_MAX_DEPTH
+#define CN_CBOR_ENCODER_MAX_DEPTH 64
+#endif
+
+/**
+ * An integer that is written with a fixed width, so that its value can
+ * later be changed in the encoded bytes with `cn_cbor_patch_int`.
+ */
+typedef struct cn_cbor_slot {
+  /** In: the CN_CBOR_UINT or CN_CBOR_INT value to write with a fixed width */
+  const cn_cbor *cb;
+  /** In: the width of the argument, in bytes: 1, 2, 4 or 8 */
+  int width;
+  /** Out: the offset in the buffer of the initial byte, or -1 if `cb`
+      was not written */
+  ssize_t offset;
+} cn_cbor_slot;
+
+/**
+ * Flags for `cn_cbor_encoder_options`.
+ */
+typedef enum cn_cbor_encoder_flags {
+  /** Write every floating point value as a double, rather than in its
+      shortest exact encoding.  The output is larger, but writing it
+      needs no classification at all. */
+  CN_CBOR_ENCODE_FLOAT64 = 1
+} cn_cbor_encoder_flags;
+
+/**
+ * Options for `cn_cbor_encoder_write_opts`.  Zero-initialize, then set
+ * the fields of interest.
+ */
+typedef struct cn_cbor_encoder_options {
+  /** Fail if containers are nested deeper than this; 0 means no limit */
+  int max_depth;
+  /** Integers to write as patchable slots, or NULL.  Writing fails if one
+      of their values does not fit its width. */
+  cn_cbor_slot *slots;
+  /** The number of entries in `slots` */
+  size_t slot_count;
+  /** Any of the `cn_cbor_encoder_flags`, or'ed together */
+  unsigned int flags;
+} cn_cbor_encoder_options;
+
 /**
  * Write a CBOR value and all of the child values.
  *
@@ -277,6 +1054,263 @@ ssize_t cn_cbor_encoder_write(uint8_t *buf,
 			      size_t buf_size,
 			      const cn_cbor *cb);
 
+/**
+ * Write a CBOR value and all of the child values, with options.
+ * Only the subtree rooted at `cb` is written; the `parent` pointers
+ * of the nodes are only used for containers nested deeper than
+ * CN_CBOR_ENCODER_MAX_DEPTH.
+ *
+ * @param[in]  buf        The buffer into which to write
+ * @param[in]  buf_offset The offset (in bytes) from the beginning of the buffer
+ *                        to start writing at
+ * @param[in]  buf_size   The total length (in bytes) of the buffer
+ * @param[in]  cb         The value to write
+ * @param[in]  opts       Encoding options, or NULL for the defaults
+ * @return                -1 on fail (including nesting deeper than the
+ *                        maximum depth), or number of bytes written
+ */
+ssize_t cn_cbor_encoder_write_opts(uint8_t *buf,
+                                   size_t buf_offset,
+                                   size_t buf_size,
+                                   const cn_cbor *cb,
+                                   const cn_cbor_encoder_options *opts);
+
+/**
+ * Write a CBOR value and all of the child values as an iovec array for
+ * `writev` or `sendmsg`, without copying large strings.  Heads and short
+ * strings are written into `buf`, and each string or CN_CBOR_RAW value of
+ * at least `threshold` bytes gets an iovec of its own that points at its content
+ * in the tree, which must stay unchanged until the output is sent.  The
+ * `offset` of any slots in `opts` is in `buf`.
+ *
+ * @param[in]  buf        The buffer for everything but the large strings
+ * @param[in]  buf_size   The length (in bytes) of the buffer
+ * @param[out] iov        The segments of the output, in order
+ * @param[in,out] iovcnt  In: the number of entries in `iov`; out: the
+ *                        number used
+ * @param[in]  threshold  The length from which strings are referenced; at
+ *                        least 1
+ * @param[in]  cb         The value to write
+ * @param[in]  opts       Encoding options, or NULL for the defaults
+ * @return                -1 on fail (including running out of `buf` or
+ *                        `iov`), or the total number of bytes in `iov`
+ */
+ssize_t cn_cbor_encoder_write_iov(uint8_t *buf,
+                                  size_t buf_size,
+                                  struct iovec *iov,
+                                  int *iovcnt,
+                                  size_t threshold,
+                                  const cn_cbor *cb,
+                                  const cn_cbor_encoder_options *opts);
+
+/**
+ * An encoding in progress that is written a piece at a time, for output
+ * that takes only part of it at once, such as a non-blocking socket.  It
+ * remembers the node it is at and how much of its head and its string
+ * it has written.  The fields are private.
+ */
+typedef struct cn_cbor_encoder_stream {
+  const cn_cbor *stack[CN_CBOR_ENCODER_MAX_DEPTH];
+  const cn_cbor *p;
+  int depth;
+  int max_depth;
+  int phase;
+  unsigned int flags;
+  uint8_t pending[24];
+  int pending_len;
+  int pending_at;
+  const uint8_t *content;
+  size_t content_left;
+} cn_cbor_encoder_stream;
+
+/**
+ * Start writing a CBOR value and all of the child values a piece at a
+ * time.  The tree must not change until the stream is done.
+ *
+ * @param[out] st         The stream
+ * @param[in]  cb         The value to write
+ * @param[in]  opts       Encoding options, or NULL for the defaults; slots
+ *                        are not supported
+ * @return                False if the options are not supported
+ */
+bool cn_cbor_encoder_stream_init(cn_cbor_encoder_stream *st,
+                                 const cn_cbor *cb,
+                                 const cn_cbor_encoder_options *opts);
+
+/**
+ * Write the next piece of a stream.  The output is the same as
+ * `cn_cbor_encoder_write_opts` would give, split wherever the buffers
+ * end; a buffer is only left partly filled at the end of the encoding.
+ *
+ * @param[in]  st         The stream
+ * @param[out] buf        The buffer into which to write
+ * @param[in]  buf_size   The length (in bytes) of the buffer
+ * @return                -1 on fail (the stream cannot go on), or the
+ *                        number of bytes written
+ */
+ssize_t cn_cbor_encoder_stream_write(cn_cbor_encoder_stream *st,
+                                     uint8_t *buf, size_t buf_size);
+
+/**
+ * Whether all of a stream has been written.
+ *
+ * @param[in]  st         The stream
+ * @return                True when done
+ */
+bool cn_cbor_encoder_stream_done(const cn_cbor_encoder_stream *st);
+
+/**
+ * Write a CBOR value and all of its children as a stringref namespace
+ * (tag 256): each byte or text string that appeared before is written as
+ * a stringref (tag 25) to its first occurrence instead.  The table of
+ * strings is allocated while writing.  CN_CBOR_RAW values cannot be
+ * written this way, as the strings inside them would be missing from
+ * the table, except within a nested stringref namespace.
+ *
+ * @param[in]  buf        The buffer into which to write
+ * @param[in]  buf_offset The offset (in bytes) from the beginning of the buffer
+ *                        to start writing at
+ * @param[in]  buf_size   The total length (in bytes) of the buffer
+ * @param[in]  cb         The value to write
+ * @param[in]  CBOR_CONTEXT Allocation context (only if USE_CBOR_CONTEXT is defined)
+ * @return                -1 on fail, or number of bytes written
+ */
+ssize_t cn_cbor_encoder_write_stringref(uint8_t *buf,
+                                        size_t buf_offset,
+                                        size_t buf_size,
+                                        const cn_cbor *cb
+                                        CBOR_CONTEXT);
+
+/**
+ * Write only the head of a CBOR item, in its shortest form.  This is the
+ * primitive for writing known structures without building a tree; the
+ * caller writes any string contents or children that follow.
+ *
+ * @param[in]  buf        The buffer into which to write
+ * @param[in]  buf_offset The offset (in bytes) from the beginning of the buffer
+ *                        to start writing at
+ * @param[in]  buf_size   The total length (in bytes) of the buffer
+ * @param[in]  mt         The major type, 0-7
+ * @param[in]  val        The argument
+ * @return                -1 on fail, or number of bytes written
+ */
+ssize_t cn_cbor_head_encode(uint8_t *buf,
+                            size_t buf_offset,
+                            size_t buf_size,
+                            int mt,
+                            uint64_t val);
+
+/**
+ * Write a struct as a CBOR map, by a field-descriptor table.  Only the
+ * `fields` and `count` of the table are used, so it need not be prepared.
+ *
+ * @param[in]  buf        The buffer into which to write
+ * @param[in]  buf_offset The offset (in bytes) from the beginning of the buffer
+ *                        to start writing at
+ * @param[in]  buf_size   The total length (in bytes) of the buffer
+ * @param[in]  desc       The field-descriptor table
+ * @param[in]  in         The struct to write
+ * @param[in]  present    A bitmap of the optional fields to write (bit `i`
+ *                        for `desc->fields[i]`); required fields are
+ *                        always written
+ * @return                -1 on fail, or number of bytes written
+ */
+ssize_t cn_cbor_encode_from(uint8_t *buf,
+                            size_t buf_offset,
+                            size_t buf_size,
+                            const cn_cbor_fields *desc,
+                            const void *in,
+                            uint64_t present);
+
+#ifndef CBOR_NO_FLOAT
+/**
+ * Write a double in its shortest exact encoding.
+ *
+ * @param[in]  buf        The buffer into which to write
+ * @param[in]  buf_offset The offset (in bytes) from the beginning of the buffer
+ *                        to start writing at
+ * @param[in]  buf_size   The total length (in bytes) of the buffer
+ * @param[in]  val        The value
+ * @return                -1 on fail, or number of bytes written
+ */
+ssize_t cn_cbor_double_encode(uint8_t *buf,
+                              size_t buf_offset,
+                              size_t buf_size,
+                              double val);
+#endif /* CBOR_NO_FLOAT */
+
+/**
+ * Change the value of an integer slot in an encoded buffer, in place.
+ * The buffer is typically a copy of a template written by
+ * `cn_cbor_encoder_write_opts` with `slots`; the slot keeps its width,
+ * and may change sign.
+ *
+ * @param[in]  buf        The buffer the template was written into, or a copy
+ * @param[in]  slot       The slot, as filled in when the template was written
+ * @param[in]  value      The new value
+ * @return                True on success, false (leaving the buffer
+ *                        unchanged) if the value does not fit the slot
+ */
+bool cn_cbor_patch_int(uint8_t *buf, const cn_cbor_slot *slot, int64_t value);
+
+/**
+ * Write a CBOR array of integers, without building a tree first.  If the
+ * buffer has room for the largest possible encoding of all of the
+ * elements, space is only checked once for the whole array.
+ *
+ * @param[in]  buf        The buffer into which to write
+ * @param[in]  buf_offset The offset (in bytes) from the beginning of the buffer
+ *                        to start writing at
+ * @param[in]  buf_size   The total length (in bytes) of the buffer
+ * @param[in]  vals       The integers to write
+ * @param[in]  count      The number of integers in `vals`
+ * @return                -1 on fail, or number of bytes written
+ */
+ssize_t cn_cbor_encoder_write_int_array(uint8_t *buf,
+                                        size_t buf_offset,
+                                        size_t buf_size,
+                                        const int64_t *vals,
+                                        size_t count);
+
+#ifndef CBOR_NO_FLOAT
+/**
+ * Write a CBOR array of doubles, each in its shortest exact encoding,
+ * without building a tree first.  If the buffer has room for the largest
+ * possible encoding of all of the elements, space is only checked once
+ * for the whole array.
+ *
+ * @param[in]  buf        The buffer into which to write
+ * @param[in]  buf_offset The offset (in bytes) from the beginning of the buffer
+ *                        to start writing at
+ * @param[in]  buf_size   The total length (in bytes) of the buffer
+ * @param[in]  vals       The doubles to write
+ * @param[in]  count      The number of doubles in `vals`
+ * @return                -1 on fail, or number of bytes written
+ */
+ssize_t cn_cbor_encoder_write_double_array(uint8_t *buf,
+                                           size_t buf_offset,
+                                           size_t buf_size,
+                                           const double *vals,
+                                           size_t count);
+#endif /* CBOR_NO_FLOAT */
+
+/**
+ * Make a copy of a CBOR value and all of its children, without
+ * recursion.  Every node is allocated with the given context, so a pool
+ * allocator gathers the whole copy in one arena.  The contents of byte
+ * and text strings are *not* copied; the copy points at the same data
+ * as the original, which must outlive it.  Only strings stored in the
+ * node itself (see `cn_cbor_string_create_copy`) come along.
+ *
+ * @param[in]   cb           The value to copy; need not be a root
+ * @param[in]   CBOR_CONTEXT Allocation context (only if USE_CBOR_CONTEXT is defined)
+ * @param[out]  errp         Error, if NULL is returned
+ * @return                   The copy, a new root, or NULL on error
+ */
+cn_cbor* cn_cbor_clone(const cn_cbor* cb
+                       CBOR_CONTEXT,
+                       cn_cbor_errback *errp);
+
 /**
  * Create a CBOR map.
  *
@@ -300,6 +1334,38 @@ cn_cbor* cn_cbor_data_create(const uint8_t* data, int len
                              CBOR_CONTEXT,
                              cn_cbor_errback *errp);
 
+/**
+ * Create a CBOR value from its encoding, to be written out unchanged,
+ * such as a cached sub-document to embed in a new one.  The encoding is
+ * checked to be exactly one well-formed data item.  As with
+ * `cn_cbor_data_create`, the data is *not* owned by the CBOR object.
+ *
+ * @param[in]   data         The encoded data item
+ * @param[in]   len          The number of bytes of data
+ * @param[in]   CBOR_CONTEXT Allocation context (only if USE_CBOR_CONTEXT is defined)
+ * @param[out]  errp         Error, if NULL is returned
+ * @return                   The created CN_CBOR_RAW object, or NULL on error
+ */
+cn_cbor* cn_cbor_raw_create(const uint8_t* data, int len
+                            CBOR_CONTEXT,
+                            cn_cbor_errback *errp);
+
+/**
+ * Create a CBOR byte string that owns a copy of the data, so that the
+ * data need not outlive it.  Up to 7 bytes are stored in the node
+ * itself; longer data is copied into the same allocation as the node.
+ * Either way, `cn_cbor_free` releases it with the node.
+ *
+ * @param[in]   data         The data
+ * @param[in]   len          The number of bytes of data
+ * @param[in]   CBOR_CONTEXT Allocation context (only if USE_CBOR_CONTEXT is defined)
+ * @param[out]  errp         Error, if NULL is returned
+ * @return                   The created object, or NULL on error
+ */
+cn_cbor* cn_cbor_data_create_copy(const uint8_t* data, int len
+                                  CBOR_CONTEXT,
+                                  cn_cbor_errback *errp);
+
 /**
  * Create a CBOR UTF-8 string.  The data is not checked for UTF-8 correctness.
  * The data being stored in the string is *not* owned the CBOR object, so it is
@@ -317,6 +1383,23 @@ cn_cbor* cn_cbor_string_create(const char* data
                                CBOR_CONTEXT,
                                cn_cbor_errback *errp);
 
+/**
+ * Create a CBOR UTF-8 string that owns a copy of the data, as
+ * `cn_cbor_data_create_copy` does for byte strings.  The copy is
+ * NUL-terminated.
+ *
+ * @note: Do NOT use this function with untrusted data.  It calls strlen, and
+ * relies on proper NULL-termination.
+ *
+ * @param[in]   data         NULL-terminated UTF-8 string
+ * @param[in]   CBOR_CONTEXT Allocation context (only if USE_CBOR_CONTEXT is defined)
+ * @param[out]  errp         Error, if NULL is returned
+ * @return                   The created object, or NULL on error
+ */
+cn_cbor* cn_cbor_string_create_copy(const char* data
+                                    CBOR_CONTEXT,
+                                    cn_cbor_errback *errp);
+
 /**
  * Create a CBOR integer (either positive or negative).
  *
@@ -413,6 +1496,105 @@ bool cn_cbor_mapput_string(cn_cbor* cb_map,
  */
 cn_cbor* cn_cbor_array_create(CBOR_CONTEXT_COMMA cn_cbor_errback *errp);
 
+/**
+ * Create a CBOR array of integers.  The array and all of its elements
+ * are allocated at once, as a single block; more elements may be
+ * appended later, but the ones created here cannot be moved to another
+ * container.
+ *
+ * @param[in]   values       The integers
+ * @param[in]   count        The number of integers in `values`
+ * @param[in]   CBOR_CONTEXT Allocation context (only if USE_CBOR_CONTEXT is defined)
+ * @param[out]  errp         Error, if NULL is returned
+ * @return                   The created array, or NULL on error
+ */
+cn_cbor* cn_cbor_int_array_create(const int64_t* values, size_t count
+                                  CBOR_CONTEXT,
+                                  cn_cbor_errback *errp);
+
+/**
+ * Create a CBOR array of UTF-8 strings, in one block as with
+ * `cn_cbor_int_array_create`.  The strings are *not* owned by the array.
+ *
+ * @note: Do NOT use this function with untrusted data.  It calls strlen,
+ * and relies on proper NULL-termination.
+ *
+ * @param[in]   values       NULL-terminated UTF-8 strings
+ * @param[in]   count        The number of strings in `values`
+ * @param[in]   CBOR_CONTEXT Allocation context (only if USE_CBOR_CONTEXT is defined)
+ * @param[out]  errp         Error, if NULL is returned
+ * @return                   The created array, or NULL on error
+ */
+cn_cbor* cn_cbor_string_array_create(const char* const* values, size_t count
+                                     CBOR_CONTEXT,
+                                     cn_cbor_errback *errp);
+
+/**
+ * Create a CBOR array of byte strings, in one block as with
+ * `cn_cbor_int_array_create`.  The data is *not* owned by the array.
+ *
+ * @param[in]   values       The data of each byte string
+ * @param[in]   lengths      The number of bytes of each one
+ * @param[in]   count        The number of byte strings
+ * @param[in]   CBOR_CONTEXT Allocation context (only if USE_CBOR_CONTEXT is defined)
+ * @param[out]  errp         Error, if NULL is returned
+ * @return                   The created array, or NULL on error
+ */
+cn_cbor* cn_cbor_data_array_create(const uint8_t* const* values,
+                                   const int* lengths, size_t count
+                                   CBOR_CONTEXT,
+                                   cn_cbor_errback *errp);
+
+/**
+ * Create a CBOR map with string keys, in one block as with
+ * `cn_cbor_int_array_create`: the keys and a copy of each value are
+ * allocated along with the map.  The values are filled-in `cn_cbor`
+ * structures, such as an array on the stack; only their `type`, `v`,
+ * `length` and indefinite flag are used, and they must not have
+ * children.  As with `cn_cbor_clone`, only strings stored in the node
+ * itself are copied.  Duplicate checks are NOT performed.
+ *
+ * @note: Do NOT use this function with untrusted key data.  It calls
+ * strlen, and relies on proper NULL-termination.
+ *
+ * @param[in]   keys         NULL-terminated UTF-8 keys
+ * @param[in]   values       The value for each key
+ * @param[in]   count        The number of entries
+ * @param[in]   CBOR_CONTEXT Allocation context (only if USE_CBOR_CONTEXT is defined)
+ * @param[out]  errp         Error, if NULL is returned
+ * @return                   The created map, or NULL on error
+ */
+cn_cbor* cn_cbor_map_create_from_pairs(const char* const* keys,
+                                       const cn_cbor* values, size_t count
+                                       CBOR_CONTEXT,
+                                       cn_cbor_errback *errp);
+
+/**
+ * Create a CBOR map with integer keys, as `cn_cbor_map_create_from_pairs`
+ * does for string keys.
+ *
+ * @param[in]   keys         The integer keys
+ * @param[in]   values       The value for each key
+ * @param[in]   count        The number of entries
+ * @param[in]   CBOR_CONTEXT Allocation context (only if USE_CBOR_CONTEXT is defined)
+ * @param[out]  errp         Error, if NULL is returned
+ * @return                   The created map, or NULL on error
+ */
+cn_cbor* cn_cbor_map_create_from_int_pairs(const int64_t* keys,
+                                           const cn_cbor* values, size_t count
+                                           CBOR_CONTEXT,
+                                           cn_cbor_errback *errp);
+
+/**
+ * Note that a value has been changed in place, so that the original
+ * encoding of it and its ancestors (see CN_CBOR_DECODE_SPANS) is no
+ * longer used when encoding.  The `cn_cbor_map_put`, `cn_cbor_mapput_*`
+ * and `cn_cbor_array_append` functions do this automatically.
+ *
+ * @param[in]   cb        The changed value
+ */
+void cn_cbor_mark_dirty(cn_cbor* cb);
+
 /**
  * Append an item to the end of a CBOR array.
  *
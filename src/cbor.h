@@ -34,6 +34,8 @@
 #define TAG_BIGNUM_NEG 3
 #define TAG_URI        32
 #define TAG_RE         35
+#define TAG_STRINGREF    25
+#define TAG_STRINGREF_NS 256
 
 /* Initial bytes of those tag numbers */
 #define IB_TIME_EPOCH (IB_TAG | TAG_TIME_EPOCH)
@@ -41,6 +43,13 @@
 #define IB_BIGNUM_NEG (IB_TAG | TAG_BIGNUM_NEG)
 /* TAG_URI and TAG_RE are non-immediate tags */
 
+/* Whether a string of len bytes goes into a stringref namespace that
+   already has n strings: only if a reference to it would be shorter */
+#define STRINGREF_WORTHY(n, len) ((len) >= ((n) < 24 ? 3 :         \
+                                            (n) < 256 ? 4 :        \
+                                            (n) < 65536 ? 5 :      \
+                                            (n) < 4294967296ULL ? 7 : 11))
+
 /* Simple values handled by this implementation */
 #define VAL_FALSE 20
 #define VAL_TRUE  21
@@ -91,14 +100,23 @@
     (ctx)->free_func((ptr), (ctx)->context) : \
     free((ptr));
 
+/**
+ * Allocate an array of `n` elements of `size` bytes.
+ */
+#define CN_CALLOC_N(ctx, n, size) (((ctx) && (ctx)->calloc_func) ? \
+    (ctx)->calloc_func((n), (size), (ctx)->context) : \
+    calloc((n), (size)))
+
 #define CBOR_CONTEXT_PARAM , context
 #define CN_CALLOC_CONTEXT() CN_CALLOC(context)
+#define CN_CALLOC_N_CONTEXT(n, size) CN_CALLOC_N(context, n, size)
 #define CN_CBOR_FREE_CONTEXT(p) CN_FREE(p, context)
 
 #else
 
 #define CBOR_CONTEXT_PARAM
 #define CN_CALLOC_CONTEXT() CN_CALLOC
+#define CN_CALLOC_N_CONTEXT(n, size) calloc((n), (size))
 #define CN_CBOR_FREE_CONTEXT(p) CN_FREE(p)
 
 #ifndef CN_CALLOC
@@ -9,20 +9,52 @@ extern "C" {
 #endif
 
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <string.h>
+#include <limits.h>
 #include <assert.h>
-#include <math.h>
 #include <arpa/inet.h> // needed for ntohl (e.g.) on Linux
+#ifndef CBOR_NO_FLOAT
+#if defined(__F16C__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+#endif /* CBOR_NO_FLOAT */
 
 #include "cn-cbor/cn-cbor.h"
 #include "cbor.h"
 
 #define CN_CBOR_FAIL(code) do { pb->err = code;  goto fail; } while(0)
 
+/* A block of nodes for CN_CBOR_DECODE_ARENA.  The root is the first node
+   of the first block, and the blocks are chained from there. */
+struct arena_block {
+  struct arena_block *next;
+  size_t count;
+  cn_cbor nodes[];
+};
+
 void cn_cbor_free(cn_cbor* cb CBOR_CONTEXT) {
   cn_cbor* p = cb;
+  struct arena_block *block, *next;
   assert(!p || !p->parent);
+#ifdef USE_CBOR_CONTEXT
+  if (p && context && context->free_tree_func) {
+    context->free_tree_func(p, context->context);
+    return;
+  }
+#endif
+  if (p && (p->flags & CN_CBOR_FL_ARENA)) {
+    block = (struct arena_block *)((char *)p -
+                                   offsetof(struct arena_block, nodes));
+    for (; block; block = next) {
+      next = block->next;
+      CN_CBOR_FREE_CONTEXT(block);
+    }
+    return;
+  }
   while (p) {
     cn_cbor* p1;
     while ((p1 = p->first_child)) { /* go down */
@@ -32,20 +64,59 @@ void cn_cbor_free(cn_cbor* cb CBOR_CONTEXT) {
       if ((p1 = p->parent))
         p1->first_child = 0;
     }
-    CN_CBOR_FREE_CONTEXT(p);
+    if (!(p->flags & CN_CBOR_FL_BLOCK)) /* else freed with its parent */
+      CN_CBOR_FREE_CONTEXT(p);
     p = p1;
   }
 }
 
 #ifndef CBOR_NO_FLOAT
-static double decode_half(int half) {
-  int exp = (half >> 10) & 0x1f;
-  int mant = half & 0x3ff;
-  double val;
-  if (exp == 0) val = ldexp(mant, -24);
-  else if (exp != 31) val = ldexp(mant + 1024, exp - 25);
-  else val = mant == 0 ? INFINITY : NAN;
-  return half & 0x8000 ? -val : val;
+/* Every half is exactly a float, so widening only moves bits around;
+   subnormals take one multiplication, which is exact as well. */
+static float decode_half(uint16_t half) {
+#if defined(__F16C__)
+  return _cvtsh_ss(half);
+#else
+  union {
+    float f;
+    uint32_t u;
+  } u32;
+  uint32_t exp = (half >> 10) & 0x1f;
+  uint32_t mant = half & 0x3ff;
+
+  if (exp == 0)
+    u32.f = (float)mant * 0x1p-24f;
+  else if (exp == 31)
+    u32.u = 0x7f800000 | (mant << 13);
+  else
+    u32.u = ((exp + 112) << 23) | (mant << 13);
+  u32.u |= (uint32_t)(half & 0x8000) << 16;
+  return u32.f;
+#endif
+}
+
+void cn_cbor_half_array_decode(const uint8_t *buf, size_t count, float *out) {
+  size_t i = 0;
+
+#if defined(__F16C__)
+  const __m128i swap = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6,
+                                     9, 8, 11, 10, 13, 12, 15, 14);
+  __m128i h;
+
+  for (; i + 8 <= count; i += 8) {
+    h = _mm_loadu_si128((const __m128i *)(buf + 2 * i));
+    _mm256_storeu_ps(out + i, _mm256_cvtph_ps(_mm_shuffle_epi8(h, swap)));
+  }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  uint16x4_t h;
+
+  for (; i + 4 <= count; i += 4) {
+    h = vreinterpret_u16_u8(vrev16_u8(vld1_u8(buf + 2 * i)));
+    vst1q_f32(out + i, vcvt_f32_f16(vreinterpret_f16_u16(h)));
+  }
+#endif
+  for (; i < count; i++)
+    out[i] = decode_half((uint16_t)(buf[2 * i] << 8 | buf[2 * i + 1]));
 }
 #endif /* CBOR_NO_FLOAT */
 
@@ -53,7 +124,7 @@ static double decode_half(int half) {
 
 #ifndef CBOR_ALIGN_READS
 #define ntoh16p(p) (ntohs(*(unsigned short*)(p)))
-#define ntoh32p(p) (ntohl(*(unsigned long*)(p)))
+#define ntoh32p(p) (ntohl(*(uint32_t*)(p)))
 #else
 static uint16_t ntoh16p(unsigned char *p) {
     uint16_t tmp;
@@ -86,23 +157,439 @@ struct parse_buf {
   unsigned char *buf;
   unsigned char *ebuf;
   cn_cbor_error err;
+  unsigned char *start;
+  unsigned int flags;
+  /* Limits, with "no limit" turned into the largest value */
+  int max_depth;
+  size_t items_left;
+  size_t bytes_left;
+  uint64_t max_string_length;
+  int depth_seen;               /* the deepest item walk_item has seen */
+  size_t containers;            /* the items walk_item has seen that get
+                                   an end word on a tape */
+  const cn_cbor_keydict *keys;
+  int raw_depth;                /* 0 if nothing is kept raw */
+  /* The stringref table, for CN_CBOR_DECODE_STRINGREFS */
+  union stringref *refs;
+  size_t ref_size;
+  size_t ref_count;
+  size_t ref_base;              /* first string of the innermost namespace */
+  int ref_ns;                   /* number of open namespaces */
+  /* The keys seen so far, for CN_CBOR_DECODE_UNIQUE_KEYS */
+  struct key_slot *key_set;
+  size_t key_size;
+  size_t key_count;
+  uint32_t *key_stack;          /* running hashes of the open items of */
+  size_t key_stack_size;        /* the key being decoded, from the key */
+  int key_depth;                /* depth of that key, 0 if none */
+  /* The block nodes come from, for CN_CBOR_DECODE_ARENA */
+  struct arena_block *arena;
+  size_t arena_used;
+  /* Frames for raw subtrees deeper than walk_item goes */
+  struct walk_frame *walk_stack;
+  int walk_stack_size;
 };
 
+/* While a container is being filled, x.span holds the offset of its
+   initial byte; once it is complete, v.bytes and x.span describe the
+   whole encoding. */
+static void set_span(struct parse_buf *pb, cn_cbor *cb, unsigned char *end) {
+  cb->v.bytes = pb->start + cb->x.span;
+  cb->x.span = end - cb->v.bytes;
+  cb->flags |= CN_CBOR_FL_SPAN;
+}
+
+static uint32_t hash_text(const uint8_t *key, size_t len) {
+  uint32_t h = 2166136261u;     /* FNV-1a */
+  while (len--) {
+    h ^= *key++;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static uint32_t hash_int(int64_t key) {
+  uint64_t h = (uint64_t)key;
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  return (uint32_t)h;
+}
+
+/* The id of a text key in a dictionary, plus one, or UINT32_MAX. */
+static uint32_t keydict_lookup(const cn_cbor_keydict *dict,
+                               const uint8_t *key, size_t len) {
+  uint32_t h = hash_text(key, len);
+  unsigned int i = h & dict->mask;
+  const char *k;
+  int n;
+
+  while ((n = dict->index[i])) {
+    k = dict->keys[--n];
+    if (dict->hash[n] == h && strlen(k) == len && !memcmp(k, key, len))
+      return n + 1;
+    i = (i + 1) & dict->mask;
+  }
+  return UINT32_MAX;
+}
+
+bool cn_cbor_keydict_init(cn_cbor_keydict *dict,
+                          const char * const *keys,
+                          size_t count,
+                          cn_cbor_errback *errp) {
+  unsigned int i;
+  size_t n, len;
+
+  if (count > CN_CBOR_KEYDICT_MAX) {
+    if (errp) {errp->err = CN_CBOR_ERR_INVALID_PARAMETER;}
+    return false;
+  }
+  memset(dict, 0, sizeof(*dict));
+  dict->keys = keys;
+  for (dict->mask = 1; dict->mask < 2 * count; dict->mask <<= 1)
+    ;
+  dict->mask--;
+  for (n = 0; n < count; n++) {
+    len = strlen(keys[n]);
+    if (keydict_lookup(dict, (const uint8_t *)keys[n], len) != UINT32_MAX) {
+      if (errp) {errp->err = CN_CBOR_ERR_INVALID_PARAMETER;}
+      return false;
+    }
+    dict->hash[n] = hash_text((const uint8_t *)keys[n], len);
+    for (i = dict->hash[n] & dict->mask; dict->index[i];
+         i = (i + 1) & dict->mask)
+      ;
+    dict->index[i] = n + 1;
+    dict->count = n + 1;
+  }
+  return true;
+}
+
+int cn_cbor_keydict_find(const cn_cbor_keydict *dict, const char *key) {
+  uint32_t id = keydict_lookup(dict, (const uint8_t *)key, strlen(key));
+  return id == UINT32_MAX ? -1 : (int)id - 1;
+}
+
 #define TAKE(pos, ebuf, n, stmt)                \
   if (n > (size_t)(ebuf - pos))                 \
     CN_CBOR_FAIL(CN_CBOR_ERR_OUT_OF_DATA);      \
   stmt;                                         \
   pos += n;
 
-static cn_cbor *decode_item (struct parse_buf *pb CBOR_CONTEXT, cn_cbor* top_parent) {
+/* Decode the head at pb->buf and step over it.  On failure, pb->buf is
+   where the error was found. */
+static bool take_head(struct parse_buf *pb, cn_cbor_head *head) {
   unsigned char *pos = pb->buf;
   unsigned char *ebuf = pb->ebuf;
-  cn_cbor* parent = top_parent;
   int ib;
-  unsigned int mt;
-  int ai;
-  uint64_t val;
-  cn_cbor* cb = NULL;
+
+  TAKE(pos, ebuf, 1, ib = ntoh8p(pos));
+  head->mt = ib >> 5;
+  head->ai = ib & 0x1f;
+  head->val = head->ai;
+  switch (head->ai) {
+  case AI_1: TAKE(pos, ebuf, 1, head->val = ntoh8p(pos)); break;
+  case AI_2: TAKE(pos, ebuf, 2, head->val = ntoh16p(pos)); break;
+  case AI_4: TAKE(pos, ebuf, 4, head->val = ntoh32p(pos)); break;
+  case AI_8: TAKE(pos, ebuf, 8, head->val = ntoh64p(pos)); break;
+  case 28: case 29: case 30: CN_CBOR_FAIL(CN_CBOR_ERR_RESERVED_AI);
+  case AI_INDEF:
+    if (head->mt == MT_UNSIGNED || head->mt == MT_NEGATIVE ||
+        head->mt == MT_TAG)
+      CN_CBOR_FAIL(CN_CBOR_ERR_MT_UNDEF_FOR_INDEF);
+  }
+  pb->buf = pos;
+  return true;
+fail:
+  pb->buf = pos;
+  return false;
+}
+
+/* One entry of the stringref table: a string, or the base of the
+   enclosing namespace, stored just before the strings of a nested one. */
+union stringref {
+  const cn_cbor *cb;
+  size_t base;
+};
+
+static bool stringref_push(struct parse_buf *pb, union stringref entry
+                           CBOR_CONTEXT) {
+  union stringref *refs;
+  size_t size;
+
+  if (pb->ref_count == pb->ref_size) {
+    size = pb->ref_size ? 2 * pb->ref_size : 16;
+    if (pb->bytes_left < size * sizeof(*refs)) {
+      pb->err = CN_CBOR_ERR_MAX_BYTES;
+      return false;
+    }
+    refs = CN_CALLOC_N_CONTEXT(size, sizeof(*refs));
+    if (!refs) {
+      pb->err = CN_CBOR_ERR_OUT_OF_MEMORY;
+      return false;
+    }
+    pb->bytes_left -= size * sizeof(*refs);
+    if (pb->refs) {
+      memcpy(refs, pb->refs, pb->ref_count * sizeof(*refs));
+      CN_CBOR_FREE_CONTEXT(pb->refs);
+    }
+    pb->refs = refs;
+    pb->ref_size = size;
+  }
+  pb->refs[pb->ref_count++] = entry;
+  return true;
+}
+
+static void intern_key(struct parse_buf *pb, const cn_cbor *parent,
+                       cn_cbor *cb) {
+  if (pb->keys && cb->type == CN_CBOR_TEXT &&
+      parent->type == CN_CBOR_MAP && (parent->length & 1))
+    cb->x.key_id = keydict_lookup(pb->keys, cb->v.bytes, cb->length);
+}
+
+/* A map key, for CN_CBOR_DECODE_UNIQUE_KEYS.  The keys of all maps in
+   the input share one table, so a key only matches the keys that have
+   the same parent. */
+struct key_slot {
+  const cn_cbor *key;
+  uint32_t hash;
+};
+
+static bool keyset_grow(struct parse_buf *pb CBOR_CONTEXT) {
+  struct key_slot *slots;
+  size_t size = pb->key_size ? 2 * pb->key_size : 16;
+  size_t i, j;
+
+  if (pb->bytes_left < size * sizeof(*slots)) {
+    pb->err = CN_CBOR_ERR_MAX_BYTES;
+    return false;
+  }
+  slots = CN_CALLOC_N_CONTEXT(size, sizeof(*slots));
+  if (!slots) {
+    pb->err = CN_CBOR_ERR_OUT_OF_MEMORY;
+    return false;
+  }
+  pb->bytes_left -= size * sizeof(*slots);
+  for (i = 0; i < pb->key_size; i++) {
+    if (!pb->key_set[i].key)
+      continue;
+    for (j = pb->key_set[i].hash & (size - 1); slots[j].key;
+         j = (j + 1) & (size - 1))
+      ;
+    slots[j] = pb->key_set[i];
+  }
+  if (pb->key_set) {
+    CN_CBOR_FREE_CONTEXT(pb->key_set);
+  }
+  pb->key_set = slots;
+  pb->key_size = size;
+  return true;
+}
+
+/* A string key hashes and compares by its content, whether or not it
+   is chunked; a container key by its items, in order. */
+static bool key_is_string(const cn_cbor *cb) {
+  return cb->type >= CN_CBOR_BYTES && cb->type <= CN_CBOR_TEXT_CHUNKED;
+}
+
+static bool key_is_text(const cn_cbor *cb) {
+  return cb->type == CN_CBOR_TEXT || cb->type == CN_CBOR_TEXT_CHUNKED;
+}
+
+static bool key_is_container(const cn_cbor *cb) {
+  return cb->type == CN_CBOR_ARRAY || cb->type == CN_CBOR_MAP ||
+    cb->type == CN_CBOR_TAG;
+}
+
+static uint32_t key_hash_bytes(uint32_t h, const cn_cbor *cb) {
+  int i;
+
+  for (i = 0; i < cb->length; i++) {
+    h ^= cb->v.bytes[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+/* The hash an item starts with, before its bytes or items are added */
+static uint32_t key_seed(const cn_cbor *cb) {
+  if (key_is_string(cb))
+    return hash_int(key_is_text(cb));
+  if (cb->type == CN_CBOR_TAG)
+    return hash_int(cb->type) ^ hash_int((int64_t)cb->v.uint) * 31;
+  return hash_int(cb->type);
+}
+
+static bool key_stack_grow(struct parse_buf *pb CBOR_CONTEXT) {
+  uint32_t *stack;
+  size_t size = pb->key_stack_size ? 2 * pb->key_stack_size : 16;
+
+  if (pb->bytes_left < size * sizeof(*stack)) {
+    pb->err = CN_CBOR_ERR_MAX_BYTES;
+    return false;
+  }
+  stack = CN_CALLOC_N_CONTEXT(size, sizeof(*stack));
+  if (!stack) {
+    pb->err = CN_CBOR_ERR_OUT_OF_MEMORY;
+    return false;
+  }
+  pb->bytes_left -= size * sizeof(*stack);
+  if (pb->key_stack) {
+    memcpy(stack, pb->key_stack, pb->key_stack_size * sizeof(*stack));
+    CN_CBOR_FREE_CONTEXT(pb->key_stack);
+  }
+  pb->key_stack = stack;
+  pb->key_stack_size = size;
+  return true;
+}
+
+/* Items equal as keys.  Containers are compared item by item, without
+   recursion; strings (chunked or not) and other items on their own. */
+static bool key_equal_item(const cn_cbor *a, const cn_cbor *b) {
+  if (key_is_container(a) || key_is_container(b))
+    return a->type == b->type && a->length == b->length &&
+      (a->type != CN_CBOR_TAG || a->v.uint == b->v.uint);
+  return cn_cbor_equal(a, b);
+}
+
+static bool key_equal(const cn_cbor *a, const cn_cbor *b) {
+  const cn_cbor *pa = a;
+  const cn_cbor *pb = b;
+
+  for (;;) {
+    if (!key_equal_item(pa, pb))
+      return false;
+    if (key_is_container(pa) && pa->first_child) { /* go down */
+      pa = pa->first_child;
+      pb = pb->first_child;
+      continue;
+    }
+    while (pa != a && !pa->next) { /* go up; equal lengths keep b along */
+      pa = pa->parent;
+      pb = pb->parent;
+    }
+    if (pa == a)
+      return true;
+    pa = pa->next;
+    pb = pb->next;
+  }
+}
+
+/* Add a completed key to the set, failing if its map already has it. */
+static bool keyset_add(struct parse_buf *pb, const cn_cbor *cb, uint32_t h
+                       CBOR_CONTEXT) {
+  const cn_cbor *key;
+  size_t i;
+
+  if (2 * (pb->key_count + 1) > pb->key_size &&
+      !keyset_grow(pb CBOR_CONTEXT_PARAM))
+    return false;
+  h ^= hash_int((int64_t)(uintptr_t)cb->parent);
+  for (i = h & (pb->key_size - 1); (key = pb->key_set[i].key);
+       i = (i + 1) & (pb->key_size - 1)) {
+    if (pb->key_set[i].hash == h && key->parent == cb->parent &&
+        key_equal(key, cb)) {
+      pb->err = CN_CBOR_ERR_DUPLICATE_KEY;
+      return false;
+    }
+  }
+  pb->key_set[i].key = cb;
+  pb->key_set[i].hash = h;
+  pb->key_count++;
+  return true;
+}
+
+static bool key_is_key(const cn_cbor *parent) {
+  return parent->type == CN_CBOR_MAP && (parent->length & 1);
+}
+
+/* A container or chunked string is starting at `depth`: if it is, or
+   is in, a key, start its hash. */
+static bool key_push(struct parse_buf *pb, const cn_cbor *parent,
+                     const cn_cbor *cb, int depth CBOR_CONTEXT) {
+  size_t i;
+
+  if (!pb->key_depth) {
+    if (!key_is_key(parent))
+      return true;
+    pb->key_depth = depth;
+  }
+  i = depth - pb->key_depth;
+  if (i == pb->key_stack_size && !key_stack_grow(pb CBOR_CONTEXT_PARAM))
+    return false;
+  pb->key_stack[i] = key_seed(cb);
+  return true;
+}
+
+/* An item at `depth` is complete: check it if it is a key, and add it
+   to the hash of its parent if that is in a key.  Each item is hashed
+   once, so keys nested in keys cost no more than any other input. */
+static bool key_fill(struct parse_buf *pb, const cn_cbor *parent,
+                     const cn_cbor *cb, int depth CBOR_CONTEXT) {
+  bool is_key = key_is_key(parent);
+  uint32_t h, *ph;
+
+  if (!is_key && !pb->key_depth)
+    return true;
+  if (pb->key_depth && depth > pb->key_depth && key_is_string(parent)) {
+    ph = &pb->key_stack[depth - 1 - pb->key_depth];
+    *ph = key_hash_bytes(*ph, cb);      /* a chunk */
+    return true;
+  }
+  if (pb->key_depth && depth >= pb->key_depth &&
+      ((cb->flags & (CN_CBOR_FL_COUNT | CN_CBOR_FL_INDEF)) ||
+       cb->type == CN_CBOR_TAG))
+    h = pb->key_stack[depth - pb->key_depth];
+  else if (key_is_string(cb))
+    h = key_hash_bytes(key_seed(cb), cb);
+  else if (key_is_container(cb))
+    h = key_seed(cb);
+  else
+    h = (uint32_t)cn_cbor_hash(cb);
+  if (is_key && !keyset_add(pb, cb, h CBOR_CONTEXT_PARAM))
+    return false;
+  if (pb->key_depth && depth > pb->key_depth) {
+    ph = &pb->key_stack[depth - 1 - pb->key_depth];
+    *ph = (*ph ^ h) * 16777619u;
+  } else if (depth == pb->key_depth) {
+    pb->key_depth = 0;
+  }
+  return true;
+}
+
+/* A bignum's content: an ordinary integer if it fits, and otherwise
+   the magnitude without its leading zeros. */
+static void set_bignum(cn_cbor *cb, bool negative, const uint8_t *p,
+                       size_t len) {
+  uint64_t val = 0;
+  size_t i;
+
+  while (len && !*p) {
+    p++;
+    len--;
+  }
+  if (len <= 8) {
+    for (i = 0; i < len; i++)
+      val = val << 8 | p[i];
+    if (!negative) {
+      cb->type = CN_CBOR_UINT;
+      cb->v.uint = val;
+      return;
+    }
+    if (val <= INT64_MAX) {
+      cb->type = CN_CBOR_INT;
+      cb->v.sint = ~val;
+      return;
+    }
+  }
+  cb->type = negative ? CN_CBOR_NEGBIGNUM : CN_CBOR_BIGNUM;
+  cb->v.bytes = p;
+  cb->length = len;
+}
+
+/* Fill in a node for a major type 7 item.  Returns false for a float
+   if they are not supported. */
+static bool set_prim(cn_cbor *cb, int ai, uint64_t val, unsigned int flags) {
 #ifndef CBOR_NO_FLOAT
   union {
     float f;
@@ -114,32 +601,126 @@ static cn_cbor *decode_item (struct parse_buf *pb CBOR_CONTEXT, cn_cbor* top_par
   } u64;
 #endif /* CBOR_NO_FLOAT */
 
-again:
-  TAKE(pos, ebuf, 1, ib = ntoh8p(pos) );
-  if (ib == IB_BREAK) {
-    if (!(parent->flags & CN_CBOR_FL_INDEF))
-      CN_CBOR_FAIL(CN_CBOR_ERR_BREAK_OUTSIDE_INDEF);
-    switch (parent->type) {
-    case CN_CBOR_BYTES: case CN_CBOR_TEXT:
-      parent->type += 2;            /* CN_CBOR_* -> CN_CBOR_*_CHUNKED */
-      break;
-    case CN_CBOR_MAP:
-      if (parent->length & 1)
-        CN_CBOR_FAIL(CN_CBOR_ERR_ODD_SIZE_INDEF_MAP);
-    default:;
+  switch (ai) {
+  case VAL_FALSE: cb->type = CN_CBOR_FALSE; break;
+  case VAL_TRUE:  cb->type = CN_CBOR_TRUE;  break;
+  case VAL_NIL:   cb->type = CN_CBOR_NULL;  break;
+  case VAL_UNDEF: cb->type = CN_CBOR_UNDEF; break;
+#ifndef CBOR_NO_FLOAT
+  case AI_2:
+    u32.f = decode_half(val);
+    goto single;
+  case AI_4:
+    u32.u = val;
+  single:
+    if (flags & CN_CBOR_DECODE_FLOATS) {
+      cb->type = CN_CBOR_FLOAT;
+      cb->v.f = u32.f;
+    } else {
+      cb->type = CN_CBOR_DOUBLE;
+      cb->v.dbl = u32.f;
     }
-    goto complete;
+    break;
+  case AI_8:
+    cb->type = CN_CBOR_DOUBLE;
+    u64.u = val;
+    cb->v.dbl = u64.d;
+    break;
+#else /*  CBOR_NO_FLOAT */
+  case AI_2: case AI_4: case AI_8:
+    (void)flags;
+    return false;
+#endif /*  CBOR_NO_FLOAT */
+  default: cb->v.uint = val;
   }
-  mt = ib >> 5;
-  ai = ib & 0x1f;
-  val = ai;
+  return true;
+}
 
-  cb = CN_CALLOC_CONTEXT();
-  if (!cb)
-    CN_CBOR_FAIL(CN_CBOR_ERR_OUT_OF_MEMORY);
+/* Each block is twice the size of the one before, but never larger than
+   the number of items that the `left` bytes of input after the current
+   one could hold. */
+static cn_cbor *alloc_node(struct parse_buf *pb, size_t left
+                           CBOR_CONTEXT) {
+  struct arena_block *block;
+  size_t count;
 
-  cb->type = mt_trans[mt];
+  if (!(pb->flags & CN_CBOR_DECODE_ARENA))
+    return CN_CALLOC_CONTEXT();
+  if (!pb->arena || pb->arena_used == pb->arena->count) {
+    count = pb->arena ? 2 * pb->arena->count : 32;
+    if (count > left + 1)
+      count = left + 1;
+    block = CN_CALLOC_N_CONTEXT(1, sizeof(*block) + count * sizeof(cn_cbor));
+    if (!block)
+      return NULL;
+    block->count = count;
+    if (pb->arena) {
+      block->next = pb->arena->next;  /* string blocks, for decode_iov */
+      pb->arena->next = block;
+    } else {
+      block->nodes[0].flags = CN_CBOR_FL_ARENA;
+    }
+    pb->arena = block;
+    pb->arena_used = 0;
+  }
+  return &pb->arena->nodes[pb->arena_used++];
+}
+
+static bool walk_item(struct parse_buf *pb);
+static bool walk_raw(struct parse_buf *pb CBOR_CONTEXT);
+
+/* The steps of decoding one item that decode_item and decode_iov_item
+   share; each fails with pb->err set. */
+
+/* A break ends the indefinite length item `parent`. */
+static bool end_indef(struct parse_buf *pb, cn_cbor *parent) {
+  if (!(parent->flags & CN_CBOR_FL_INDEF)) {
+    pb->err = CN_CBOR_ERR_BREAK_OUTSIDE_INDEF;
+    return false;
+  }
+  switch (parent->type) {
+  case CN_CBOR_BYTES: case CN_CBOR_TEXT:
+    parent->type += 2;            /* CN_CBOR_* -> CN_CBOR_*_CHUNKED */
+    break;
+  case CN_CBOR_MAP:
+    if (parent->length & 1) {
+      pb->err = CN_CBOR_ERR_ODD_SIZE_INDEF_MAP;
+      return false;
+    }
+  default:;
+  }
+  return true;
+}
+
+/* A node for an item of major type `mt` at `depth`, within the limits,
+   added as the last child of `parent`.  `left` is the number of bytes
+   of input after its initial byte. */
+static cn_cbor *add_node(struct parse_buf *pb, cn_cbor *parent,
+                         unsigned int mt, int depth, size_t left
+                         CBOR_CONTEXT) {
+  cn_cbor *cb;
+
+  if (depth > pb->max_depth) {
+    pb->err = CN_CBOR_ERR_MAX_DEPTH;
+    return NULL;
+  }
+  if (!pb->items_left) {
+    pb->err = CN_CBOR_ERR_MAX_ITEMS;
+    return NULL;
+  }
+  if (pb->bytes_left < sizeof(cn_cbor)) {
+    pb->err = CN_CBOR_ERR_MAX_BYTES;
+    return NULL;
+  }
+  pb->items_left--;
+  pb->bytes_left -= sizeof(cn_cbor);
 
+  cb = alloc_node(pb, left CBOR_CONTEXT_PARAM);
+  if (!cb) {
+    pb->err = CN_CBOR_ERR_OUT_OF_MEMORY;
+    return NULL;
+  }
+  cb->type = mt_trans[mt];
   cb->parent = parent;
   if (parent->last_child) {
     parent->last_child->next = cb;
@@ -148,6 +729,96 @@ again:
   }
   parent->last_child = cb;
   parent->length++;
+  return cb;
+}
+
+/* An array or map of `val` items or pairs; true if it has any, and
+   so is to be filled. */
+static bool set_count(cn_cbor *cb, unsigned int mt, uint64_t val) {
+  if (mt == MT_MAP)
+    val <<= 1;
+  if ((cb->v.count = val)) {
+    cb->flags |= CN_CBOR_FL_COUNT;
+    return true;
+  }
+  return false;
+}
+
+/* `cb` is complete: check it against `parent` and, if it is a key,
+   against the other keys. */
+static bool fill_node(struct parse_buf *pb, cn_cbor *parent,
+                      const cn_cbor *cb, int depth CBOR_CONTEXT) {
+  if ((pb->flags & CN_CBOR_DECODE_UNIQUE_KEYS) &&
+      !key_fill(pb, parent, cb, depth CBOR_CONTEXT_PARAM))
+    return false;
+  if ((parent->flags & CN_CBOR_FL_INDEF) &&
+      (parent->type == CN_CBOR_BYTES || parent->type == CN_CBOR_TEXT) &&
+      cb->type != parent->type) {
+    pb->err = CN_CBOR_ERR_WRONG_NESTING_IN_INDEF_STRING;
+    return false;
+  }
+  return true;
+}
+
+/* Whether `parent` takes another item after the one just filled in */
+static bool more_items(cn_cbor *parent) {
+  if (parent->flags & CN_CBOR_FL_INDEF)
+    return true;
+  return (parent->flags & CN_CBOR_FL_COUNT) && --parent->v.count;
+}
+
+static cn_cbor *decode_item (struct parse_buf *pb CBOR_CONTEXT, cn_cbor* top_parent) {
+  unsigned char *pos = pb->buf;
+  unsigned char *ebuf = pb->ebuf;
+  cn_cbor* parent = top_parent;
+  int ib;
+  unsigned int mt;
+  int ai;
+  uint64_t val;
+  cn_cbor* cb = NULL;
+  int depth = 0;
+  cn_cbor_head ref;
+  union stringref entry;
+  bool ok;
+
+again:
+  TAKE(pos, ebuf, 1, ib = ntoh8p(pos) );
+  if (ib == IB_BREAK) {
+    if (!end_indef(pb, parent))
+      goto fail;
+    goto complete;
+  }
+  mt = ib >> 5;
+  ai = ib & 0x1f;
+  val = ai;
+
+  cb = add_node(pb, parent, mt, depth, ebuf - pos CBOR_CONTEXT_PARAM);
+  if (!cb)
+    goto fail;
+  if ((pb->flags & CN_CBOR_DECODE_SPANS) && !pb->ref_ns &&
+      (mt == MT_ARRAY || mt == MT_MAP))
+    cb->x.span = pos - 1 - pb->start;
+
+  if (pb->raw_depth && depth == pb->raw_depth && !pb->ref_ns &&
+      (mt == MT_ARRAY || mt == MT_MAP || mt == MT_TAG)) {
+    /* walk_item counts this item again, from depth 0 */
+    pb->items_left++;
+    pb->bytes_left += sizeof(cn_cbor);
+    pb->max_depth -= depth;
+    pb->buf = pos - 1;
+    ok = walk_raw(pb CBOR_CONTEXT_PARAM);
+    pb->max_depth += depth;
+    if (!ok) {
+      pos = pb->buf;
+      goto fail;
+    }
+    cb->type = CN_CBOR_RAW;
+    cb->v.bytes = pos - 1;
+    cb->length = pb->buf - (pos - 1);
+    cb->x.span = 0;
+    pos = pb->buf;
+    goto fill;
+  }
 
   switch (ai) {
   case AI_1: TAKE(pos, ebuf, 1, val = ntoh8p(pos)) ; break;
@@ -156,7 +827,7 @@ again:
   case AI_8: TAKE(pos, ebuf, 8, val = ntoh64p(pos)) ; break;
   case 28: case 29: case 30: CN_CBOR_FAIL(CN_CBOR_ERR_RESERVED_AI);
   case AI_INDEF:
-    if ((mt - MT_BYTES) <= MT_MAP) {
+    if (mt >= MT_BYTES && mt <= MT_MAP) {
       cb->flags |= CN_CBOR_FL_INDEF;
       goto push;
     } else {
@@ -166,74 +837,94 @@ again:
   // process content
   switch (mt) {
   case MT_UNSIGNED:
-    cb->v.uint = val;           /* to do: Overflow check */
+    cb->v.uint = val;
     break;
   case MT_NEGATIVE:
-    cb->v.sint = ~val;          /* to do: Overflow check */
+    if (val > INT64_MAX) {      /* the argument itself is the number */
+      cb->type = CN_CBOR_NEGBIGNUM;
+      cb->v.bytes = pos - 8;
+      cb->length = 8;
+    } else {
+      cb->v.sint = ~val;
+    }
     break;
   case MT_BYTES: case MT_TEXT:
+    if (val > pb->max_string_length)
+      CN_CBOR_FAIL(CN_CBOR_ERR_MAX_STRING_LENGTH);
     cb->v.str = (char *) pos;
     cb->length = val;
     TAKE(pos, ebuf, val, ;);
+    intern_key(pb, parent, cb);
+    if (pb->ref_ns && !((parent->flags & CN_CBOR_FL_INDEF) &&
+                        parent->type == cb->type) &&
+        STRINGREF_WORTHY(pb->ref_count - pb->ref_base, val)) {
+      entry.cb = cb;
+      if (!stringref_push(pb, entry CBOR_CONTEXT_PARAM))
+        goto fail;
+    }
     break;
-  case MT_MAP:
-    val <<= 1;
-    /* fall through */
-  case MT_ARRAY:
-    if ((cb->v.count = val)) {
-      cb->flags |= CN_CBOR_FL_COUNT;
+  case MT_ARRAY: case MT_MAP:
+    if (set_count(cb, mt, val))
       goto push;
-    }
+    if ((pb->flags & CN_CBOR_DECODE_SPANS) && !pb->ref_ns)
+      set_span(pb, cb, pos);
     break;
   case MT_TAG:
     cb->v.uint = val;
+    if ((pb->flags & CN_CBOR_DECODE_BIGNUMS) && !pb->ref_ns &&
+        (val == TAG_BIGNUM || val == TAG_BIGNUM_NEG)) {
+      pb->buf = pos;
+      if (take_head(pb, &ref) && ref.mt == MT_BYTES && ref.ai != AI_INDEF) {
+        if (ref.val > pb->max_string_length)
+          CN_CBOR_FAIL(CN_CBOR_ERR_MAX_STRING_LENGTH);
+        pos = pb->buf;
+        TAKE(pos, ebuf, ref.val, ;);
+        set_bignum(cb, val == TAG_BIGNUM_NEG, pos - ref.val, ref.val);
+        break;
+      }
+      /* anything else stays a tag */
+    }
+    if (pb->flags & CN_CBOR_DECODE_STRINGREFS) {
+      if (val == TAG_STRINGREF && pb->ref_ns) {
+        /* resolve to the string it refers to, without a child */
+        if ((parent->flags & CN_CBOR_FL_INDEF) &&
+            (parent->type == CN_CBOR_BYTES || parent->type == CN_CBOR_TEXT))
+          CN_CBOR_FAIL(CN_CBOR_ERR_WRONG_NESTING_IN_INDEF_STRING);
+        pb->buf = pos;
+        if (!take_head(pb, &ref)) {
+          pos = pb->buf;
+          goto fail;
+        }
+        if (ref.mt != MT_UNSIGNED ||
+            ref.val >= pb->ref_count - pb->ref_base)
+          CN_CBOR_FAIL(CN_CBOR_ERR_INVALID_STRINGREF);
+        pos = pb->buf;
+        entry = pb->refs[pb->ref_base + ref.val];
+        cb->type = entry.cb->type;
+        cb->v = entry.cb->v;
+        cb->length = entry.cb->length;
+        intern_key(pb, parent, cb);
+        break;
+      }
+      if (val == TAG_STRINGREF_NS) {
+        entry.base = pb->ref_base;
+        if (!stringref_push(pb, entry CBOR_CONTEXT_PARAM))
+          goto fail;
+        pb->ref_base = pb->ref_count;
+        pb->ref_ns++;
+      }
+    }
     goto push;
   case MT_PRIM:
-    switch (ai) {
-    case VAL_FALSE: cb->type = CN_CBOR_FALSE; break;
-    case VAL_TRUE:  cb->type = CN_CBOR_TRUE;  break;
-    case VAL_NIL:   cb->type = CN_CBOR_NULL;  break;
-    case VAL_UNDEF: cb->type = CN_CBOR_UNDEF; break;
-    case AI_2:
-#ifndef CBOR_NO_FLOAT
-      cb->type = CN_CBOR_DOUBLE;
-      cb->v.dbl = decode_half(val);
-#else /*  CBOR_NO_FLOAT */
-      CN_CBOR_FAIL(CN_CBOR_ERR_FLOAT_NOT_SUPPORTED);
-#endif /*  CBOR_NO_FLOAT */
-      break;
-    case AI_4:
-#ifndef CBOR_NO_FLOAT
-      cb->type = CN_CBOR_DOUBLE;
-      u32.u = val;
-      cb->v.dbl = u32.f;
-#else /*  CBOR_NO_FLOAT */
-      CN_CBOR_FAIL(CN_CBOR_ERR_FLOAT_NOT_SUPPORTED);
-#endif /*  CBOR_NO_FLOAT */
-      break;
-    case AI_8:
-#ifndef CBOR_NO_FLOAT
-      cb->type = CN_CBOR_DOUBLE;
-      u64.u = val;
-      cb->v.dbl = u64.d;
-#else /*  CBOR_NO_FLOAT */
+    if (!set_prim(cb, ai, val, pb->flags))
       CN_CBOR_FAIL(CN_CBOR_ERR_FLOAT_NOT_SUPPORTED);
-#endif /*  CBOR_NO_FLOAT */
-      break;
-    default: cb->v.uint = val;
-    }
+    break;
   }
 fill:                           /* emulate loops */
-  if (parent->flags & CN_CBOR_FL_INDEF) {
-    if (parent->type == CN_CBOR_BYTES || parent->type == CN_CBOR_TEXT)
-      if (cb->type != parent->type)
-          CN_CBOR_FAIL(CN_CBOR_ERR_WRONG_NESTING_IN_INDEF_STRING);
+  if (!fill_node(pb, parent, cb, depth CBOR_CONTEXT_PARAM))
+    goto fail;
+  if (more_items(parent))
     goto again;
-  }
-  if (parent->flags & CN_CBOR_FL_COUNT) {
-    if (--parent->v.count)
-      goto again;
-  }
   /* so we are done filling parent. */
 complete:                       /* emulate return from call */
   if (parent == top_parent) {
@@ -244,25 +935,112 @@ complete:                       /* emulate return from call */
   }
   cb = parent;
   parent = parent->parent;
+  depth--;
+  if (pb->ref_ns && cb->type == CN_CBOR_TAG &&
+      cb->v.uint == TAG_STRINGREF_NS) {
+    pb->ref_count = pb->ref_base - 1;
+    pb->ref_base = pb->refs[pb->ref_count].base;
+    pb->ref_ns--;
+  }
+  if ((pb->flags & CN_CBOR_DECODE_SPANS) && !pb->ref_ns &&
+      (cb->type == CN_CBOR_ARRAY || cb->type == CN_CBOR_MAP))
+    set_span(pb, cb, pos);
   goto fill;
 push:                           /* emulate recursive call */
+  if ((pb->flags & CN_CBOR_DECODE_UNIQUE_KEYS) &&
+      !key_push(pb, parent, cb, depth CBOR_CONTEXT_PARAM))
+    goto fail;
   parent = cb;
+  depth++;
   goto again;
 fail:
   pb->buf = pos;
   return 0;
 }
 
-cn_cbor* cn_cbor_decode(const unsigned char* buf, size_t len CBOR_CONTEXT, cn_cbor_errback *errp) {
-  cn_cbor catcher = {CN_CBOR_INVALID, 0, {0}, 0, NULL, NULL, NULL, NULL};
-  struct parse_buf pb;
+/* Turn "no limit" into the largest value */
+static void set_limits(struct parse_buf *pb, const cn_cbor_limits *limits) {
+  pb->max_depth = INT_MAX;
+  pb->items_left = SIZE_MAX;
+  pb->bytes_left = SIZE_MAX;
+  pb->max_string_length = UINT64_MAX;
+  if (limits) {
+    if (limits->max_depth > 0)
+      pb->max_depth = limits->max_depth;
+    if (limits->max_items)
+      pb->items_left = limits->max_items;
+    if (limits->max_bytes)
+      pb->bytes_left = limits->max_bytes;
+    if (limits->max_string_length)
+      pb->max_string_length = limits->max_string_length;
+  }
+}
+
+cn_cbor* cn_cbor_decode(const unsigned char* buf, size_t len CBOR_CONTEXT, cn_cbor_errback *errp) {
+  return cn_cbor_decode_opts(buf, len, NULL CBOR_CONTEXT_PARAM, errp);
+}
+
+cn_cbor* cn_cbor_decode_limited(const uint8_t *buf, size_t len,
+                                const cn_cbor_limits *limits
+                                CBOR_CONTEXT,
+                                cn_cbor_errback *errp) {
+  cn_cbor_decode_options opts = {limits, 0, NULL, 0};
+  return cn_cbor_decode_opts(buf, len, &opts CBOR_CONTEXT_PARAM, errp);
+}
+
+cn_cbor* cn_cbor_decode_opts(const uint8_t *buf, size_t len,
+                             const cn_cbor_decode_options *opts
+                             CBOR_CONTEXT,
+                             cn_cbor_errback *errp) {
+  const cn_cbor_limits *limits = opts ? opts->limits : NULL;
+  cn_cbor catcher = {CN_CBOR_INVALID, 0, {0}, 0, NULL, NULL, NULL, NULL, {0}};
+  struct parse_buf pb;
   cn_cbor* ret;
 
   pb.buf  = (unsigned char *)buf;
   pb.ebuf = (unsigned char *)buf+len;
   pb.err  = CN_CBOR_NO_ERROR;
+  pb.start = (unsigned char *)buf;
+  pb.flags = opts ? opts->flags : 0;
+  pb.keys = opts ? opts->keys : NULL;
+  pb.raw_depth = opts && opts->raw_depth > 0 ? opts->raw_depth : 0;
+  pb.refs = NULL;
+  pb.ref_size = pb.ref_count = pb.ref_base = 0;
+  pb.ref_ns = 0;
+  pb.key_set = NULL;
+  pb.key_size = pb.key_count = 0;
+  pb.key_stack = NULL;
+  pb.key_stack_size = 0;
+  pb.key_depth = 0;
+  pb.arena = NULL;
+  pb.arena_used = 0;
+  pb.walk_stack = NULL;
+  pb.walk_stack_size = 0;
+  pb.depth_seen = 0;
+  pb.containers = 0;
+  if (len > UINT32_MAX)         /* spans are stored in 32 bits */
+    pb.flags &= ~CN_CBOR_DECODE_SPANS;
+  if (len > INT_MAX)            /* and raw values in `length` */
+    pb.raw_depth = 0;
+  set_limits(&pb, limits);
   ret = decode_item(&pb CBOR_CONTEXT_PARAM, &catcher);
+  if (pb.refs) {
+    CN_CBOR_FREE_CONTEXT(pb.refs);
+  }
+  if (pb.key_set) {
+    CN_CBOR_FREE_CONTEXT(pb.key_set);
+  }
+  if (pb.key_stack) {
+    CN_CBOR_FREE_CONTEXT(pb.key_stack);
+  }
+  if (pb.walk_stack) {
+    CN_CBOR_FREE_CONTEXT(pb.walk_stack);
+  }
   if (ret != NULL) {
+    /* The root is the catcher's only child.  Taking it from there rather
+       than from the return value lets the compiler see that no pointer
+       to the catcher escapes. */
+    ret = catcher.first_child;
     /* mark as top node */
     ret->parent = NULL;
   } else {
@@ -280,6 +1058,1013 @@ cn_cbor* cn_cbor_decode(const unsigned char* buf, size_t len CBOR_CONTEXT, cn_cb
   return ret;
 }
 
+/* Input in fragments, for cn_cbor_decode_iov */
+struct iov_input {
+  const struct iovec *iov;      /* the current fragment */
+  size_t at;                    /* the offset in it */
+  size_t offset;                /* the offset in the whole input */
+  size_t len;                   /* the length of the whole input */
+};
+
+/* Step over used up and empty fragments; some input must be left. */
+static void iov_settle(struct iov_input *in) {
+  while (in->at == in->iov->iov_len) {
+    in->iov++;
+    in->at = 0;
+  }
+}
+
+/* Copy the next n bytes, which must be there, across fragments. */
+static void iov_copy(struct iov_input *in, uint8_t *out, size_t n) {
+  size_t k;
+
+  while (n) {
+    iov_settle(in);
+    k = in->iov->iov_len - in->at;
+    if (k > n)
+      k = n;
+    memcpy(out, (const uint8_t *)in->iov->iov_base + in->at, k);
+    out += k;
+    n -= k;
+    in->at += k;
+    in->offset += k;
+  }
+}
+
+/* The next n (at most 8) bytes as a big-endian number */
+static uint64_t iov_take_uint(struct iov_input *in, int n) {
+  uint8_t tmp[8];
+  uint64_t val = 0;
+  int i;
+
+  iov_copy(in, tmp, n);
+  for (i = 0; i < n; i++)
+    val = val << 8 | tmp[i];
+  return val;
+}
+
+/* The next len bytes, which must be there: in place if they are in one
+   fragment, and otherwise copied into a block of their own, which is
+   freed with the arena. */
+static const uint8_t *iov_take_string(struct parse_buf *pb,
+                                      struct iov_input *in, size_t len
+                                      CBOR_CONTEXT) {
+  struct arena_block *block;
+  const uint8_t *p;
+
+  if (len)
+    iov_settle(in);
+  p = (const uint8_t *)in->iov->iov_base + in->at;
+  if (len <= in->iov->iov_len - in->at) {
+    in->at += len;
+    in->offset += len;
+    return p;
+  }
+  if (pb->bytes_left < len) {
+    pb->err = CN_CBOR_ERR_MAX_BYTES;
+    return NULL;
+  }
+  block = CN_CALLOC_N_CONTEXT(1, sizeof(*block) + len);
+  if (!block) {
+    pb->err = CN_CBOR_ERR_OUT_OF_MEMORY;
+    return NULL;
+  }
+  pb->bytes_left -= len;
+  block->next = pb->arena->next;
+  pb->arena->next = block;
+  iov_copy(in, (uint8_t *)block->nodes, len);
+  return (const uint8_t *)block->nodes;
+}
+
+#define IOV_TAKE(n, stmt)                         \
+  if ((n) > in->len - in->offset)                 \
+    CN_CBOR_FAIL(CN_CBOR_ERR_OUT_OF_DATA);        \
+  stmt;
+
+/* decode_item, reading from fragments.  Nodes always come from an
+   arena, which also holds the strings that cross fragments. */
+static cn_cbor *decode_iov_item(struct parse_buf *pb, struct iov_input *in
+                                CBOR_CONTEXT, cn_cbor *top_parent) {
+  struct iov_input mark;
+  cn_cbor* parent = top_parent;
+  int ib;
+  unsigned int mt;
+  int ai;
+  uint64_t val;
+  cn_cbor* cb = NULL;
+  int depth = 0;
+
+again:
+  IOV_TAKE(1, ib = iov_take_uint(in, 1));
+  if (ib == IB_BREAK) {
+    if (!end_indef(pb, parent))
+      goto fail;
+    goto complete;
+  }
+  mt = ib >> 5;
+  ai = ib & 0x1f;
+  val = ai;
+
+  cb = add_node(pb, parent, mt, depth, in->len - in->offset
+                CBOR_CONTEXT_PARAM);
+  if (!cb)
+    goto fail;
+
+  mark = *in;
+  switch (ai) {
+  case AI_1: IOV_TAKE(1, val = iov_take_uint(in, 1)); break;
+  case AI_2: IOV_TAKE(2, val = iov_take_uint(in, 2)); break;
+  case AI_4: IOV_TAKE(4, val = iov_take_uint(in, 4)); break;
+  case AI_8: IOV_TAKE(8, val = iov_take_uint(in, 8)); break;
+  case 28: case 29: case 30: CN_CBOR_FAIL(CN_CBOR_ERR_RESERVED_AI);
+  case AI_INDEF:
+    if (mt >= MT_BYTES && mt <= MT_MAP) {
+      cb->flags |= CN_CBOR_FL_INDEF;
+      goto push;
+    } else {
+      CN_CBOR_FAIL(CN_CBOR_ERR_MT_UNDEF_FOR_INDEF);
+    }
+  }
+  switch (mt) {
+  case MT_UNSIGNED:
+    cb->v.uint = val;
+    break;
+  case MT_NEGATIVE:
+    if (val > INT64_MAX) {      /* the argument itself is the number */
+      *in = mark;
+      cb->type = CN_CBOR_NEGBIGNUM;
+      cb->v.bytes = iov_take_string(pb, in, 8 CBOR_CONTEXT_PARAM);
+      if (!cb->v.bytes)
+        goto fail;
+      cb->length = 8;
+    } else {
+      cb->v.sint = ~val;
+    }
+    break;
+  case MT_BYTES: case MT_TEXT:
+    if (val > pb->max_string_length)
+      CN_CBOR_FAIL(CN_CBOR_ERR_MAX_STRING_LENGTH);
+    IOV_TAKE(val, ;);
+    cb->v.bytes = iov_take_string(pb, in, val CBOR_CONTEXT_PARAM);
+    if (!cb->v.bytes)
+      goto fail;
+    cb->length = val;
+    intern_key(pb, parent, cb);
+    break;
+  case MT_ARRAY: case MT_MAP:
+    if (set_count(cb, mt, val))
+      goto push;
+    break;
+  case MT_TAG:
+    cb->v.uint = val;
+    goto push;
+  case MT_PRIM:
+    if (!set_prim(cb, ai, val, pb->flags))
+      CN_CBOR_FAIL(CN_CBOR_ERR_FLOAT_NOT_SUPPORTED);
+    break;
+  }
+fill:                           /* emulate loops */
+  if (!fill_node(pb, parent, cb, depth CBOR_CONTEXT_PARAM))
+    goto fail;
+  if (more_items(parent))
+    goto again;
+complete:                       /* emulate return from call */
+  if (parent == top_parent) {
+    if (in->offset != in->len)
+      CN_CBOR_FAIL(CN_CBOR_ERR_NOT_ALL_DATA_CONSUMED);
+    return cb;
+  }
+  cb = parent;
+  parent = parent->parent;
+  depth--;
+  goto fill;
+push:                           /* emulate recursive call */
+  if ((pb->flags & CN_CBOR_DECODE_UNIQUE_KEYS) &&
+      !key_push(pb, parent, cb, depth CBOR_CONTEXT_PARAM))
+    goto fail;
+  parent = cb;
+  depth++;
+  goto again;
+fail:
+  return 0;
+}
+
+/* The options decode_iov_item supports; the others need the input in
+   one piece. */
+#define IOV_DECODE_FLAGS (CN_CBOR_DECODE_UNIQUE_KEYS | CN_CBOR_DECODE_FLOATS | \
+                          CN_CBOR_DECODE_ARENA)
+
+cn_cbor* cn_cbor_decode_iov(const struct iovec *iov, int iovcnt,
+                            const cn_cbor_decode_options *opts
+                            CBOR_CONTEXT,
+                            cn_cbor_errback *errp) {
+  cn_cbor catcher = {CN_CBOR_INVALID, 0, {0}, 0, NULL, NULL, NULL, NULL, {0}};
+  struct parse_buf pb;
+  struct iov_input in;
+  cn_cbor* ret;
+  int i;
+
+  if (opts && ((opts->flags & ~IOV_DECODE_FLAGS) || opts->raw_depth > 0)) {
+    if (errp) {
+      errp->err = CN_CBOR_ERR_INVALID_PARAMETER;
+      errp->pos = 0;
+    }
+    return NULL;
+  }
+  memset(&pb, 0, sizeof(pb));
+  pb.flags = (opts ? opts->flags : 0) | CN_CBOR_DECODE_ARENA;
+  pb.keys = opts ? opts->keys : NULL;
+  set_limits(&pb, opts ? opts->limits : NULL);
+  in.iov = iov;
+  in.at = 0;
+  in.offset = 0;
+  in.len = 0;
+  for (i = 0; i < iovcnt; i++)
+    in.len += iov[i].iov_len;
+  ret = decode_iov_item(&pb, &in CBOR_CONTEXT_PARAM, &catcher);
+  if (pb.key_set) {
+    CN_CBOR_FREE_CONTEXT(pb.key_set);
+  }
+  if (pb.key_stack) {
+    CN_CBOR_FREE_CONTEXT(pb.key_stack);
+  }
+  if (ret != NULL) {
+    /* The root is the catcher's only child.  Taking it from there rather
+       than from the return value lets the compiler see that no pointer
+       to the catcher escapes. */
+    ret = catcher.first_child;
+    /* mark as top node */
+    ret->parent = NULL;
+  } else {
+    if (catcher.first_child) {
+      catcher.first_child->parent = 0;
+      cn_cbor_free(catcher.first_child CBOR_CONTEXT_PARAM);
+    }
+    if (errp) {
+      errp->err = pb.err;
+      errp->pos = in.offset;
+    }
+  }
+  return ret;
+}
+
+size_t cn_cbor_head_decode(const uint8_t *buf, size_t len,
+                           cn_cbor_head *head,
+                           cn_cbor_errback *errp) {
+  struct parse_buf pb;
+
+  memset(&pb, 0, sizeof(pb));
+  pb.buf  = (unsigned char *)buf;
+  pb.ebuf = (unsigned char *)buf+len;
+  pb.start = (unsigned char *)buf;
+  if (!take_head(&pb, head)) {
+    if (errp) {
+      errp->err = pb.err;
+      errp->pos = pb.buf - (unsigned char *)buf;
+    }
+    return 0;
+  }
+  return pb.buf - (unsigned char *)buf;
+}
+
+/* One open container while walking an encoded item without building a
+   tree.  These are the fields of cn_cbor that decode_item uses for a
+   parent, and walk_item follows decode_item step by step, so that both
+   find the same errors at the same positions. */
+struct walk_frame {
+  cn_cbor_type type;
+  int flags;
+  uint64_t count;
+  size_t length;
+};
+
+/* Walk with the given frames; one more open container than they hold
+   fails with CN_CBOR_ERR_MAX_DEPTH. */
+static bool walk_frames(struct parse_buf *pb, struct walk_frame *stack,
+                        int size) {
+  struct walk_frame *parent = stack;
+  struct walk_frame cur;
+  unsigned char *pos = pb->buf;
+  unsigned char *ebuf = pb->ebuf;
+  int ib;
+  unsigned int mt;
+  int ai;
+  uint64_t val;
+
+  memset(parent, 0, sizeof(*parent));
+  parent->type = CN_CBOR_INVALID;
+again:
+  TAKE(pos, ebuf, 1, ib = ntoh8p(pos) );
+  if (ib == IB_BREAK) {
+    if (!(parent->flags & CN_CBOR_FL_INDEF))
+      CN_CBOR_FAIL(CN_CBOR_ERR_BREAK_OUTSIDE_INDEF);
+    switch (parent->type) {
+    case CN_CBOR_BYTES: case CN_CBOR_TEXT:
+      parent->type += 2;            /* CN_CBOR_* -> CN_CBOR_*_CHUNKED */
+      break;
+    case CN_CBOR_MAP:
+      if (parent->length & 1)
+        CN_CBOR_FAIL(CN_CBOR_ERR_ODD_SIZE_INDEF_MAP);
+    default:;
+    }
+    goto complete;
+  }
+  mt = ib >> 5;
+  ai = ib & 0x1f;
+  val = ai;
+
+  if (parent - stack > pb->max_depth)
+    CN_CBOR_FAIL(CN_CBOR_ERR_MAX_DEPTH);
+  if (!pb->items_left)
+    CN_CBOR_FAIL(CN_CBOR_ERR_MAX_ITEMS);
+  if (pb->bytes_left < sizeof(cn_cbor))
+    CN_CBOR_FAIL(CN_CBOR_ERR_MAX_BYTES);
+  pb->items_left--;
+  pb->bytes_left -= sizeof(cn_cbor);
+  if (parent - stack > pb->depth_seen)
+    pb->depth_seen = parent - stack;
+
+  cur.type = mt_trans[mt];
+  cur.flags = 0;
+  cur.count = 0;
+  cur.length = 0;
+  parent->length++;
+
+  switch (ai) {
+  case AI_1: TAKE(pos, ebuf, 1, val = ntoh8p(pos)) ; break;
+  case AI_2: TAKE(pos, ebuf, 2, val = ntoh16p(pos)) ; break;
+  case AI_4: TAKE(pos, ebuf, 4, val = ntoh32p(pos)) ; break;
+  case AI_8: TAKE(pos, ebuf, 8, val = ntoh64p(pos)) ; break;
+  case 28: case 29: case 30: CN_CBOR_FAIL(CN_CBOR_ERR_RESERVED_AI);
+  case AI_INDEF:
+    if (mt >= MT_BYTES && mt <= MT_MAP) {
+      cur.flags |= CN_CBOR_FL_INDEF;
+      goto push;
+    } else {
+      CN_CBOR_FAIL(CN_CBOR_ERR_MT_UNDEF_FOR_INDEF);
+    }
+  }
+  switch (mt) {
+  case MT_BYTES: case MT_TEXT:
+    if (val > pb->max_string_length)
+      CN_CBOR_FAIL(CN_CBOR_ERR_MAX_STRING_LENGTH);
+    TAKE(pos, ebuf, val, ;);
+    break;
+  case MT_MAP:
+    val <<= 1;
+    /* fall through */
+  case MT_ARRAY:
+    if ((cur.count = val)) {
+      cur.flags |= CN_CBOR_FL_COUNT;
+      goto push;
+    }
+    pb->containers++;
+    break;
+  case MT_TAG:
+    goto push;
+  case MT_PRIM:
+#ifdef CBOR_NO_FLOAT
+    if (ai == AI_2 || ai == AI_4 || ai == AI_8)
+      CN_CBOR_FAIL(CN_CBOR_ERR_FLOAT_NOT_SUPPORTED);
+#endif /*  CBOR_NO_FLOAT */
+    break;
+  }
+fill:
+  if (parent->flags & CN_CBOR_FL_INDEF) {
+    if (parent->type == CN_CBOR_BYTES || parent->type == CN_CBOR_TEXT)
+      if (cur.type != parent->type)
+          CN_CBOR_FAIL(CN_CBOR_ERR_WRONG_NESTING_IN_INDEF_STRING);
+    goto again;
+  }
+  if (parent->flags & CN_CBOR_FL_COUNT) {
+    if (--parent->count)
+      goto again;
+  }
+complete:
+  if (parent == stack) {
+    pb->buf = pos;
+    return true;
+  }
+  cur = *parent--;
+  goto fill;
+push:
+  if (parent == stack + size - 1)
+    CN_CBOR_FAIL(CN_CBOR_ERR_MAX_DEPTH);
+  pb->containers++;
+  *++parent = cur;
+  goto again;
+fail:
+  pb->buf = pos;
+  return false;
+}
+
+static bool walk_item(struct parse_buf *pb) {
+  struct walk_frame stack[CN_CBOR_WALK_MAX_DEPTH + 1];
+
+  return walk_frames(pb, stack, CN_CBOR_WALK_MAX_DEPTH + 1);
+}
+
+static bool walk_stack_grow(struct parse_buf *pb CBOR_CONTEXT) {
+  struct walk_frame *stack;
+  int size = pb->walk_stack_size ? 2 * pb->walk_stack_size :
+    2 * (CN_CBOR_WALK_MAX_DEPTH + 1);
+
+  if (pb->bytes_left < size * sizeof(*stack)) {
+    pb->err = CN_CBOR_ERR_MAX_BYTES;
+    return false;
+  }
+  stack = CN_CALLOC_N_CONTEXT(size, sizeof(*stack));
+  if (!stack) {
+    pb->err = CN_CBOR_ERR_OUT_OF_MEMORY;
+    return false;
+  }
+  pb->bytes_left -= size * sizeof(*stack);
+  if (pb->walk_stack) {
+    CN_CBOR_FREE_CONTEXT(pb->walk_stack);
+  }
+  pb->walk_stack = stack;
+  pb->walk_stack_size = size;
+  return true;
+}
+
+/* Walk a subtree that is kept raw.  Only max_depth limits it, as it
+   does a decoded one: when the frames run out first, the walk starts
+   over with twice as many. */
+static bool walk_raw(struct parse_buf *pb CBOR_CONTEXT) {
+  unsigned char *start = pb->buf;
+  size_t items_left = pb->items_left;
+  size_t bytes_left = pb->bytes_left;
+  size_t containers = pb->containers;
+  int size = CN_CBOR_WALK_MAX_DEPTH + 1;
+
+  if (walk_item(pb))
+    return true;
+  while (pb->err == CN_CBOR_ERR_MAX_DEPTH && size - 1 <= pb->max_depth) {
+    pb->buf = start;
+    pb->items_left = items_left;
+    pb->bytes_left = bytes_left;
+    pb->containers = containers;
+    if (pb->walk_stack_size <= size) {
+      if (!walk_stack_grow(pb CBOR_CONTEXT_PARAM))
+        return false;
+      bytes_left = pb->bytes_left;
+    }
+    size = pb->walk_stack_size;
+    if (walk_frames(pb, pb->walk_stack, size))
+      return true;
+  }
+  return false;
+}
+
+size_t cn_cbor_skip(const uint8_t *buf, size_t len, cn_cbor_errback *errp) {
+  struct parse_buf pb;
+
+  memset(&pb, 0, sizeof(pb));
+  pb.buf  = (unsigned char *)buf;
+  pb.ebuf = (unsigned char *)buf+len;
+  pb.start = (unsigned char *)buf;
+  set_limits(&pb, NULL);
+  if (!walk_item(&pb)) {
+    if (errp) {
+      errp->err = pb.err;
+      errp->pos = pb.buf - (unsigned char *)buf;
+    }
+    return 0;
+  }
+  return pb.buf - (unsigned char *)buf;
+}
+
+bool cn_cbor_validate(const uint8_t *buf, size_t len,
+                      const cn_cbor_limits *limits,
+                      cn_cbor_stats *stats,
+                      cn_cbor_errback *errp) {
+  struct parse_buf pb;
+  size_t items;
+
+  memset(&pb, 0, sizeof(pb));
+  pb.buf  = (unsigned char *)buf;
+  pb.ebuf = (unsigned char *)buf+len;
+  pb.start = (unsigned char *)buf;
+  set_limits(&pb, limits);
+  items = pb.items_left;
+  if (!walk_item(&pb)) {
+    goto fail;
+  }
+  if (pb.buf != pb.ebuf) {
+    pb.err = CN_CBOR_ERR_NOT_ALL_DATA_CONSUMED;
+    goto fail;
+  }
+  if (stats) {
+    stats->items = items - pb.items_left;
+    stats->max_depth = pb.depth_seen;
+  }
+  return true;
+fail:
+  if (errp) {
+    errp->err = pb.err;
+    errp->pos = pb.buf - (unsigned char *)buf;
+  }
+  return false;
+}
+
+/* The type an item gets on a tape, from its head. */
+static cn_cbor_type tape_type(const cn_cbor_head *head) {
+  switch (head->mt) {
+  case MT_NEGATIVE:
+    return head->val > INT64_MAX ? CN_CBOR_NEGBIGNUM : CN_CBOR_INT;
+  case MT_BYTES: case MT_TEXT:
+    /* CN_CBOR_* -> CN_CBOR_*_CHUNKED */
+    return mt_trans[head->mt] + (head->ai == AI_INDEF ? 2 : 0);
+  case MT_PRIM:
+    switch (head->ai) {
+    case VAL_FALSE: return CN_CBOR_FALSE;
+    case VAL_TRUE:  return CN_CBOR_TRUE;
+    case VAL_NIL:   return CN_CBOR_NULL;
+    case VAL_UNDEF: return CN_CBOR_UNDEF;
+    case AI_2: case AI_4: case AI_8: return CN_CBOR_DOUBLE;
+    default: return CN_CBOR_SIMPLE;
+    }
+  default:
+    return mt_trans[head->mt];
+  }
+}
+
+/* Lay out an item that walk_item has accepted, so nothing is checked. */
+static void tape_fill(struct parse_buf *pb, uint64_t *words) {
+  struct {
+    size_t at;
+    uint64_t left;              /* children to come, UINT64_MAX if indef */
+  } stack[CN_CBOR_WALK_MAX_DEPTH + 1], *parent = stack;
+  cn_cbor_head head;
+  cn_cbor_type type;
+  size_t n = 0;
+
+  parent->left = 1;
+  for (;;) {
+    if (*pb->buf == IB_BREAK) {
+      pb->buf++;
+      goto close;
+    }
+    words[n] = (uint64_t)(pb->buf - pb->start);
+    (void)take_head(pb, &head);
+    type = tape_type(&head);
+    words[n++] |= (uint64_t)type << 56;
+    switch (type) {
+    case CN_CBOR_BYTES: case CN_CBOR_TEXT:
+      pb->buf += head.val;
+      break;
+    case CN_CBOR_BYTES_CHUNKED: case CN_CBOR_TEXT_CHUNKED:
+    case CN_CBOR_ARRAY: case CN_CBOR_MAP: case CN_CBOR_TAG:
+      (++parent)->at = n - 1;
+      n++;
+      if (head.ai == AI_INDEF)
+        parent->left = UINT64_MAX;
+      else if (type == CN_CBOR_TAG)
+        parent->left = 1;
+      else if ((parent->left = head.val << (type == CN_CBOR_MAP)) == 0)
+        goto close;
+      continue;
+    default:;
+    }
+  done:                         /* a child of parent is complete */
+    if (parent->left == UINT64_MAX || --parent->left)
+      continue;
+    if (parent == stack)
+      return;
+  close:
+    words[parent->at + 1] = n;
+    parent--;
+    goto done;
+  }
+}
+
+bool cn_cbor_tape_decode(const uint8_t *buf, size_t len,
+                         const cn_cbor_limits *limits,
+                         cn_cbor_tape *tape
+                         CBOR_CONTEXT,
+                         cn_cbor_errback *errp) {
+  struct parse_buf pb;
+  size_t items;
+
+  memset(tape, 0, sizeof(*tape));
+  memset(&pb, 0, sizeof(pb));
+  pb.buf  = (unsigned char *)buf;
+  pb.ebuf = (unsigned char *)buf+len;
+  pb.start = (unsigned char *)buf;
+  set_limits(&pb, limits);
+  items = pb.items_left;
+  if (!walk_item(&pb)) {
+    goto fail;
+  }
+  if (pb.buf != pb.ebuf) {
+    pb.err = CN_CBOR_ERR_NOT_ALL_DATA_CONSUMED;
+    goto fail;
+  }
+  tape->count = items - pb.items_left + pb.containers;
+  tape->words = CN_CALLOC_N_CONTEXT(tape->count, sizeof(uint64_t));
+  if (!tape->words) {
+    tape->count = 0;
+    pb.err = CN_CBOR_ERR_OUT_OF_MEMORY;
+    pb.buf = pb.start;
+    goto fail;
+  }
+  tape->buf = buf;
+  tape->len = len;
+  pb.buf = pb.start;
+  tape_fill(&pb, tape->words);
+  return true;
+fail:
+  if (errp) {
+    errp->err = pb.err;
+    errp->pos = pb.buf - (unsigned char *)buf;
+  }
+  return false;
+}
+
+void cn_cbor_tape_free(cn_cbor_tape *tape CBOR_CONTEXT) {
+  if (tape->words) {
+    CN_CBOR_FREE_CONTEXT(tape->words);
+  }
+  memset(tape, 0, sizeof(*tape));
+}
+
+void cn_cbor_tape_get(const cn_cbor_tape *tape, size_t at, cn_cbor *out) {
+  uint64_t word = tape->words[at];
+  struct parse_buf pb;
+  cn_cbor_head head;
+  size_t child;
+#ifndef CBOR_NO_FLOAT
+  union {
+    float f;
+    uint32_t u;
+  } u32;
+  union {
+    double d;
+    uint64_t u;
+  } u64;
+#endif /* CBOR_NO_FLOAT */
+
+  memset(out, 0, sizeof(*out));
+  memset(&pb, 0, sizeof(pb));
+  memset(&head, 0, sizeof(head)); /* the tape was checked; for the compiler */
+  pb.buf = (unsigned char *)tape->buf + CN_CBOR_TAPE_OFFSET(word);
+  pb.ebuf = (unsigned char *)tape->buf + tape->len;
+  (void)take_head(&pb, &head);
+  out->type = CN_CBOR_TAPE_TYPE(word);
+  if (head.ai == AI_INDEF)
+    out->flags |= CN_CBOR_FL_INDEF;
+  switch (out->type) {
+  case CN_CBOR_UINT: case CN_CBOR_SIMPLE:
+    out->v.uint = head.val;
+    break;
+  case CN_CBOR_INT:
+    out->v.sint = ~head.val;
+    break;
+  case CN_CBOR_NEGBIGNUM:
+    out->v.bytes = pb.buf - 8;
+    out->length = 8;
+    break;
+  case CN_CBOR_BYTES: case CN_CBOR_TEXT:
+    out->v.bytes = pb.buf;
+    out->length = head.val;
+    break;
+  case CN_CBOR_TAG:
+    out->v.uint = head.val;
+    out->length = 1;
+    break;
+  case CN_CBOR_BYTES_CHUNKED: case CN_CBOR_TEXT_CHUNKED:
+  case CN_CBOR_ARRAY: case CN_CBOR_MAP:
+    if (head.ai != AI_INDEF) {
+      out->length = head.val << (out->type == CN_CBOR_MAP);
+      break;
+    }
+    for (child = at + 2; child < tape->words[at + 1];
+         child = cn_cbor_tape_next(tape, child))
+      out->length++;
+    break;
+#ifndef CBOR_NO_FLOAT
+  case CN_CBOR_DOUBLE:
+    if (head.ai == AI_8) {
+      u64.u = head.val;
+      out->v.dbl = u64.d;
+    } else {
+      u32.u = head.val;
+      out->v.dbl = head.ai == AI_2 ? decode_half(head.val) : u32.f;
+    }
+    break;
+#endif /* CBOR_NO_FLOAT */
+  default:;
+  }
+}
+
+/* The header of a tape image, followed by the words and then the input.
+   The magic is "cbortap1" on little-endian hosts; it also rejects images
+   from hosts with the other byte order. */
+struct tape_image {
+  uint64_t magic;
+  uint64_t count;
+  uint64_t len;
+};
+
+#define TAPE_IMAGE_MAGIC 0x31706174726f6263ULL
+
+size_t cn_cbor_tape_image_size(const cn_cbor_tape *tape) {
+  return sizeof(struct tape_image) + tape->count * sizeof(uint64_t) +
+    tape->len;
+}
+
+ssize_t cn_cbor_tape_image_write(uint8_t *buf, size_t buf_size,
+                                 const cn_cbor_tape *tape) {
+  struct tape_image head;
+  size_t size = cn_cbor_tape_image_size(tape);
+
+  if (size > buf_size)
+    return -1;
+  head.magic = TAPE_IMAGE_MAGIC;
+  head.count = tape->count;
+  head.len = tape->len;
+  memcpy(buf, &head, sizeof(head));
+  buf += sizeof(head);
+  memcpy(buf, tape->words, tape->count * sizeof(uint64_t));
+  buf += tape->count * sizeof(uint64_t);
+  memcpy(buf, tape->buf, tape->len);
+  return size;
+}
+
+bool cn_cbor_tape_image_open(const uint8_t *image, size_t len,
+                             cn_cbor_tape *tape,
+                             cn_cbor_errback *errp) {
+  const struct tape_image *head = (const struct tape_image *)image;
+  cn_cbor_error err;
+
+  memset(tape, 0, sizeof(*tape));
+  if ((uintptr_t)image % sizeof(uint64_t)) {
+    err = CN_CBOR_ERR_INVALID_PARAMETER;
+    goto fail;
+  }
+  if (len < sizeof(*head)) {
+    err = CN_CBOR_ERR_OUT_OF_DATA;
+    goto fail;
+  }
+  if (head->magic != TAPE_IMAGE_MAGIC || !head->count) {
+    err = CN_CBOR_ERR_INVALID_PARAMETER;
+    goto fail;
+  }
+  len -= sizeof(*head);
+  if (head->count > len / sizeof(uint64_t) ||
+      head->len > len - head->count * sizeof(uint64_t)) {
+    err = CN_CBOR_ERR_OUT_OF_DATA;
+    goto fail;
+  }
+  tape->words = (uint64_t *)(head + 1);
+  tape->count = head->count;
+  tape->buf = (const uint8_t *)(tape->words + tape->count);
+  tape->len = head->len;
+  return true;
+fail:
+  if (errp) {
+    errp->err = err;
+    errp->pos = 0;
+  }
+  return false;
+}
+
+/* Find the field for a key: a text key if key is not NULL, else int_key.
+   Returns the field number, or -1. */
+static int field_find(const cn_cbor_fields *desc, const uint8_t *key,
+                      size_t len, int64_t int_key) {
+  uint32_t h = key ? hash_text(key, len) : hash_int(int_key);
+  unsigned int i = h & desc->mask;
+  const cn_cbor_field *f;
+  int n;
+
+  while ((n = desc->index[i])) {
+    f = &desc->fields[--n];
+    if (desc->hash[n] == h) {
+      if (key ? (f->key && strlen(f->key) == len && !memcmp(f->key, key, len))
+              : (!f->key && f->int_key == int_key))
+        return n;
+    }
+    i = (i + 1) & desc->mask;
+  }
+  return -1;
+}
+
+bool cn_cbor_fields_init(cn_cbor_fields *desc,
+                         const cn_cbor_field *fields,
+                         size_t count,
+                         cn_cbor_errback *errp) {
+  const cn_cbor_field *f;
+  unsigned int i;
+  size_t n;
+
+  if (count > CN_CBOR_FIELDS_MAX) {
+    if (errp) {errp->err = CN_CBOR_ERR_INVALID_PARAMETER;}
+    return false;
+  }
+  memset(desc, 0, sizeof(*desc));
+  desc->fields = fields;
+  for (desc->mask = 1; desc->mask < 2 * count; desc->mask <<= 1)
+    ;
+  desc->mask--;
+  for (n = 0; n < count; n++) {
+    f = &fields[n];
+    if (field_find(desc, (const uint8_t *)f->key,
+                   f->key ? strlen(f->key) : 0, f->int_key) >= 0) {
+      if (errp) {errp->err = CN_CBOR_ERR_INVALID_PARAMETER;}
+      return false;
+    }
+    desc->hash[n] = f->key ?
+      hash_text((const uint8_t *)f->key, strlen(f->key)) :
+      hash_int(f->int_key);
+    for (i = desc->hash[n] & desc->mask; desc->index[i];
+         i = (i + 1) & desc->mask)
+      ;
+    desc->index[i] = n + 1;
+    desc->count = n + 1;
+  }
+  return true;
+}
+
+/* Decode the item at pb->buf into the member for field f. */
+static bool store_field(struct parse_buf *pb, const cn_cbor_field *f,
+                        uint8_t *out) {
+  unsigned char *item = pb->buf;
+  void *dst = out + f->offset;
+  cn_cbor_head h;
+  cn_cbor_string *str;
+
+  if (!take_head(pb, &h))
+    return false;
+  switch (f->type) {
+  case CN_CBOR_FIELD_UINT64:
+    if (h.mt != MT_UNSIGNED)
+      goto wrong;
+    *(uint64_t *)dst = h.val;
+    break;
+  case CN_CBOR_FIELD_INT64:
+  case CN_CBOR_FIELD_INT:
+    if ((h.mt != MT_UNSIGNED && h.mt != MT_NEGATIVE) ||
+        h.val > (f->type == CN_CBOR_FIELD_INT ? (uint64_t)INT_MAX : INT64_MAX))
+      goto wrong;
+    if (f->type == CN_CBOR_FIELD_INT)
+      *(int *)dst = h.mt == MT_UNSIGNED ? (int)h.val : -1 - (int)h.val;
+    else
+      *(int64_t *)dst = h.mt == MT_UNSIGNED ? (int64_t)h.val : -1 - (int64_t)h.val;
+    break;
+  case CN_CBOR_FIELD_BOOL:
+    if (h.mt != MT_PRIM || (h.ai != VAL_FALSE && h.ai != VAL_TRUE))
+      goto wrong;
+    *(bool *)dst = h.ai == VAL_TRUE;
+    break;
+  case CN_CBOR_FIELD_TEXT:
+  case CN_CBOR_FIELD_BYTES:
+    if (h.mt != (f->type == CN_CBOR_FIELD_TEXT ? MT_TEXT : MT_BYTES) ||
+        h.ai == AI_INDEF)
+      goto wrong;
+    if (h.val > (uint64_t)(pb->ebuf - pb->buf)) {
+      pb->buf = pb->ebuf;
+      pb->err = CN_CBOR_ERR_OUT_OF_DATA;
+      return false;
+    }
+    str = dst;
+    str->ptr = pb->buf;
+    str->length = h.val;
+    pb->buf += h.val;
+    break;
+  case CN_CBOR_FIELD_DOUBLE:
+  case CN_CBOR_FIELD_FLOAT:
+#ifndef CBOR_NO_FLOAT
+    {
+      union {
+        float f;
+        uint32_t u;
+      } u32;
+      union {
+        double d;
+        uint64_t u;
+      } u64;
+      if (h.mt != MT_PRIM)
+        goto wrong;
+      switch (h.ai) {
+      case AI_2: u32.f = decode_half(h.val); u64.d = u32.f; break;
+      case AI_4: u32.u = h.val; u64.d = u32.f; break;
+      case AI_8: u64.u = h.val; u32.f = u64.d; break;
+      default: goto wrong;
+      }
+      if (f->type == CN_CBOR_FIELD_FLOAT)
+        *(float *)dst = u32.f;
+      else
+        *(double *)dst = u64.d;
+    }
+#else /*  CBOR_NO_FLOAT */
+    pb->buf = item;
+    pb->err = CN_CBOR_ERR_FLOAT_NOT_SUPPORTED;
+    return false;
+#endif /*  CBOR_NO_FLOAT */
+    break;
+  default:
+    goto wrong;
+  }
+  return true;
+wrong:
+  pb->buf = item;
+  pb->err = CN_CBOR_ERR_WRONG_TYPE;
+  return false;
+}
+
+size_t cn_cbor_decode_into(const uint8_t *buf, size_t len,
+                           const cn_cbor_fields *desc,
+                           void *out,
+                           uint64_t *present,
+                           cn_cbor_errback *errp) {
+  struct parse_buf pb;
+  cn_cbor_head h;
+  unsigned char *item;
+  uint64_t seen = 0;
+  uint64_t count;
+  bool indef;
+  size_t n;
+  int f;
+
+  memset(&pb, 0, sizeof(pb));
+  pb.buf  = (unsigned char *)buf;
+  pb.ebuf = (unsigned char *)buf+len;
+  pb.start = (unsigned char *)buf;
+  set_limits(&pb, NULL);
+
+  if (!take_head(&pb, &h))
+    goto fail;
+  if (h.mt != MT_MAP) {
+    pb.buf = (unsigned char *)buf;
+    pb.err = CN_CBOR_ERR_WRONG_TYPE;
+    goto fail;
+  }
+  indef = h.ai == AI_INDEF;
+  for (count = h.val; indef || count; count--) {
+    if (indef && pb.buf < pb.ebuf && *pb.buf == IB_BREAK) {
+      pb.buf++;
+      break;
+    }
+    item = pb.buf;
+    if (!take_head(&pb, &h))
+      goto fail;
+    f = -1;
+    switch (h.mt) {
+    case MT_UNSIGNED:
+    case MT_NEGATIVE:
+      if (h.val <= INT64_MAX)
+        f = field_find(desc, NULL, 0, h.mt == MT_UNSIGNED ?
+                       (int64_t)h.val : -1 - (int64_t)h.val);
+      break;
+    case MT_TEXT:
+      if (h.ai != AI_INDEF) {
+        if (h.val > (uint64_t)(pb.ebuf - pb.buf)) {
+          pb.buf = pb.ebuf;
+          pb.err = CN_CBOR_ERR_OUT_OF_DATA;
+          goto fail;
+        }
+        f = field_find(desc, pb.buf, h.val, 0);
+        pb.buf += h.val;
+        break;
+      }
+      /* fall through */
+    default:
+      pb.buf = item;
+      if (!walk_item(&pb))
+        goto fail;
+    }
+    if (indef && pb.buf < pb.ebuf && *pb.buf == IB_BREAK) {
+      pb.err = CN_CBOR_ERR_ODD_SIZE_INDEF_MAP;
+      goto fail;
+    }
+    if (f < 0) {
+      if (!walk_item(&pb))
+        goto fail;
+      continue;
+    }
+    if (!store_field(&pb, &desc->fields[f], out))
+      goto fail;
+    seen |= (uint64_t)1 << f;
+  }
+  for (n = 0; n < desc->count; n++) {
+    if ((desc->fields[n].flags & CN_CBOR_FIELD_REQUIRED) &&
+        !(seen & ((uint64_t)1 << n))) {
+      pb.err = CN_CBOR_ERR_MISSING_FIELD;
+      goto fail;
+    }
+  }
+  if (present)
+    *present = seen;
+  return pb.buf - (unsigned char *)buf;
+fail:
+  if (errp) {
+    errp->err = pb.err;
+    errp->pos = pb.buf - (unsigned char *)buf;
+  }
+  return 0;
+}
+
 #ifdef  __cplusplus
 }
 #endif
@@ -0,0 +1,290 @@
+#ifndef CN_COMPARE_C
+#define CN_COMPARE_C
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+#ifdef EMACS_INDENTATION_HELPER
+} /* Duh. */
+#endif
+
+#include <string.h>
+#include <assert.h>
+
+#include "cn-cbor/cn-cbor.h"
+#include "cbor.h"
+
+/* Values that only differ in their encoding compare and hash the same:
+   floats are compared as doubles, definite and indefinite length
+   containers are not distinguished, and chunked strings are compared by
+   their content, wherever the chunks are split.  Raw values are compared
+   by their encoding, and never equal a decoded value.  Hashes are the
+   same on every host. */
+
+static cn_cbor_type _canonical_type(const cn_cbor *cb)
+{
+  switch (cb->type) {
+  case CN_CBOR_FLOAT:
+    return CN_CBOR_DOUBLE;
+  case CN_CBOR_BYTES_CHUNKED:
+    return CN_CBOR_BYTES;
+  case CN_CBOR_TEXT_CHUNKED:
+    return CN_CBOR_TEXT;
+  default:
+    return cb->type;
+  }
+}
+
+static bool _is_string(const cn_cbor *cb)
+{
+  return cb->type >= CN_CBOR_BYTES && cb->type <= CN_CBOR_TEXT_CHUNKED;
+}
+
+/* The first piece of a string: itself, or its first chunk */
+static const cn_cbor *_first_chunk(const cn_cbor *cb)
+{
+  return cb->type == CN_CBOR_BYTES || cb->type == CN_CBOR_TEXT ?
+    cb : cb->first_child;
+}
+
+static const cn_cbor *_next_chunk(const cn_cbor *s, const cn_cbor *c)
+{
+  return c == s ? NULL : c->next;
+}
+
+static bool _string_equal(const cn_cbor *a, const cn_cbor *b)
+{
+  const cn_cbor *ca = _first_chunk(a);
+  const cn_cbor *cb = _first_chunk(b);
+  int oa = 0, ob = 0, n;
+
+  for (;;) {
+    while (ca && oa == ca->length) {
+      ca = _next_chunk(a, ca);
+      oa = 0;
+    }
+    while (cb && ob == cb->length) {
+      cb = _next_chunk(b, cb);
+      ob = 0;
+    }
+    if (!ca || !cb) {
+      return !ca && !cb;
+    }
+    n = ca->length - oa < cb->length - ob ? ca->length - oa : cb->length - ob;
+    if (memcmp(ca->v.bytes + oa, cb->v.bytes + ob, n)) {
+      return false;
+    }
+    oa += n;
+    ob += n;
+  }
+}
+
+#ifndef CBOR_NO_FLOAT
+static uint64_t _double_bits(const cn_cbor *cb)
+{
+  union {
+    double d;
+    uint64_t u;
+  } u64;
+
+  u64.d = cb->type == CN_CBOR_FLOAT ? cb->v.f : cb->v.dbl;
+  if (u64.d != u64.d) {
+    return 0x7ff8000000000000ULL; /* all NaNs are the same */
+  }
+  return u64.u;
+}
+#endif /* CBOR_NO_FLOAT */
+
+static bool _item_equal(const cn_cbor *a, const cn_cbor *b)
+{
+  if (_canonical_type(a) != _canonical_type(b)) {
+    return false;
+  }
+  if (_is_string(a)) {
+    return _string_equal(a, b);
+  }
+  if (a->length != b->length) {
+    return false;
+  }
+  switch (a->type) {
+  case CN_CBOR_UINT:
+  case CN_CBOR_TAG:
+  case CN_CBOR_SIMPLE:
+    return a->v.uint == b->v.uint;
+  case CN_CBOR_INT:
+    return a->v.sint == b->v.sint;
+  case CN_CBOR_BIGNUM:
+  case CN_CBOR_NEGBIGNUM:
+  case CN_CBOR_RAW:
+    return a->length == 0 || memcmp(a->v.bytes, b->v.bytes, a->length) == 0;
+  case CN_CBOR_DOUBLE:
+  case CN_CBOR_FLOAT:
+#ifndef CBOR_NO_FLOAT
+    return _double_bits(a) == _double_bits(b);
+#endif /* CBOR_NO_FLOAT */
+  default:
+    return true;
+  }
+}
+
+bool cn_cbor_equal(const cn_cbor *a, const cn_cbor *b)
+{
+  const cn_cbor *pa = a;
+  const cn_cbor *pb = b;
+
+  if (!a || !b) {
+    return a == b;
+  }
+  for (;;) {
+    if (!_item_equal(pa, pb)) {
+      return false;
+    }
+    if (pa->first_child && !_is_string(pa)) { /* go down */
+      if (!pb->first_child) {
+        return false;
+      }
+      pa = pa->first_child;
+      pb = pb->first_child;
+      continue;
+    }
+    while (pa != a && !pa->next) { /* go up */
+      if (pb->next) {
+        return false;
+      }
+      pa = pa->parent;
+      pb = pb->parent;
+    }
+    if (pa == a) {
+      return true;
+    }
+    if (!pb->next) {
+      return false;
+    }
+    pa = pa->next;
+    pb = pb->next;
+  }
+}
+
+#define HASH_SEED  0xcbf29ce484222325ULL
+#define HASH_PRIME 0x100000001b3ULL
+
+static inline uint64_t _hash_word(uint64_t h, uint64_t w)
+{
+  return (h ^ w) * HASH_PRIME;
+}
+
+/* Bytes are hashed eight at a time as big-endian words, so that the
+   hash does not depend on the host.  A word can span chunks: *w holds
+   the *n bytes not yet hashed, which the caller flushes at the end. */
+static uint64_t _hash_bytes(uint64_t h, uint64_t *w, int *n,
+                            const uint8_t *p, size_t len)
+{
+  for (; len && *n; p++, len--) {
+    *w = *w << 8 | *p;
+    if (++*n == 8) {
+      h = _hash_word(h, *w);
+      *w = 0;
+      *n = 0;
+    }
+  }
+  for (; len >= 8; p += 8, len -= 8) {
+    h = _hash_word(h, (uint64_t)p[0] << 56 | (uint64_t)p[1] << 48 |
+                   (uint64_t)p[2] << 40 | (uint64_t)p[3] << 32 |
+                   (uint64_t)p[4] << 24 | (uint64_t)p[5] << 16 |
+                   (uint64_t)p[6] << 8 | p[7]);
+  }
+  for (; len; p++, len--) {
+    *w = *w << 8 | *p;
+    ++*n;
+  }
+  return h;
+}
+
+static uint64_t _hash_string(uint64_t h, const cn_cbor *cb)
+{
+  const cn_cbor *c;
+  uint64_t w = 0;
+  uint32_t len = 0;
+  int n = 0;
+
+  for (c = _first_chunk(cb); c; c = _next_chunk(cb, c)) {
+    len += c->length;
+  }
+  h = _hash_word(h, ((uint64_t)_canonical_type(cb) << 32) | len);
+  for (c = _first_chunk(cb); c; c = _next_chunk(cb, c)) {
+    h = _hash_bytes(h, &w, &n, c->v.bytes, c->length);
+  }
+  return n ? _hash_word(h, w) : h;
+}
+
+uint64_t cn_cbor_hash(const cn_cbor *cb)
+{
+  const cn_cbor *p = cb;
+  uint64_t h = HASH_SEED;
+
+  uint64_t w;
+  int n;
+
+  if (!cb) {
+    return h;
+  }
+  for (;;) {
+    if (_is_string(p)) {
+      h = _hash_string(h, p);
+      goto next;
+    }
+    h = _hash_word(h, ((uint64_t)_canonical_type(p) << 32) | (uint32_t)p->length);
+    switch (p->type) {
+    case CN_CBOR_UINT:
+    case CN_CBOR_TAG:
+    case CN_CBOR_SIMPLE:
+      h = _hash_word(h, p->v.uint);
+      break;
+    case CN_CBOR_INT:
+      h = _hash_word(h, (uint64_t)p->v.sint);
+      break;
+    case CN_CBOR_BIGNUM:
+    case CN_CBOR_NEGBIGNUM:
+    case CN_CBOR_RAW:
+      w = 0;
+      n = 0;
+      h = _hash_bytes(h, &w, &n, p->v.bytes, p->length);
+      if (n) {
+        h = _hash_word(h, w);
+      }
+      break;
+#ifndef CBOR_NO_FLOAT
+    case CN_CBOR_DOUBLE:
+    case CN_CBOR_FLOAT:
+      h = _hash_word(h, _double_bits(p));
+      break;
+#endif /* CBOR_NO_FLOAT */
+    default:
+      break;
+    }
+
+    if (p->first_child) {       /* go down */
+      p = p->first_child;
+      continue;
+    }
+  next:
+    while (p != cb && !p->next) { /* go up */
+      p = p->parent;
+    }
+    if (p == cb) {
+      break;
+    }
+    p = p->next;
+  }
+  /* final avalanche, so that all bits depend on all of the input */
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  return h;
+}
+
+#ifdef  __cplusplus
+}
+#endif
+
+#endif  /* CN_COMPARE_C */
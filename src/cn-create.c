@@ -7,6 +7,7 @@ extern "C" {
 
 #include <string.h>
 #include <stdlib.h>
+#include <limits.h>
 
 #include "cn-cbor/cn-cbor.h"
 #include "cbor.h"
@@ -41,6 +42,102 @@ cn_cbor* cn_cbor_data_create(const uint8_t* data, int len
   return ret;
 }
 
+/* A string that owns a copy of its data: short ones are kept in x.str,
+   and longer ones right after the node, in the same allocation. */
+static cn_cbor* _owned_create(cn_cbor_type type, const void* data, int len
+                              CBOR_CONTEXT,
+                              cn_cbor_errback *errp)
+{
+  cn_cbor* ret;
+  char* str;
+
+  if (len < 0 || (len && !data)) {
+    if (errp) {errp->err = CN_CBOR_ERR_INVALID_PARAMETER;}
+    return NULL;
+  }
+  if ((size_t)len < sizeof(ret->x.str)) {
+    INIT_CB(ret);
+    str = ret->x.str;
+  } else {
+    if (errp) {errp->err = CN_CBOR_NO_ERROR;}
+    ret = CN_CALLOC_N_CONTEXT(1, sizeof(cn_cbor) + len + 1);
+    if (!ret) {
+      if (errp) {errp->err = CN_CBOR_ERR_OUT_OF_MEMORY;}
+      return NULL;
+    }
+    str = (char*)(ret + 1);
+  }
+  if (len) {
+    memcpy(str, data, len);
+  }
+  str[len] = '\0';
+  ret->type = type;
+  ret->flags = CN_CBOR_FL_OWNER;
+  ret->length = len;
+  ret->v.str = str;
+
+  return ret;
+}
+
+/* Also true of a struct copy of such a node, whose v.str still points
+   at the original's x.str */
+static inline bool _is_inline(const cn_cbor* cb)
+{
+  return (cb->flags & CN_CBOR_FL_OWNER) &&
+    (cb->type == CN_CBOR_BYTES || cb->type == CN_CBOR_TEXT) &&
+    (size_t)cb->length < sizeof(cb->x.str);
+}
+
+cn_cbor* cn_cbor_data_create_copy(const uint8_t* data, int len
+                                  CBOR_CONTEXT,
+                                  cn_cbor_errback *errp)
+{
+  return _owned_create(CN_CBOR_BYTES, data, len CBOR_CONTEXT_PARAM, errp);
+}
+
+cn_cbor* cn_cbor_string_create_copy(const char* data
+                                    CBOR_CONTEXT,
+                                    cn_cbor_errback *errp)
+{
+  size_t len = strlen(data);
+
+  if (len > INT_MAX) {
+    if (errp) {errp->err = CN_CBOR_ERR_INVALID_PARAMETER;}
+    return NULL;
+  }
+  return _owned_create(CN_CBOR_TEXT, data, len CBOR_CONTEXT_PARAM, errp);
+}
+
+cn_cbor* cn_cbor_raw_create(const uint8_t* data, int len
+                            CBOR_CONTEXT,
+                            cn_cbor_errback *errp)
+{
+  cn_cbor_errback err;
+  cn_cbor* ret;
+  size_t n;
+
+  if (!data || len <= 0) {
+    if (errp) {errp->err = CN_CBOR_ERR_INVALID_PARAMETER;}
+    return NULL;
+  }
+  n = cn_cbor_skip(data, len, &err);
+  if (n != (size_t)len) {
+    if (n) {
+      err.err = CN_CBOR_ERR_NOT_ALL_DATA_CONSUMED;
+      err.pos = n;
+    }
+    if (errp) {*errp = err;}
+    return NULL;
+  }
+  INIT_CB(ret);
+
+  ret->type = CN_CBOR_RAW;
+  ret->length = len;
+  ret->v.bytes = data;
+
+  return ret;
+}
+
 cn_cbor* cn_cbor_string_create(const char* data
                                CBOR_CONTEXT,
                                cn_cbor_errback *errp)
@@ -55,6 +152,17 @@ cn_cbor* cn_cbor_string_create(const char* data
   return ret;
 }
 
+static void _set_int(cn_cbor* cb, int64_t value)
+{
+  if (value<0) {
+    cb->type = CN_CBOR_INT;
+    cb->v.sint = value;
+  } else {
+    cb->type = CN_CBOR_UINT;
+    cb->v.uint = value;
+  }
+}
+
 cn_cbor* cn_cbor_int_create(int64_t value
                             CBOR_CONTEXT,
                             cn_cbor_errback *errp)
@@ -62,13 +170,7 @@ cn_cbor* cn_cbor_int_create(int64_t value
   cn_cbor* ret;
   INIT_CB(ret);
 
-  if (value<0) {
-    ret->type = CN_CBOR_INT;
-    ret->v.sint = value;
-  } else {
-    ret->type = CN_CBOR_UINT;
-    ret->v.uint = value;
-  }
+  _set_int(ret, value);
 
   return ret;
 }
@@ -101,6 +203,18 @@ cn_cbor* cn_cbor_double_create(double value
 }
 #endif /* CBOR_NO_FLOAT */
 
+void cn_cbor_mark_dirty(cn_cbor* cb)
+{
+  /* Only arrays and maps have spans.  One without a span can still have
+     ancestors with one (those around a stringref namespace), so go all
+     the way up. */
+  for (; cb; cb = cb->parent) {
+    if (cb->type == CN_CBOR_ARRAY || cb->type == CN_CBOR_MAP) {
+      cb->flags &= ~CN_CBOR_FL_SPAN;
+    }
+  }
+}
+
 static bool _append_kv(cn_cbor *cb_map, cn_cbor *key, cn_cbor *val)
 {
   //Connect key and value and insert them into the map.
@@ -116,6 +230,7 @@ static bool _append_kv(cn_cbor *cb_map, cn_cbor *key, cn_cbor *val)
   }
   cb_map->last_child = val;
   cb_map->length += 2;
+  cn_cbor_mark_dirty(cb_map);
   return true;
 }
 
@@ -202,9 +317,225 @@ bool cn_cbor_array_append(cn_cbor* cb_array,
   }
   cb_array->last_child = cb_value;
   cb_array->length++;
+  cn_cbor_mark_dirty(cb_array);
   return true;
 }
 
+/* Allocate a container and its `count` children as one block, with the
+   children already linked in order.  They are marked so that
+   cn_cbor_free leaves them to the container, which is at the start of
+   the block. */
+static cn_cbor* _block_create(cn_cbor_type type, size_t count
+                              CBOR_CONTEXT,
+                              cn_cbor_errback *errp)
+{
+  cn_cbor* ret;
+  size_t i;
+
+  if (errp) {errp->err = CN_CBOR_NO_ERROR;}
+  if (count > INT_MAX) {
+    if (errp) {errp->err = CN_CBOR_ERR_INVALID_PARAMETER;}
+    return NULL;
+  }
+  ret = CN_CALLOC_N_CONTEXT(count + 1, sizeof(cn_cbor));
+  if (!ret) {
+    if (errp) {errp->err = CN_CBOR_ERR_OUT_OF_MEMORY;}
+    return NULL;
+  }
+  ret->type = type;
+  ret->flags = CN_CBOR_FL_COUNT;
+  ret->length = count;
+  if (count) {
+    ret->first_child = &ret[1];
+    ret->last_child = &ret[count];
+  }
+  for (i = 1; i <= count; i++) {
+    ret[i].flags = CN_CBOR_FL_BLOCK;
+    ret[i].parent = ret;
+    ret[i].next = i < count ? &ret[i + 1] : NULL;
+  }
+  return ret;
+}
+
+cn_cbor* cn_cbor_int_array_create(const int64_t* values, size_t count
+                                  CBOR_CONTEXT,
+                                  cn_cbor_errback *errp)
+{
+  cn_cbor* ret;
+  size_t i;
+
+  ret = _block_create(CN_CBOR_ARRAY, count CBOR_CONTEXT_PARAM, errp);
+  if (!ret) { return NULL; }
+  for (i = 0; i < count; i++) {
+    _set_int(&ret[i + 1], values[i]);
+  }
+  return ret;
+}
+
+cn_cbor* cn_cbor_string_array_create(const char* const* values, size_t count
+                                     CBOR_CONTEXT,
+                                     cn_cbor_errback *errp)
+{
+  cn_cbor* ret;
+  size_t i;
+
+  ret = _block_create(CN_CBOR_ARRAY, count CBOR_CONTEXT_PARAM, errp);
+  if (!ret) { return NULL; }
+  for (i = 0; i < count; i++) {
+    ret[i + 1].type = CN_CBOR_TEXT;
+    ret[i + 1].length = strlen(values[i]);
+    ret[i + 1].v.str = values[i];
+  }
+  return ret;
+}
+
+cn_cbor* cn_cbor_data_array_create(const uint8_t* const* values,
+                                   const int* lengths, size_t count
+                                   CBOR_CONTEXT,
+                                   cn_cbor_errback *errp)
+{
+  cn_cbor* ret;
+  size_t i;
+
+  ret = _block_create(CN_CBOR_ARRAY, count CBOR_CONTEXT_PARAM, errp);
+  if (!ret) { return NULL; }
+  for (i = 0; i < count; i++) {
+    ret[i + 1].type = CN_CBOR_BYTES;
+    ret[i + 1].length = lengths[i];
+    ret[i + 1].v.bytes = values[i];
+  }
+  return ret;
+}
+
+/* The map for the _from_pairs functions, with the values filled in */
+static cn_cbor* _pairs_create(const cn_cbor* values, size_t count
+                              CBOR_CONTEXT,
+                              cn_cbor_errback *errp)
+{
+  cn_cbor* ret;
+  cn_cbor* p;
+  size_t i;
+
+  for (i = 0; i < count; i++) {
+    if (values[i].first_child) {
+      if (errp) {errp->err = CN_CBOR_ERR_INVALID_PARAMETER;}
+      return NULL;
+    }
+  }
+  if (count > INT_MAX / 2) {
+    if (errp) {errp->err = CN_CBOR_ERR_INVALID_PARAMETER;}
+    return NULL;
+  }
+  ret = _block_create(CN_CBOR_MAP, 2 * count CBOR_CONTEXT_PARAM, errp);
+  if (!ret) { return NULL; }
+  for (i = 0; i < count; i++) {
+    p = &ret[2 * i + 2];
+    p->type = values[i].type;
+    p->flags |= values[i].flags & CN_CBOR_FL_INDEF;
+    p->v = values[i].v;
+    p->length = values[i].length;
+    if (_is_inline(&values[i])) {
+      p->x = values[i].x;
+      p->v.str = p->x.str;
+      p->flags |= CN_CBOR_FL_OWNER;
+    }
+  }
+  return ret;
+}
+
+cn_cbor* cn_cbor_map_create_from_pairs(const char* const* keys,
+                                       const cn_cbor* values, size_t count
+                                       CBOR_CONTEXT,
+                                       cn_cbor_errback *errp)
+{
+  cn_cbor* ret;
+  size_t i;
+
+  ret = _pairs_create(values, count CBOR_CONTEXT_PARAM, errp);
+  if (!ret) { return NULL; }
+  for (i = 0; i < count; i++) {
+    ret[2 * i + 1].type = CN_CBOR_TEXT;
+    ret[2 * i + 1].length = strlen(keys[i]);
+    ret[2 * i + 1].v.str = keys[i];
+  }
+  return ret;
+}
+
+cn_cbor* cn_cbor_map_create_from_int_pairs(const int64_t* keys,
+                                           const cn_cbor* values, size_t count
+                                           CBOR_CONTEXT,
+                                           cn_cbor_errback *errp)
+{
+  cn_cbor* ret;
+  size_t i;
+
+  ret = _pairs_create(values, count CBOR_CONTEXT_PARAM, errp);
+  if (!ret) { return NULL; }
+  for (i = 0; i < count; i++) {
+    _set_int(&ret[2 * i + 1], keys[i]);
+  }
+  return ret;
+}
+
+cn_cbor* cn_cbor_clone(const cn_cbor* cb
+                       CBOR_CONTEXT,
+                       cn_cbor_errback *errp)
+{
+  const cn_cbor* p = cb;
+  cn_cbor* parent = NULL;     /* the copy of p->parent */
+  cn_cbor* ret = NULL;
+  cn_cbor* copy;
+
+  if (!cb) {
+    if (errp) {errp->err = CN_CBOR_ERR_INVALID_PARAMETER;}
+    return NULL;
+  }
+  if (errp) {errp->err = CN_CBOR_NO_ERROR;}
+  for (;;) {
+    copy = CN_CALLOC_CONTEXT();
+    if (!copy) {
+      cn_cbor_free(ret CBOR_CONTEXT_PARAM);
+      if (errp) {errp->err = CN_CBOR_ERR_OUT_OF_MEMORY;}
+      return NULL;
+    }
+    copy->type = p->type;
+    copy->flags = p->flags &
+      ~(CN_CBOR_FL_OWNER | CN_CBOR_FL_ARENA | CN_CBOR_FL_BLOCK);
+    copy->v = p->v;
+    copy->length = p->length;
+    copy->x = p->x;
+    if (_is_inline(p)) {        /* the only strings that are copied */
+      copy->v.str = copy->x.str;
+      copy->flags |= CN_CBOR_FL_OWNER;
+    }
+    if (parent) {
+      copy->parent = parent;
+      if (parent->last_child) {
+        parent->last_child->next = copy;
+      } else {
+        parent->first_child = copy;
+      }
+      parent->last_child = copy;
+    } else {
+      ret = copy;
+    }
+
+    if (p->first_child) {     /* go down */
+      parent = copy;
+      p = p->first_child;
+      continue;
+    }
+    while (p != cb && !p->next) { /* go up */
+      p = p->parent;
+      parent = parent->parent;
+    }
+    if (p == cb) {
+      return ret;
+    }
+    p = p->next;
+  }
+}
+
 #ifdef  __cplusplus
 }
 #endif
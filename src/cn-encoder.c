@@ -8,31 +8,66 @@ extern "C" {
 } /* Duh. */
 #endif
 
-#include <arpa/inet.h>
+#include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <stdbool.h>
 #include <assert.h>
+#include <limits.h>
+#include <sys/uio.h>
+#ifndef CBOR_NO_FLOAT
+#if defined(__F16C__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+#endif /* CBOR_NO_FLOAT */
 
 #include "cn-cbor/cn-cbor.h"
 #include "cbor.h"
 
-#define hton8p(p) (*(uint8_t*)(p))
-#define hton16p(p) (htons(*(uint16_t*)(p)))
-#define hton32p(p) (htonl(*(uint32_t*)(p)))
-static uint64_t hton64p(const uint8_t *p) {
-  /* TODO: does this work on both BE and LE systems? */
-  uint64_t ret = hton32p(p);
-  ret <<= 32;
-  ret |= hton32p(p+4);
-  return ret;
-}
+/* A string already written into the stringref namespace */
+typedef struct _stringref
+{
+  const uint8_t *ptr;
+  size_t len;
+  uint64_t index;
+  uint8_t ib;                   /* IB_BYTES or IB_TEXT */
+} cn_stringref;
+
+/* Open-addressed hash table of the strings in the namespace */
+typedef struct _stringref_table
+{
+  cn_stringref *slots;
+  size_t size;                  /* a power of two, or 0 */
+  uint64_t count;
+#ifdef USE_CBOR_CONTEXT
+  cn_cbor_context *context;
+#endif
+} cn_stringref_table;
+
+/* Scatter-gather output: segments of the buffer, and large strings */
+typedef struct _iov_state
+{
+  struct iovec *iov;
+  int count;
+  int size;
+  size_t threshold;             /* strings this long are referenced */
+  ssize_t start;                /* the buffer segment not yet in iov */
+  size_t referenced;            /* the bytes in referenced strings */
+} cn_iov_state;
 
 typedef struct _write_state
 {
   uint8_t *buf;
   ssize_t offset;
   ssize_t size;
+  cn_cbor_slot *slots;
+  size_t slot_count;
+  cn_stringref_table *refs;
+  const cn_cbor *refs_hold;     /* a nested namespace being written without refs */
+  unsigned int flags;           /* cn_cbor_encoder_flags */
+  cn_iov_state *iov;            /* scatter-gather output, or NULL */
 } cn_write_state;
 
 #define ensure_writable(sz) if ((ws->offset<0) || (ws->offset + (sz) >= ws->size)) { \
@@ -40,11 +75,6 @@ typedef struct _write_state
   return; \
 }
 
-#define write_byte_and_data(b, data, sz) \
-ws->buf[ws->offset++] = (b); \
-memcpy(ws->buf+ws->offset, (data), (sz)); \
-ws->offset += sz;
-
 #define write_byte(b) \
 ws->buf[ws->offset++] = (b); \
 
@@ -68,6 +98,10 @@ static uint8_t _xlate[] = {
   IB_TAG,      /* CN_CBOR_TAG */
   IB_PRIM,     /* CN_CBOR_SIMPLE */
   0xFF,        /* CN_CBOR_DOUBLE */
+  0xFF,        /* CN_CBOR_FLOAT */
+  IB_UNSIGNED, /* CN_CBOR_BIGNUM, if it fits */
+  IB_NEGATIVE, /* CN_CBOR_NEGBIGNUM, if it fits */
+  0xFF,        /* CN_CBOR_RAW */
   0xFF         /* CN_CBOR_INVALID */
 };
 
@@ -76,6 +110,106 @@ static inline bool is_indefinite(const cn_cbor *cb)
   return (cb->flags & CN_CBOR_FL_INDEF) != 0;
 }
 
+static inline bool is_chunked(const cn_cbor *cb)
+{
+  return cb->type == CN_CBOR_BYTES_CHUNKED || cb->type == CN_CBOR_TEXT_CHUNKED;
+}
+
+static inline int _head_size(uint64_t val)
+{
+  if (val < 24) {
+    return 1;
+  } else if (val < 256) {
+    return 2;
+  } else if (val < 65536) {
+    return 3;
+  } else if (val < 0x100000000L) {
+    return 5;
+  }
+  return 9;
+}
+
+static inline void _store_be16(uint8_t *p, uint16_t val)
+{
+  p[0] = (uint8_t)(val >> 8);
+  p[1] = (uint8_t)val;
+}
+
+static inline void _store_be32(uint8_t *p, uint32_t val)
+{
+  p[0] = (uint8_t)(val >> 24);
+  p[1] = (uint8_t)(val >> 16);
+  p[2] = (uint8_t)(val >> 8);
+  p[3] = (uint8_t)val;
+}
+
+static inline void _store_be64(uint8_t *p, uint64_t val)
+{
+  _store_be32(p, (uint32_t)(val >> 32));
+  _store_be32(p + 4, (uint32_t)val);
+}
+
+/* Write an initial byte and its argument, without any space checks.
+   The caller must have ensured that `_head_size(val)` bytes are available. */
+static inline int _put_head(uint8_t *p, uint8_t ib, uint64_t val)
+{
+  if (val < 24) {
+    p[0] = ib | (uint8_t)val;
+    return 1;
+  } else if (val < 256) {
+    p[0] = ib | AI_1;
+    p[1] = (uint8_t)val;
+    return 2;
+  } else if (val < 65536) {
+    p[0] = ib | AI_2;
+    _store_be16(p + 1, (uint16_t)val);
+    return 3;
+  } else if (val < 0x100000000L) {
+    p[0] = ib | AI_4;
+    _store_be32(p + 1, (uint32_t)val);
+    return 5;
+  }
+  p[0] = ib | AI_8;
+  _store_be64(p + 1, val);
+  return 9;
+}
+
+/* Write an initial byte and its argument in exactly `width` bytes, without
+   any space checks.  Returns -1 if the value does not fit. */
+static int _put_head_fixed(uint8_t *p, uint8_t ib, uint64_t val, int width)
+{
+  switch (width) {
+  case 1:
+    if (val > 0xff) { return -1; }
+    p[0] = ib | AI_1;
+    p[1] = (uint8_t)val;
+    break;
+  case 2:
+    if (val > 0xffff) { return -1; }
+    p[0] = ib | AI_2;
+    _store_be16(p + 1, (uint16_t)val);
+    break;
+  case 4:
+    if (val > 0xffffffffUL) { return -1; }
+    p[0] = ib | AI_4;
+    _store_be32(p + 1, (uint32_t)val);
+    break;
+  case 8:
+    p[0] = ib | AI_8;
+    _store_be64(p + 1, val);
+    break;
+  default:
+    return -1;
+  }
+  return 1 + width;
+}
+
+static void _write_head(cn_write_state *ws, uint8_t ib, uint64_t val)
+{
+  ensure_writable(_head_size(val));
+  ws->offset += _put_head(ws->buf + ws->offset, ib, val);
+}
+
 static void _write_positive(cn_write_state *ws, cn_cbor_type typ, uint64_t val) {
   uint8_t ib;
 
@@ -87,144 +221,280 @@ static void _write_positive(cn_write_state *ws, cn_cbor_type typ, uint64_t val)
     return;
   }
 
-  if (val < 24) {
-    ensure_writable(1);
-    write_byte(ib | val);
-  } else if (val < 256) {
-    ensure_writable(2);
-    write_byte(ib | 24);
-    write_byte((uint8_t)val);
-  } else if (val < 65536) {
-    uint16_t be16 = (uint16_t)val;
-    ensure_writable(3);
-    be16 = hton16p(&be16);
-    write_byte_and_data(ib | 25, (const void*)&be16, 2);
-  } else if (val < 0x100000000L) {
-    uint32_t be32 = (uint32_t)val;
-    ensure_writable(5);
-    be32 = hton32p(&be32);
-    write_byte_and_data(ib | 26, (const void*)&be32, 4);
-  } else {
-    uint64_t be64;
-    ensure_writable(9);
-    be64 = hton64p((const uint8_t*)&val);
-    write_byte_and_data(ib | 27, (const void*)&be64, 8);
-  }
+  _write_head(ws, ib, val);
 }
 
 #ifndef CBOR_NO_FLOAT
+/* Write the shortest exact encoding of a double, without any space checks.
+   The caller must have ensured that 9 bytes are available.  The width is
+   found from the IEEE bits alone: a double fits a narrower format when
+   its exponent is in that format's range and the low mantissa bits that
+   the format cannot hold are all zero. */
+static int _put_double(uint8_t *p, double val)
+{
+  union {
+    double d;
+    uint64_t u;
+  } u64;
+  uint64_t mant, sig;
+  int exp, drop;
+
+  u64.d = val;
+  mant = u64.u & 0xfffffffffffffULL;
+  exp = (int)((u64.u >> 52) & 0x7ff) - 1023;
+  if (exp == 1024 || (exp == -1023 && !mant)) {
+    p[0] = IB_FLOAT2;
+    if (exp == 1024 && mant) {  /* NaN -- we always write a half NaN */
+      p[1] = 0x7e;
+    } else {                    /* Inf, 0.0 and their negatives */
+      p[1] = ((u64.u >> 56) & 0x80) | (exp == 1024 ? 0x7c : 0);
+    }
+    p[2] = 0;
+    return 3;
+  }
+  sig = mant | 1ULL << 52;      /* only used for normals */
+  if (exp >= -24 && exp <= 15) {
+    drop = exp < -14 ? 28 - exp : 42; /* half subnormals lose more bits */
+    if (!(mant & ((1ULL << drop) - 1))) {
+      p[0] = IB_FLOAT2;
+      _store_be16(p + 1, (uint16_t)(((u64.u >> 48) & 0x8000) |
+                                    (exp < -14 ? sig >> drop :
+                                     (uint64_t)(exp + 15) << 10 | mant >> 42)));
+      return 3;
+    }
+  }
+  if (exp >= -149 && exp <= 127) {
+    drop = exp < -126 ? -97 - exp : 29;
+    if (!(mant & ((1ULL << drop) - 1))) {
+      p[0] = IB_FLOAT4;
+      _store_be32(p + 1, (uint32_t)(((u64.u >> 32) & 0x80000000) |
+                                    (exp < -126 ? sig >> drop :
+                                     (uint64_t)(exp + 127) << 23 | mant >> 29)));
+      return 5;
+    }
+  }
+  p[0] = IB_FLOAT8;             /* including the subnormal doubles */
+  _store_be64(p + 1, u64.u);
+  return 9;
+}
+
 static void _write_double(cn_write_state *ws, double val)
 {
-  float float_val = val;
-  if (float_val == val) {                /* 32 bits is enough and we aren't NaN */
-    uint32_t be32;
-    uint16_t be16, u16;
-    union {
-      float f;
-      uint32_t u;
-    } u32;
-    u32.f = float_val;
-    if ((u32.u & 0x1FFF) == 0) { /* worth trying half */
-      int s16 = (u32.u >> 16) & 0x8000;
-      int exp = (u32.u >> 23) & 0xff;
-      int mant = u32.u & 0x7fffff;
-      if (exp == 0 && mant == 0)
-        ;              /* 0.0, -0.0 */
-      else if (exp >= 113 && exp <= 142) /* normalized */
-        s16 += ((exp - 112) << 10) + (mant >> 13);
-      else if (exp >= 103 && exp < 113) { /* denorm, exp16 = 0 */
-        if (mant & ((1 << (126 - exp)) - 1))
-          goto float32;         /* loss of precision */
-        s16 += ((mant + 0x800000) >> (126 - exp));
-      } else if (exp == 255 && mant == 0) { /* Inf */
-        s16 += 0x7c00;
-      } else
-        goto float32;           /* loss of range */
-
-      ensure_writable(3);
-      u16 = s16;
-      be16 = hton16p((const uint8_t*)&u16);
-
-      write_byte_and_data(IB_PRIM | 25, (const void*)&be16, 2);
+  uint8_t tmp[9];
+  int sz;
+  union {
+    double d;
+    uint64_t u;
+  } u64;
+
+  if (ws->flags & CN_CBOR_ENCODE_FLOAT64) {
+    u64.d = val;
+    tmp[0] = IB_FLOAT8;
+    _store_be64(tmp + 1, u64.u);
+    sz = 9;
+  } else {
+    sz = _put_double(tmp, val);
+  }
+
+  ensure_writable(sz);
+  memcpy(ws->buf+ws->offset, tmp, sz);
+  ws->offset += sz;
+}
+#endif /* CBOR_NO_FLOAT */
+
+#define CHECK(st) (st); \
+if (ws->offset < 0) { return; }
+
+/* End the current segment of the buffer, if it is not empty */
+static void _iov_flush(cn_write_state *ws)
+{
+  cn_iov_state *v = ws->iov;
+
+  if (ws->offset == v->start) {
+    return;
+  }
+  if (v->count == v->size) {
+    ws->offset = -1;
+    return;
+  }
+  v->iov[v->count].iov_base = ws->buf + v->start;
+  v->iov[v->count].iov_len = ws->offset - v->start;
+  v->count++;
+  v->start = ws->offset;
+}
+
+/* Write the content of a string; in scatter-gather mode, large ones are
+   referenced where they are instead. */
+static void _write_bytes(cn_write_state *ws, const uint8_t *data, size_t len)
+{
+  cn_iov_state *v = ws->iov;
+
+  if (v && len && len >= v->threshold) {
+    CHECK(_iov_flush(ws));
+    if (v->count == v->size) {
+      ws->offset = -1;
       return;
     }
-  float32:
-    ensure_writable(5);
-    be32 = hton32p((const uint8_t*)&u32.u);
+    v->iov[v->count].iov_base = (void *)data;
+    v->iov[v->count].iov_len = len;
+    v->count++;
+    v->referenced += len;
+    return;
+  }
+  ensure_writable((ssize_t)len);
+  memcpy(ws->buf + ws->offset, data, len);
+  ws->offset += len;
+}
 
-    write_byte_and_data(IB_PRIM | 26, (const void*)&be32, 4);
+static void _write_string(cn_write_state *ws, uint8_t ib,
+                          const uint8_t *data, size_t len)
+{
+  CHECK(_write_head(ws, ib, len));
+  _write_bytes(ws, data, len);
+}
 
-  } else if (val != val) {      /* NaN -- we always write a half NaN*/
-    ensure_writable(3);
-    write_byte_and_data(IB_PRIM | 25, (const void*)"\x7e\x00", 2);
-  } else {
-    uint64_t be64;
-    /* Copy the same problematic implementation from the decoder. */
-    union {
-      double d;
-      uint64_t u;
-    } u64;
+/* Write an integer that might be a patchable slot */
+static void _write_slot(cn_write_state *ws, const cn_cbor *cb,
+                        uint8_t ib, uint64_t val)
+{
+  size_t i;
+  int sz;
 
-    u64.d = val;
+  for (i = 0; i < ws->slot_count; i++) {
+    if (ws->slots[i].cb == cb) {
+      ensure_writable(1 + ws->slots[i].width);
+      sz = _put_head_fixed(ws->buf + ws->offset, ib, val, ws->slots[i].width);
+      if (sz < 0) {
+        ws->offset = -1;
+        return;
+      }
+      ws->slots[i].offset = ws->offset;
+      ws->offset += sz;
+      return;
+    }
+  }
+  _write_head(ws, ib, val);
+}
 
-    ensure_writable(9);
-    be64 = hton64p((const uint8_t*)&u64.u);
+static size_t _stringref_hash(uint8_t ib, const uint8_t *p, size_t len)
+{
+  uint32_t h = 2166136261u ^ ib; /* FNV-1a */
+  while (len--) {
+    h ^= *p++;
+    h *= 16777619u;
+  }
+  return h;
+}
 
-    write_byte_and_data(IB_PRIM | 27, (const void*)&be64, 8);
+/* The slot for a string: either the one holding it, or the empty one
+   where it would go. */
+static cn_stringref *_stringref_find(const cn_stringref_table *t, uint8_t ib,
+                                     const uint8_t *p, size_t len)
+{
+  size_t i = _stringref_hash(ib, p, len) & (t->size - 1);
+  cn_stringref *e;
 
+  for (;; i = (i + 1) & (t->size - 1)) {
+    e = &t->slots[i];
+    if (!e->ptr ||
+        (e->ib == ib && e->len == len && memcmp(e->ptr, p, len) == 0)) {
+      return e;
+    }
   }
 }
-#endif /* CBOR_NO_FLOAT */
 
-// TODO: make public?
-typedef void (*cn_visit_func)(const cn_cbor *cb, int depth, void *context);
-static void _visit(const cn_cbor *cb,
-                   cn_visit_func visitor,
-                   cn_visit_func breaker,
-                   void *context)
-{
-    const cn_cbor *p = cb;
-    int depth = 0;
-    while (p)
-    {
-visit:
-      visitor(p, depth, context);
-      if (p->first_child) {
-        p = p->first_child;
-        depth++;
-      } else{
-        // Empty indefinite
-        if (is_indefinite(p)) {
-          breaker(p->parent, depth, context);
-        }
-        if (p->next) {
-          p = p->next;
-        } else {
-          while (p->parent) {
-            depth--;
-            if (is_indefinite(p->parent)) {
-              breaker(p->parent, depth, context);
-            }
-            if (p->parent->next) {
-              p = p->parent->next;
-              goto visit;
-            }
-            p = p->parent;
-          }
-          return;
-        }
+static bool _stringref_grow(cn_stringref_table *t)
+{
+#ifdef USE_CBOR_CONTEXT
+  cn_cbor_context *context = t->context;
+#endif
+  cn_stringref_table bigger = *t;
+  size_t i;
+
+  bigger.size = t->size ? 2 * t->size : 16;
+  bigger.slots = CN_CALLOC_N_CONTEXT(bigger.size, sizeof(cn_stringref));
+  if (!bigger.slots) {
+    return false;
+  }
+  for (i = 0; i < t->size; i++) {
+    if (t->slots[i].ptr) {
+      *_stringref_find(&bigger, t->slots[i].ib,
+                       t->slots[i].ptr, t->slots[i].len) = t->slots[i];
+    }
+  }
+  if (t->slots) {
+    CN_CBOR_FREE_CONTEXT(t->slots);
+  }
+  *t = bigger;
+  return true;
+}
+
+/* Write a string, or a reference to it if it was written before */
+static void _write_stringref(cn_write_state *ws, const cn_cbor *cb)
+{
+  cn_stringref_table *t = ws->refs;
+  uint8_t ib = _xlate[cb->type];
+  cn_stringref *e = NULL;
+
+  if (t->size) {
+    e = _stringref_find(t, ib, cb->v.bytes, cb->length);
+    if (e->ptr) {
+      CHECK(_write_head(ws, IB_TAG, TAG_STRINGREF));
+      _write_head(ws, IB_UNSIGNED, e->index);
+      return;
+    }
+  }
+  if (STRINGREF_WORTHY(t->count, (size_t)cb->length)) {
+    if (4 * (t->count + 1) > 3 * t->size) {
+      if (!_stringref_grow(t)) {
+        ws->offset = -1;
+        return;
       }
+      e = NULL;
     }
+    if (!e) {
+      e = _stringref_find(t, ib, cb->v.bytes, cb->length);
+    }
+    e->ptr = cb->v.bytes;
+    e->len = cb->length;
+    e->ib = ib;
+    e->index = t->count++;
+  }
+  _write_string(ws, ib, cb->v.bytes, cb->length);
 }
 
-#define CHECK(st) (st); \
-if (ws->offset < 0) { return; }
+/* Skip the leading zeros of a bignum's magnitude */
+static void _bignum_strip(const uint8_t **p, size_t *len)
+{
+  while (*len && !**p) {
+    (*p)++;
+    (*len)--;
+  }
+}
 
-void _encoder_visitor(const cn_cbor *cb, int depth, void *context)
+/* Write a bignum as an integer if it fits, and as a tagged byte string
+   otherwise, in both cases without leading zeros. */
+static void _write_bignum(cn_write_state *ws, const cn_cbor *cb)
 {
-  cn_write_state *ws = context;
-  UNUSED_PARAM(depth);
+  const uint8_t *p = cb->v.bytes;
+  size_t len = cb->length;
+  uint64_t val = 0;
 
+  _bignum_strip(&p, &len);
+  if (len <= 8) {
+    while (len--) {
+      val = val << 8 | *p++;
+    }
+    CHECK(_write_positive(ws, cb->type, val));
+    return;
+  }
+  CHECK(_write_head(ws, IB_TAG, cb->type == CN_CBOR_BIGNUM ?
+                    TAG_BIGNUM : TAG_BIGNUM_NEG));
+  _write_string(ws, IB_BYTES, p, len);
+}
+
+static void _encode_item(cn_write_state *ws, const cn_cbor *cb)
+{
   switch (cb->type) {
   case CN_CBOR_ARRAY:
     if (is_indefinite(cb)) {
@@ -247,10 +517,7 @@ void _encoder_visitor(const cn_cbor *cb, int depth, void *context)
 
   case CN_CBOR_TEXT:
   case CN_CBOR_BYTES:
-    CHECK(_write_positive(ws, cb->type, cb->length));
-    ensure_writable(cb->length);
-    memcpy(ws->buf+ws->offset, cb->v.str, cb->length);
-    ws->offset += cb->length;
+    CHECK(_write_string(ws, _xlate[cb->type], cb->v.bytes, cb->length));
     break;
 
   case CN_CBOR_FALSE:
@@ -260,17 +527,39 @@ void _encoder_visitor(const cn_cbor *cb, int depth, void *context)
     write_byte_ensured(_xlate[cb->type]);
     break;
 
-  case CN_CBOR_TAG:
   case CN_CBOR_UINT:
+    if (ws->slots) {
+      CHECK(_write_slot(ws, cb, IB_UNSIGNED, cb->v.uint));
+      break;
+    }
+    /* fall through */
+  case CN_CBOR_TAG:
   case CN_CBOR_SIMPLE:
     CHECK(_write_positive(ws, cb->type, cb->v.uint));
     break;
 
   case CN_CBOR_INT:
     assert(cb->v.sint < 0);
+    if (ws->slots) {
+      CHECK(_write_slot(ws, cb, IB_NEGATIVE, ~(cb->v.sint)));
+      break;
+    }
     CHECK(_write_positive(ws, CN_CBOR_INT, ~(cb->v.sint)));
     break;
 
+  case CN_CBOR_BIGNUM:
+  case CN_CBOR_NEGBIGNUM:
+    CHECK(_write_bignum(ws, cb));
+    break;
+
+  case CN_CBOR_RAW:
+    if (ws->refs && !ws->refs_hold) {
+      ws->offset = -1;          /* its strings are not in the table */
+      break;
+    }
+    CHECK(_write_bytes(ws, cb->v.bytes, cb->length));
+    break;
+
   case CN_CBOR_DOUBLE:
 #ifndef CBOR_NO_FLOAT
     CHECK(_write_double(ws, cb->v.dbl));
@@ -288,12 +577,104 @@ void _encoder_visitor(const cn_cbor *cb, int depth, void *context)
   }
 }
 
-void _encoder_breaker(const cn_cbor *cb, int depth, void *context)
+/* Open the container `p` at `depth` */
+static inline void _stack_push(const cn_cbor **stack, int depth,
+                               const cn_cbor *p)
+{
+  if (depth < CN_CBOR_ENCODER_MAX_DEPTH) {
+    stack[depth] = p;
+  }
+}
+
+/* The container open at `depth`, of which `p` is a child: from the
+   stack if it fits there, and otherwise through the `parent` pointer */
+static inline const cn_cbor *_stack_at(const cn_cbor *const *stack,
+                                       int depth, const cn_cbor *p)
 {
-  cn_write_state *ws = context;
-  UNUSED_PARAM(cb);
-  UNUSED_PARAM(depth);
-  write_byte_ensured(IB_BREAK);
+  return depth < CN_CBOR_ENCODER_MAX_DEPTH ? stack[depth] : p->parent;
+}
+
+/* Walk the tree in document order.  Instead of climbing back up through
+   the `parent` pointers, the open containers are kept on a bounded stack,
+   so the walk never leaves the subtree rooted at `cb`; only containers
+   nested deeper than the stack are climbed out of through `parent`. */
+static void _encode(cn_write_state *ws, const cn_cbor *cb, int max_depth)
+{
+  const cn_cbor *stack[CN_CBOR_ENCODER_MAX_DEPTH];
+  const cn_cbor *p = cb;
+  int depth = 0;
+
+  if (!p) {
+    return;
+  }
+  for (;;) {
+    if ((p->flags & CN_CBOR_FL_SPAN) && !ws->slots && !ws->refs &&
+        !(ws->flags & CN_CBOR_ENCODE_FLOAT64)) {
+      /* unchanged since decoding, and to be written as it was */
+      CHECK(_write_bytes(ws, p->v.bytes, p->x.span));
+    } else {
+      if (ws->refs && !ws->refs_hold &&
+          p->type == CN_CBOR_TAG && p->v.uint == TAG_STRINGREF_NS) {
+        ws->refs_hold = p;      /* the decoder starts a new namespace */
+      }
+      if (ws->refs && !ws->refs_hold &&
+          (p->type == CN_CBOR_TEXT || p->type == CN_CBOR_BYTES) &&
+          !(depth > 0 && is_chunked(_stack_at(stack, depth - 1, p)))) {
+        CHECK(_write_stringref(ws, p)); /* chunks are written as they are */
+      } else {
+        CHECK(_encode_item(ws, p));
+      }
+      if (p->first_child) {
+        if (depth >= max_depth) {
+          ws->offset = -1;
+          return;
+        }
+        _stack_push(stack, depth++, p);
+        p = p->first_child;
+        continue;
+      }
+      if (is_indefinite(p)) {   /* empty indefinite */
+        write_byte_ensured(IB_BREAK);
+      }
+    }
+    while (depth > 0 && !p->next) {
+      --depth;
+      p = _stack_at(stack, depth, p);
+      if (p == ws->refs_hold) {
+        ws->refs_hold = NULL;
+      }
+      if (is_indefinite(p)) {
+        write_byte_ensured(IB_BREAK);
+      }
+    }
+    if (depth == 0) {
+      return;
+    }
+    p = p->next;
+  }
+}
+
+/* Set up the write state for the options; returns the depth limit */
+static int _apply_options(cn_write_state *ws,
+                          const cn_cbor_encoder_options *opts)
+{
+  int max_depth = INT_MAX;
+  size_t i;
+
+  if (opts) {
+    if (opts->max_depth > 0) {
+      max_depth = opts->max_depth;
+    }
+    ws->flags = opts->flags;
+    if (opts->slot_count) {
+      ws->slots = opts->slots;
+      ws->slot_count = opts->slot_count;
+      for (i = 0; i < ws->slot_count; i++) {
+        ws->slots[i].offset = -1;
+      }
+    }
+  }
+  return max_depth;
 }
 
 ssize_t cn_cbor_encoder_write(uint8_t *buf,
@@ -301,12 +682,463 @@ ssize_t cn_cbor_encoder_write(uint8_t *buf,
 			      size_t buf_size,
 			      const cn_cbor *cb)
 {
-  cn_write_state ws = { buf, buf_offset, buf_size };
-  _visit(cb, _encoder_visitor, _encoder_breaker, &ws);
+  return cn_cbor_encoder_write_opts(buf, buf_offset, buf_size, cb, NULL);
+}
+
+ssize_t cn_cbor_encoder_write_opts(uint8_t *buf,
+                                   size_t buf_offset,
+                                   size_t buf_size,
+                                   const cn_cbor *cb,
+                                   const cn_cbor_encoder_options *opts)
+{
+  cn_write_state ws = { buf, buf_offset, buf_size, NULL, 0, NULL, NULL, 0, NULL };
+
+  _encode(&ws, cb, _apply_options(&ws, opts));
+  if (ws.offset < 0) { return -1; }
+  return ws.offset - buf_offset;
+}
+
+ssize_t cn_cbor_encoder_write_iov(uint8_t *buf,
+                                  size_t buf_size,
+                                  struct iovec *iov,
+                                  int *iovcnt,
+                                  size_t threshold,
+                                  const cn_cbor *cb,
+                                  const cn_cbor_encoder_options *opts)
+{
+  cn_iov_state v = { iov, 0, *iovcnt, threshold, 0, 0 };
+  cn_write_state ws = { buf, 0, buf_size, NULL, 0, NULL, NULL, 0, &v };
+
+  if (!threshold) { return -1; }
+  _encode(&ws, cb, _apply_options(&ws, opts));
+  if (ws.offset >= 0) {
+    _iov_flush(&ws);
+  }
+  if (ws.offset < 0) { return -1; }
+  *iovcnt = v.count;
+  return ws.offset + v.referenced;
+}
+
+/* Where a stream is in the walk of _encode */
+enum {
+  STREAM_ITEM,                  /* p is to be written */
+  STREAM_AFTER,                 /* p has been written */
+  STREAM_NEXT,                  /* p and its children have been written */
+  STREAM_DONE,
+  STREAM_FAILED
+};
+
+bool cn_cbor_encoder_stream_init(cn_cbor_encoder_stream *st,
+                                 const cn_cbor *cb,
+                                 const cn_cbor_encoder_options *opts)
+{
+  cn_write_state ws = { NULL, 0, 0, NULL, 0, NULL, NULL, 0, NULL };
+
+  memset(st, 0, sizeof(*st));
+  st->p = cb;
+  st->phase = cb ? STREAM_ITEM : STREAM_DONE;
+  if (opts && opts->slot_count) {
+    st->phase = STREAM_FAILED;  /* the output is not in one buffer */
+    return false;
+  }
+  st->max_depth = _apply_options(&ws, opts);
+  st->flags = ws.flags;
+  return true;
+}
+
+/* Start writing the current item: its head goes into `pending`, and the
+   bytes that follow it, if any, into `content`. */
+static void _stream_item(cn_cbor_encoder_stream *st)
+{
+  const cn_cbor *p = st->p;
+  cn_write_state ws = { st->pending, 0, sizeof(st->pending),
+                        NULL, 0, NULL, NULL, st->flags, NULL };
+  const uint8_t *bytes = p->v.bytes;
+  size_t len = p->length;
+
+  if ((p->flags & CN_CBOR_FL_SPAN) && !(st->flags & CN_CBOR_ENCODE_FLOAT64)) {
+    len = p->x.span;
+  } else if (p->type == CN_CBOR_RAW) {
+    /* no head, the content is all of it */
+  } else if (p->type == CN_CBOR_BYTES || p->type == CN_CBOR_TEXT) {
+    _write_positive(&ws, p->type, len);
+  } else if (p->type == CN_CBOR_BIGNUM || p->type == CN_CBOR_NEGBIGNUM) {
+    _bignum_strip(&bytes, &len);
+    if (len <= 8) {
+      _write_bignum(&ws, p);
+      len = 0;
+    } else {
+      _write_head(&ws, IB_TAG, p->type == CN_CBOR_BIGNUM ?
+                  TAG_BIGNUM : TAG_BIGNUM_NEG);
+      _write_head(&ws, IB_BYTES, len);
+    }
+  } else {
+    _encode_item(&ws, p);
+    len = 0;
+  }
+  if (ws.offset < 0) {
+    st->phase = STREAM_FAILED;
+    return;
+  }
+  st->pending_len = ws.offset;
+  st->pending_at = 0;
+  st->content = bytes;
+  st->content_left = len;
+  st->phase = STREAM_AFTER;
+}
+
+ssize_t cn_cbor_encoder_stream_write(cn_cbor_encoder_stream *st,
+                                     uint8_t *buf, size_t buf_size)
+{
+  size_t written = 0;
+  size_t n;
+
+  for (;;) {
+    n = st->pending_len - st->pending_at;
+    if (n > buf_size - written) {
+      n = buf_size - written;
+    }
+    memcpy(buf + written, st->pending + st->pending_at, n);
+    st->pending_at += n;
+    written += n;
+    if (st->pending_at < st->pending_len) {
+      return written;           /* full */
+    }
+    n = st->content_left;
+    if (n > buf_size - written) {
+      n = buf_size - written;
+    }
+    if (n) {
+      memcpy(buf + written, st->content, n);
+      st->content += n;
+      st->content_left -= n;
+      written += n;
+    }
+    if (st->content_left) {
+      return written;
+    }
+    st->pending_len = st->pending_at = 0;
+
+    /* the same steps as _encode, one at a time */
+    switch (st->phase) {
+    case STREAM_ITEM:
+      _stream_item(st);
+      break;
+    case STREAM_AFTER:
+      st->phase = STREAM_NEXT;
+      if ((st->p->flags & CN_CBOR_FL_SPAN) &&
+          !(st->flags & CN_CBOR_ENCODE_FLOAT64)) {
+        break;
+      }
+      if (st->p->first_child) {
+        if (st->depth >= st->max_depth) {
+          st->phase = STREAM_FAILED;
+          break;
+        }
+        _stack_push(st->stack, st->depth++, st->p);
+        st->p = st->p->first_child;
+        st->phase = STREAM_ITEM;
+      } else if (is_indefinite(st->p)) { /* empty indefinite */
+        st->pending[st->pending_len++] = IB_BREAK;
+      }
+      break;
+    case STREAM_NEXT:
+      if (st->depth == 0) {
+        st->phase = STREAM_DONE;
+      } else if (st->p->next) {
+        st->p = st->p->next;
+        st->phase = STREAM_ITEM;
+      } else {
+        --st->depth;
+        st->p = _stack_at(st->stack, st->depth, st->p);
+        if (is_indefinite(st->p)) {
+          st->pending[st->pending_len++] = IB_BREAK;
+        }
+      }
+      break;
+    case STREAM_DONE:
+      return written;
+    default:
+      return -1;
+    }
+  }
+}
+
+bool cn_cbor_encoder_stream_done(const cn_cbor_encoder_stream *st)
+{
+  return st->phase == STREAM_DONE && st->pending_at == st->pending_len &&
+    !st->content_left;
+}
+
+ssize_t cn_cbor_encoder_write_stringref(uint8_t *buf,
+                                        size_t buf_offset,
+                                        size_t buf_size,
+                                        const cn_cbor *cb
+                                        CBOR_CONTEXT)
+{
+  cn_stringref_table refs;
+  cn_write_state ws = { buf, buf_offset, buf_size, NULL, 0, &refs, NULL, 0, NULL };
+
+  memset(&refs, 0, sizeof(refs));
+#ifdef USE_CBOR_CONTEXT
+  refs.context = context;
+#endif
+  _write_head(&ws, IB_TAG, TAG_STRINGREF_NS);
+  if (ws.offset >= 0) {
+    _encode(&ws, cb, INT_MAX);
+  }
+  if (refs.slots) {
+    CN_CBOR_FREE_CONTEXT(refs.slots);
+  }
+  if (ws.offset < 0) { return -1; }
+  return ws.offset - buf_offset;
+}
+
+ssize_t cn_cbor_head_encode(uint8_t *buf,
+                            size_t buf_offset,
+                            size_t buf_size,
+                            int mt,
+                            uint64_t val)
+{
+  cn_write_state ws = { buf, buf_offset, buf_size, NULL, 0, NULL, NULL, 0, NULL };
+
+  if (mt < MT_UNSIGNED || mt > MT_PRIM) { return -1; }
+  _write_head(&ws, (uint8_t)(mt << 5), val);
+  if (ws.offset < 0) { return -1; }
+  return ws.offset - buf_offset;
+}
+
+static void _write_int(cn_write_state *ws, int64_t val)
+{
+  if (val < 0) {
+    _write_head(ws, IB_NEGATIVE, ~(uint64_t)val);
+  } else {
+    _write_head(ws, IB_UNSIGNED, val);
+  }
+}
+
+static void _write_field(cn_write_state *ws, const cn_cbor_field *f,
+                         const uint8_t *in)
+{
+  const void *src = in + f->offset;
+  const cn_cbor_string *str;
+
+  if (f->key) {
+    CHECK(_write_string(ws, IB_TEXT, (const uint8_t *)f->key, strlen(f->key)));
+  } else {
+    CHECK(_write_int(ws, f->int_key));
+  }
+  switch (f->type) {
+  case CN_CBOR_FIELD_UINT64:
+    _write_head(ws, IB_UNSIGNED, *(const uint64_t *)src);
+    break;
+  case CN_CBOR_FIELD_INT64:
+    _write_int(ws, *(const int64_t *)src);
+    break;
+  case CN_CBOR_FIELD_INT:
+    _write_int(ws, *(const int *)src);
+    break;
+  case CN_CBOR_FIELD_BOOL:
+    write_byte_ensured(*(const bool *)src ? IB_TRUE : IB_FALSE);
+    break;
+  case CN_CBOR_FIELD_TEXT:
+  case CN_CBOR_FIELD_BYTES:
+    str = src;
+    _write_string(ws, f->type == CN_CBOR_FIELD_TEXT ? IB_TEXT : IB_BYTES,
+                  str->ptr, str->length);
+    break;
+#ifndef CBOR_NO_FLOAT
+  case CN_CBOR_FIELD_DOUBLE:
+    _write_double(ws, *(const double *)src);
+    break;
+  case CN_CBOR_FIELD_FLOAT:
+    _write_double(ws, *(const float *)src);
+    break;
+#endif /* CBOR_NO_FLOAT */
+  default:
+    ws->offset = -1;
+  }
+}
+
+ssize_t cn_cbor_encode_from(uint8_t *buf,
+                            size_t buf_offset,
+                            size_t buf_size,
+                            const cn_cbor_fields *desc,
+                            const void *in,
+                            uint64_t present)
+{
+  cn_write_state ws = { buf, buf_offset, buf_size, NULL, 0, NULL, NULL, 0, NULL };
+  uint64_t count = 0;
+  size_t n;
+
+  if (desc->count > CN_CBOR_FIELDS_MAX) { return -1; }
+  for (n = 0; n < desc->count; n++) {
+    if (desc->fields[n].flags & CN_CBOR_FIELD_REQUIRED)
+      present |= (uint64_t)1 << n;
+    if (present & ((uint64_t)1 << n))
+      count++;
+  }
+  _write_head(&ws, IB_MAP, count);
+  for (n = 0; n < desc->count && ws.offset >= 0; n++) {
+    if (present & ((uint64_t)1 << n))
+      _write_field(&ws, &desc->fields[n], in);
+  }
+  if (ws.offset < 0) { return -1; }
+  return ws.offset - buf_offset;
+}
+
+#ifndef CBOR_NO_FLOAT
+ssize_t cn_cbor_double_encode(uint8_t *buf,
+                              size_t buf_offset,
+                              size_t buf_size,
+                              double val)
+{
+  cn_write_state ws = { buf, buf_offset, buf_size, NULL, 0, NULL, NULL, 0, NULL };
+  _write_double(&ws, val);
+  if (ws.offset < 0) { return -1; }
+  return ws.offset - buf_offset;
+}
+#endif /* CBOR_NO_FLOAT */
+
+bool cn_cbor_patch_int(uint8_t *buf, const cn_cbor_slot *slot, int64_t value)
+{
+  uint8_t tmp[9];
+
+  if (!buf || !slot || slot->offset < 0) {
+    return false;
+  }
+  /* Write all or nothing */
+  if (_put_head_fixed(tmp, value < 0 ? IB_NEGATIVE : IB_UNSIGNED,
+                      value < 0 ? ~(uint64_t)value : (uint64_t)value,
+                      slot->width) < 0) {
+    return false;
+  }
+  memcpy(buf + slot->offset, tmp, 1 + slot->width);
+  return true;
+}
+
+/* The bulk array writers check once whether the worst case encoding of
+   all of the elements fits, and if so write them without any further
+   checks.  Otherwise, they fall back to checking each element. */
+#define bulk_fits(count, max) \
+  ((count) <= (size_t)(ws->size / (max)) && \
+   ws->offset + (ssize_t)((count) * (max)) <= ws->size)
+
+static void _write_int_array(cn_write_state *ws, const int64_t *vals, size_t count)
+{
+  size_t i;
+
+  CHECK(_write_positive(ws, CN_CBOR_ARRAY, count));
+  if (bulk_fits(count, 9)) {
+    uint8_t *p = ws->buf + ws->offset;
+    for (i = 0; i < count; i++) {
+      int64_t v = vals[i];
+      uint8_t ib = v < 0 ? IB_NEGATIVE : IB_UNSIGNED;
+      p += _put_head(p, ib, v < 0 ? ~(uint64_t)v : (uint64_t)v);
+    }
+    ws->offset = p - ws->buf;
+  } else {
+    for (i = 0; i < count; i++) {
+      if (vals[i] < 0) {
+        CHECK(_write_positive(ws, CN_CBOR_INT, ~(uint64_t)vals[i]));
+      } else {
+        CHECK(_write_positive(ws, CN_CBOR_UINT, (uint64_t)vals[i]));
+      }
+    }
+  }
+}
+
+ssize_t cn_cbor_encoder_write_int_array(uint8_t *buf,
+                                        size_t buf_offset,
+                                        size_t buf_size,
+                                        const int64_t *vals,
+                                        size_t count)
+{
+  cn_write_state ws = { buf, buf_offset, buf_size, NULL, 0, NULL, NULL, 0, NULL };
+  if (!vals && count) { return -1; }
+  _write_int_array(&ws, vals, count);
   if (ws.offset < 0) { return -1; }
   return ws.offset - buf_offset;
 }
 
+#ifndef CBOR_NO_FLOAT
+/* As in cn_cbor_half_array_decode, the vector units are only used for
+   converting halves, which the scalar code does with bit operations;
+   the integer heads have no such instruction, and are left to the
+   compiler. */
+#if defined(__F16C__) || (defined(__ARM_NEON) && defined(__aarch64__))
+/* Write four doubles, without any space checks: as halves in one go if
+   they all are exact halves, and otherwise one by one. */
+static int _put_double4(uint8_t *p, const double *vals)
+{
+  uint16_t h[4];
+  int i, sz = 0;
+#if defined(__F16C__)
+  __m256d d = _mm256_loadu_pd(vals);
+  __m128i hv = _mm_cvtps_ph(_mm256_cvtpd_ps(d), _MM_FROUND_TO_NEAREST_INT);
+
+  if (_mm256_movemask_pd(_mm256_cmp_pd(_mm256_cvtps_pd(_mm_cvtph_ps(hv)), d,
+                                       _CMP_EQ_OQ)) == 0xf) {
+    _mm_storel_epi64((__m128i *)h, hv);
+#else
+  float64x2_t lo = vld1q_f64(vals), hi = vld1q_f64(vals + 2);
+  float16x4_t hv = vcvt_f16_f32(vcvt_high_f32_f64(vcvt_f32_f64(lo), hi));
+  float32x4_t back = vcvt_f32_f16(hv);
+  uint64x2_t eq = vandq_u64(vceqq_f64(vcvt_f64_f32(vget_low_f32(back)), lo),
+                            vceqq_f64(vcvt_high_f64_f32(back), hi));
+
+  if (vgetq_lane_u64(eq, 0) && vgetq_lane_u64(eq, 1)) {
+    vst1_u16(h, vreinterpret_u16_f16(hv));
+#endif
+    for (i = 0; i < 4; i++) {
+      p[3 * i] = IB_FLOAT2;
+      _store_be16(p + 3 * i + 1, h[i]);
+    }
+    return 12;
+  }
+  for (i = 0; i < 4; i++)
+    sz += _put_double(p + sz, vals[i]);
+  return sz;
+}
+#endif
+
+static void _write_double_array(cn_write_state *ws, const double *vals, size_t count)
+{
+  size_t i = 0;
+
+  CHECK(_write_positive(ws, CN_CBOR_ARRAY, count));
+  if (bulk_fits(count, 9)) {
+    uint8_t *p = ws->buf + ws->offset;
+#if defined(__F16C__) || (defined(__ARM_NEON) && defined(__aarch64__))
+    for (; i + 4 <= count; i += 4) {
+      p += _put_double4(p, vals + i);
+    }
+#endif
+    for (; i < count; i++) {
+      p += _put_double(p, vals[i]);
+    }
+    ws->offset = p - ws->buf;
+  } else {
+    for (; i < count; i++) {
+      CHECK(_write_double(ws, vals[i]));
+    }
+  }
+}
+
+ssize_t cn_cbor_encoder_write_double_array(uint8_t *buf,
+                                           size_t buf_offset,
+                                           size_t buf_size,
+                                           const double *vals,
+                                           size_t count)
+{
+  cn_write_state ws = { buf, buf_offset, buf_size, NULL, 0, NULL, NULL, 0, NULL };
+  if (!vals && count) { return -1; }
+  _write_double_array(&ws, vals, count);
+  if (ws.offset < 0) { return -1; }
+  return ws.offset - buf_offset;
+}
+#endif /* CBOR_NO_FLOAT */
+
 #ifdef  __cplusplus
 }
 #endif
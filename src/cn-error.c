@@ -9,5 +9,13 @@ const char *cn_cbor_error_str[] = {
  "CN_CBOR_ERR_WRONG_NESTING_IN_INDEF_STRING",
  "CN_CBOR_ERR_INVALID_PARAMETER",
  "CN_CBOR_ERR_OUT_OF_MEMORY",
- "CN_CBOR_ERR_FLOAT_NOT_SUPPORTED"
+ "CN_CBOR_ERR_FLOAT_NOT_SUPPORTED",
+ "CN_CBOR_ERR_MAX_DEPTH",
+ "CN_CBOR_ERR_MAX_ITEMS",
+ "CN_CBOR_ERR_MAX_BYTES",
+ "CN_CBOR_ERR_MAX_STRING_LENGTH",
+ "CN_CBOR_ERR_WRONG_TYPE",
+ "CN_CBOR_ERR_MISSING_FIELD",
+ "CN_CBOR_ERR_INVALID_STRINGREF",
+ "CN_CBOR_ERR_DUPLICATE_KEY"
 };
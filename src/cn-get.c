@@ -10,12 +10,12 @@ cn_cbor* cn_cbor_mapget_int(const cn_cbor* cb, int key) {
   for (cp = cb->first_child; cp && cp->next; cp = cp->next->next) {
     switch(cp->type) {
     case CN_CBOR_UINT:
-      if (cp->v.uint == (unsigned long)key) {
+      if (cp->v.uint == (uint64_t)key) {
         return cp->next;
       }
       break;
     case CN_CBOR_INT:
-      if (cp->v.sint == (long)key) {
+      if (cp->v.sint == (int64_t)key) {
         return cp->next;
       }
       break;
@@ -49,6 +49,33 @@ cn_cbor* cn_cbor_mapget_string(const cn_cbor* cb, const char* key) {
   return NULL;
 }
 
+cn_cbor* cn_cbor_mapget_key(const cn_cbor* cb,
+                            const cn_cbor_keydict *dict,
+                            int key_id) {
+  cn_cbor *cp;
+  const char *key;
+  uint32_t id = key_id + 1;
+  int keylen;
+  assert(cb);
+  assert(dict);
+  assert(key_id >= 0 && (size_t)key_id < dict->count);
+  key = dict->keys[key_id];
+  keylen = strlen(key);
+  for (cp = cb->first_child; cp && cp->next; cp = cp->next->next) {
+    if (cp->type != CN_CBOR_TEXT) {
+      continue;
+    }
+    if (cp->x.key_id && !(cp->flags & CN_CBOR_FL_OWNER)) {
+      if (cp->x.key_id == id) {
+        return cp->next;
+      }
+    } else if (keylen == cp->length && memcmp(key, cp->v.str, keylen) == 0) {
+      return cp->next;
+    }
+  }
+  return NULL;
+}
+
 cn_cbor* cn_cbor_index(const cn_cbor* cb, unsigned int idx) {
   cn_cbor *cp;
   unsigned int i = 0;
@@ -61,3 +88,97 @@ cn_cbor* cn_cbor_index(const cn_cbor* cb, unsigned int idx) {
   }
   return NULL;
 }
+
+cn_cbor_type cn_cbor_tape_type(const cn_cbor_tape *tape, size_t at) {
+  assert(tape && at < tape->count);
+  return CN_CBOR_TAPE_TYPE(tape->words[at]);
+}
+
+/* Whether an item on a tape is followed by an end word */
+static bool tape_is_container(cn_cbor_type type) {
+  switch (type) {
+  case CN_CBOR_BYTES_CHUNKED: case CN_CBOR_TEXT_CHUNKED:
+  case CN_CBOR_ARRAY: case CN_CBOR_MAP: case CN_CBOR_TAG:
+    return true;
+  default:
+    return false;
+  }
+}
+
+size_t cn_cbor_tape_next(const cn_cbor_tape *tape, size_t at) {
+  assert(tape && at < tape->count);
+  if (tape_is_container(CN_CBOR_TAPE_TYPE(tape->words[at]))) {
+    return tape->words[at + 1];
+  }
+  return at + 1;
+}
+
+size_t cn_cbor_tape_mapget_int(const cn_cbor_tape *tape, size_t at, int key) {
+  size_t cp, val, end;
+  cn_cbor k;
+  end = cn_cbor_tape_next(tape, at);   /* at + 1 if not a container */
+  for (cp = at + 2; cp < end; cp = cn_cbor_tape_next(tape, val)) {
+    val = cn_cbor_tape_next(tape, cp);
+    if (val >= end) {
+      break;
+    }
+    switch (cn_cbor_tape_type(tape, cp)) {
+    case CN_CBOR_UINT:
+      cn_cbor_tape_get(tape, cp, &k);
+      if (k.v.uint == (uint64_t)key) {
+        return val;
+      }
+      break;
+    case CN_CBOR_INT:
+      cn_cbor_tape_get(tape, cp, &k);
+      if (k.v.sint == (int64_t)key) {
+        return val;
+      }
+      break;
+    default:
+      ; // skip non-integer keys
+    }
+  }
+  return 0;
+}
+
+size_t cn_cbor_tape_mapget_string(const cn_cbor_tape *tape, size_t at,
+                                  const char *key) {
+  size_t cp, val, end;
+  cn_cbor k;
+  int keylen;
+  assert(key);
+  keylen = strlen(key);
+  end = cn_cbor_tape_next(tape, at);   /* at + 1 if not a container */
+  for (cp = at + 2; cp < end; cp = cn_cbor_tape_next(tape, val)) {
+    val = cn_cbor_tape_next(tape, cp);
+    if (val >= end) {
+      break;
+    }
+    switch (cn_cbor_tape_type(tape, cp)) {
+    case CN_CBOR_TEXT: // fall-through
+    case CN_CBOR_BYTES:
+      cn_cbor_tape_get(tape, cp, &k);
+      if (keylen == k.length && memcmp(key, k.v.str, keylen) == 0) {
+        return val;
+      }
+    default:
+      ; // skip non-string keys
+    }
+  }
+  return 0;
+}
+
+size_t cn_cbor_tape_index(const cn_cbor_tape *tape, size_t at,
+                          unsigned int idx) {
+  size_t cp, end;
+  unsigned int i = 0;
+  end = cn_cbor_tape_next(tape, at);   /* at + 1 if not a container */
+  for (cp = at + 2; cp < end; cp = cn_cbor_tape_next(tape, cp)) {
+    if (i == idx) {
+      return cp;
+    }
+    i++;
+  }
+  return 0;
+}
@@ -0,0 +1,67 @@
+#ifndef CN_PUBLISH_C
+#define CN_PUBLISH_C
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+#ifdef EMACS_INDENTATION_HELPER
+} /* Duh. */
+#endif
+
+#include <string.h>
+#include <sched.h>
+
+#include "cn-cbor/cn-cbor.h"
+#include "cbor.h"
+
+/* A reader announces the epoch it entered in before it loads the tree.
+   An update swaps the tree, then starts a new epoch, and waits for every
+   reader still in an older one; a reader seen idle, or in the new epoch,
+   can only load the new tree.  Everything is sequentially consistent, so
+   the reader's announcement is ordered before its load of the tree. */
+
+void cn_cbor_published_init(cn_cbor_published *pub,
+                            cn_cbor_reader *readers,
+                            size_t reader_count,
+                            cn_cbor *tree) {
+  memset(readers, 0, reader_count * sizeof(*readers));
+  pub->epoch = 1;               /* 0 is an idle reader */
+  pub->readers = readers;
+  pub->reader_count = reader_count;
+  __atomic_store_n(&pub->tree, tree, __ATOMIC_SEQ_CST);
+}
+
+const cn_cbor *cn_cbor_published_enter(cn_cbor_published *pub,
+                                       size_t reader) {
+  __atomic_store_n(&pub->readers[reader].epoch,
+                   __atomic_load_n(&pub->epoch, __ATOMIC_SEQ_CST),
+                   __ATOMIC_SEQ_CST);
+  return __atomic_load_n(&pub->tree, __ATOMIC_SEQ_CST);
+}
+
+void cn_cbor_published_exit(cn_cbor_published *pub, size_t reader) {
+  __atomic_store_n(&pub->readers[reader].epoch, 0, __ATOMIC_RELEASE);
+}
+
+void cn_cbor_published_update(cn_cbor_published *pub, cn_cbor *tree
+                              CBOR_CONTEXT) {
+  cn_cbor *old = __atomic_exchange_n(&pub->tree, tree, __ATOMIC_SEQ_CST);
+  uint64_t epoch = __atomic_add_fetch(&pub->epoch, 1, __ATOMIC_SEQ_CST);
+  uint64_t seen;
+  size_t i;
+
+  for (i = 0; i < pub->reader_count; i++) {
+    while ((seen = __atomic_load_n(&pub->readers[i].epoch,
+                                   __ATOMIC_SEQ_CST)) &&
+           seen < epoch) {
+      sched_yield();
+    }
+  }
+  cn_cbor_free(old CBOR_CONTEXT_PARAM);
+}
+
+#ifdef  __cplusplus
+}
+#endif
+
+#endif  /* CN_PUBLISH_C */
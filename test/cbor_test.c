@@ -5,8 +5,15 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stddef.h>
 #include <assert.h>
 #include <string.h>
+#include <math.h>
+#ifdef CBOR_PUBLISH
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#endif /* CBOR_PUBLISH */
 
 #include "cn-cbor/cn-cbor.h"
 
@@ -61,6 +68,14 @@ CTEST(cbor, error)
     ASSERT_STR(cn_cbor_error_str[CN_CBOR_ERR_INVALID_PARAMETER], "CN_CBOR_ERR_INVALID_PARAMETER");
     ASSERT_STR(cn_cbor_error_str[CN_CBOR_ERR_OUT_OF_MEMORY], "CN_CBOR_ERR_OUT_OF_MEMORY");
     ASSERT_STR(cn_cbor_error_str[CN_CBOR_ERR_FLOAT_NOT_SUPPORTED], "CN_CBOR_ERR_FLOAT_NOT_SUPPORTED");
+    ASSERT_STR(cn_cbor_error_str[CN_CBOR_ERR_MAX_DEPTH], "CN_CBOR_ERR_MAX_DEPTH");
+    ASSERT_STR(cn_cbor_error_str[CN_CBOR_ERR_MAX_ITEMS], "CN_CBOR_ERR_MAX_ITEMS");
+    ASSERT_STR(cn_cbor_error_str[CN_CBOR_ERR_MAX_BYTES], "CN_CBOR_ERR_MAX_BYTES");
+    ASSERT_STR(cn_cbor_error_str[CN_CBOR_ERR_MAX_STRING_LENGTH], "CN_CBOR_ERR_MAX_STRING_LENGTH");
+    ASSERT_STR(cn_cbor_error_str[CN_CBOR_ERR_WRONG_TYPE], "CN_CBOR_ERR_WRONG_TYPE");
+    ASSERT_STR(cn_cbor_error_str[CN_CBOR_ERR_MISSING_FIELD], "CN_CBOR_ERR_MISSING_FIELD");
+    ASSERT_STR(cn_cbor_error_str[CN_CBOR_ERR_INVALID_STRINGREF], "CN_CBOR_ERR_INVALID_STRINGREF");
+    ASSERT_STR(cn_cbor_error_str[CN_CBOR_ERR_DUPLICATE_KEY], "CN_CBOR_ERR_DUPLICATE_KEY");
 }
 
 CTEST(cbor, parse)
@@ -220,12 +235,13 @@ CTEST(cbor, fail)
         {"1f", CN_CBOR_ERR_MT_UNDEF_FOR_INDEF},
         {"1c", CN_CBOR_ERR_RESERVED_AI},
         {"7f4100", CN_CBOR_ERR_WRONG_NESTING_IN_INDEF_STRING},
+        {"df00", CN_CBOR_ERR_MT_UNDEF_FOR_INDEF},
     };
     cn_cbor *cb;
     buffer b;
     size_t i;
     uint8_t buf[10];
-    cn_cbor inv = {CN_CBOR_INVALID, 0, {0}, 0, NULL, NULL, NULL, NULL};
+    cn_cbor inv = {CN_CBOR_INVALID, 0, {0}, 0, NULL, NULL, NULL, NULL, {0}};
 
     ASSERT_EQUAL(-1, cn_cbor_encoder_write(buf, 0, sizeof(buf), &inv));
 
@@ -449,3 +465,2290 @@ CTEST(cbor, create_encode)
   enc_sz = cn_cbor_encoder_write(encoded, 0, sizeof(encoded), map);
   ASSERT_EQUAL(7, enc_sz);
 }
+
+CTEST(cbor, int_array)
+{
+    int64_t vals[] = {0, 23, 24, -1, -25, 256, 65536, -4294967297LL,
+                      INT64_MAX, INT64_MIN};
+    buffer b;
+    unsigned char encoded[128];
+    ssize_t enc_sz;
+    size_t i;
+
+    ASSERT_TRUE(parse_hex("8a001718182038181901001a000100003b00000001000000001b7fffffffffffffff3b7fffffffffffffff", &b));
+    enc_sz = cn_cbor_encoder_write_int_array(encoded, 0, sizeof(encoded),
+                                             vals, 10);
+    ASSERT_DATA(b.ptr, b.sz, encoded, enc_sz);
+
+    /* Too small for the worst case; checked element by element */
+    enc_sz = cn_cbor_encoder_write_int_array(encoded, 0, b.sz + 1, vals, 10);
+    ASSERT_DATA(b.ptr, b.sz, encoded, enc_sz);
+    for (i = 0; i <= b.sz; i++) {
+        ASSERT_EQUAL(-1, cn_cbor_encoder_write_int_array(encoded, 0, i,
+                                                         vals, 10));
+    }
+    free(b.ptr);
+
+    /* Worst case elements that exactly fill the buffer */
+    for (i = 0; i < 10; i++) {
+        vals[i] = i % 2 ? INT64_MIN : INT64_MAX;
+    }
+    ASSERT_EQUAL(91, cn_cbor_encoder_write_int_array(encoded, 0, 91,
+                                                     vals, 10));
+    ASSERT_EQUAL(0x8a, encoded[0]);
+    ASSERT_EQUAL(0x3b, encoded[82]);
+    ASSERT_EQUAL(-1, cn_cbor_encoder_write_int_array(encoded, 0, 90,
+                                                     vals, 10));
+
+    enc_sz = cn_cbor_encoder_write_int_array(encoded, 0, sizeof(encoded),
+                                             NULL, 0);
+    ASSERT_EQUAL(1, enc_sz);
+    ASSERT_EQUAL(0x80, encoded[0]);
+}
+
+CTEST(cbor, double_array)
+{
+#ifndef CBOR_NO_FLOAT
+    double vals[] = {1.0, -4.0, 100000.0, 1.1, 5.960464477539063e-08,
+                     0.0/0.0};
+    static double many[1001];
+    static unsigned char big[9 * 1001 + 3], checked[9 * 1001 + 3];
+    buffer b;
+    unsigned char encoded[128];
+    ssize_t enc_sz;
+    size_t i;
+
+    ASSERT_TRUE(parse_hex("86f93c00f9c400fa47c35000fb3ff199999999999af90001f97e00", &b));
+    enc_sz = cn_cbor_encoder_write_double_array(encoded, 0, sizeof(encoded),
+                                                vals, 6);
+    ASSERT_DATA(b.ptr, b.sz, encoded, enc_sz);
+
+    enc_sz = cn_cbor_encoder_write_double_array(encoded, 0, b.sz + 1, vals, 6);
+    ASSERT_DATA(b.ptr, b.sz, encoded, enc_sz);
+    for (i = 0; i <= b.sz; i++) {
+        ASSERT_EQUAL(-1, cn_cbor_encoder_write_double_array(encoded, 0, i,
+                                                            vals, 6));
+    }
+    free(b.ptr);
+
+    /* Runs of halves, singles and doubles come out the same whether the
+       space is checked once or for each element */
+    for (i = 0; i < sizeof(many) / sizeof(many[0]); i++) {
+        switch (i % 11) {
+        case 0: many[i] = (double)i / 8; break;
+        case 1: many[i] = -(double)i * 1024; break;
+        case 2: many[i] = i % 2 ? -0.0 : 0.0; break;
+        case 3: many[i] = ldexp(i % 2 ? -1.0 : 1.0, -24 - (int)(i % 3)); break;
+        case 4: many[i] = i % 3 ? 1.0 / 0.0 : 65504.0; break;
+        case 5: many[i] = 1.0 + ldexp(1.0, -(int)(i % 30)); break;
+        case 6: many[i] = (double)i / 3; break;
+        default: many[i] = (double)(i % 100); break;
+        }
+    }
+    enc_sz = cn_cbor_encoder_write_double_array(big, 0, sizeof(big), many,
+                                                sizeof(many) / sizeof(many[0]));
+    ASSERT_TRUE(enc_sz > 0);
+    ASSERT_EQUAL(enc_sz, cn_cbor_encoder_write_double_array(
+                     checked, 0, enc_sz + 1, many,
+                     sizeof(many) / sizeof(many[0])));
+    ASSERT_DATA(big, enc_sz, checked, enc_sz);
+#endif /* CBOR_NO_FLOAT */
+}
+
+CTEST(cbor, encode_depth)
+{
+    cn_cbor_errback err;
+    cn_cbor_encoder_options opts;
+    unsigned char in[CN_CBOR_ENCODER_MAX_DEPTH + 2];
+    unsigned char encoded[CN_CBOR_ENCODER_MAX_DEPTH + 8];
+    unsigned char deep[3 * CN_CBOR_ENCODER_MAX_DEPTH + 1];
+    unsigned char deep_encoded[sizeof(deep) + 8];
+    cn_cbor_encoder_stream st;
+    cn_cbor *cb, *p;
+    ssize_t enc_sz;
+    size_t depth;
+
+    /* [[[...[0]...]]] nested exactly CN_CBOR_ENCODER_MAX_DEPTH deep */
+    for (depth = 0; depth < CN_CBOR_ENCODER_MAX_DEPTH; depth++) {
+        in[depth] = 0x81;
+    }
+    in[depth] = 0x00;
+    cb = cn_cbor_decode(in, depth + 1 CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(cb);
+    enc_sz = cn_cbor_encoder_write(encoded, 0, sizeof(encoded), cb);
+    ASSERT_DATA(in, depth + 1, encoded, enc_sz);
+
+    memset(&opts, 0, sizeof(opts));
+    opts.max_depth = 2;
+    ASSERT_EQUAL(-1, cn_cbor_encoder_write_opts(encoded, 0, sizeof(encoded),
+                                                cb, &opts));
+    /* The innermost [[0]] needs two levels */
+    for (p = cb, depth = 0; depth < CN_CBOR_ENCODER_MAX_DEPTH - 2; depth++) {
+        p = p->first_child;
+    }
+    enc_sz = cn_cbor_encoder_write_opts(encoded, 0, sizeof(encoded), p, &opts);
+    ASSERT_DATA(in + depth, 3, encoded, enc_sz);
+    cn_cbor_free(cb CONTEXT_NULL);
+
+    /* Deeper than the stack, by default and within a larger limit, and
+       from a subtree that starts below the root */
+    for (depth = 0; depth < sizeof(deep) - 1; depth++) {
+        deep[depth] = 0x81;
+    }
+    deep[depth] = 0x00;
+    cb = cn_cbor_decode(deep, sizeof(deep) CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(cb);
+    enc_sz = cn_cbor_encoder_write(deep_encoded, 0, sizeof(deep_encoded), cb);
+    ASSERT_DATA(deep, sizeof(deep), deep_encoded, enc_sz);
+    opts.max_depth = sizeof(deep) - 1;
+    enc_sz = cn_cbor_encoder_write_opts(deep_encoded, 0, sizeof(deep_encoded),
+                                        cb, &opts);
+    ASSERT_DATA(deep, sizeof(deep), deep_encoded, enc_sz);
+    opts.max_depth = sizeof(deep) - 2;
+    ASSERT_EQUAL(-1, cn_cbor_encoder_write_opts(deep_encoded, 0,
+                                                sizeof(deep_encoded), cb, &opts));
+    for (p = cb, depth = 0; depth < 10; depth++) {
+        p = p->first_child;
+    }
+    enc_sz = cn_cbor_encoder_write(deep_encoded, 0, sizeof(deep_encoded), p);
+    ASSERT_DATA(deep + 10, sizeof(deep) - 10, deep_encoded, enc_sz);
+    ASSERT_TRUE(cn_cbor_encoder_stream_init(&st, p, NULL));
+    ASSERT_EQUAL(sizeof(deep) - 10,
+                 cn_cbor_encoder_stream_write(&st, deep_encoded,
+                                              sizeof(deep_encoded)));
+    ASSERT_TRUE(cn_cbor_encoder_stream_done(&st));
+    ASSERT_DATA(deep + 10, sizeof(deep) - 10, deep_encoded, sizeof(deep) - 10);
+    cn_cbor_free(cb CONTEXT_NULL);
+}
+
+CTEST(cbor, encode_subtree)
+{
+    cn_cbor_errback err;
+    buffer b;
+    cn_cbor *cb;
+    unsigned char encoded[16];
+    ssize_t enc_sz;
+
+    /* [[1, 2], [_ 3], 4]: each child encodes without its siblings */
+    ASSERT_TRUE(parse_hex("838201029f03ff04", &b));
+    cb = cn_cbor_decode(b.ptr, b.sz CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(cb);
+    enc_sz = cn_cbor_encoder_write(encoded, 0, sizeof(encoded),
+                                   cn_cbor_index(cb, 0));
+    ASSERT_DATA(b.ptr + 1, 3, encoded, enc_sz);
+    enc_sz = cn_cbor_encoder_write(encoded, 0, sizeof(encoded),
+                                   cn_cbor_index(cb, 1));
+    ASSERT_DATA(b.ptr + 4, 3, encoded, enc_sz);
+    enc_sz = cn_cbor_encoder_write(encoded, 0, sizeof(encoded),
+                                   cn_cbor_index(cb, 0)->first_child);
+    ASSERT_DATA(b.ptr + 2, 1, encoded, enc_sz);
+    free(b.ptr);
+    cn_cbor_free(cb CONTEXT_NULL);
+}
+
+CTEST(cbor, limits)
+{
+    cn_cbor_errback err;
+    cn_cbor_limits limits;
+    buffer b;
+    cn_cbor *cb;
+
+    ASSERT_TRUE(parse_hex("82818100826161626161", &b)); // [[[0]], ["a", "aa"]]
+
+    memset(&limits, 0, sizeof(limits));
+    cb = cn_cbor_decode_limited(b.ptr, b.sz, &limits CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(cb);
+    cn_cbor_free(cb CONTEXT_NULL);
+
+    limits.max_depth = 3;
+    cb = cn_cbor_decode_limited(b.ptr, b.sz, &limits CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(cb);
+    cn_cbor_free(cb CONTEXT_NULL);
+    limits.max_depth = 2;
+    cb = cn_cbor_decode_limited(b.ptr, b.sz, &limits CONTEXT_NULL, &err);
+    ASSERT_NULL(cb);
+    ASSERT_EQUAL(CN_CBOR_ERR_MAX_DEPTH, err.err);
+    ASSERT_EQUAL(4, err.pos);
+    limits.max_depth = 0;
+
+    limits.max_items = 7;
+    cb = cn_cbor_decode_limited(b.ptr, b.sz, &limits CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(cb);
+    cn_cbor_free(cb CONTEXT_NULL);
+    limits.max_items = 6;
+    cb = cn_cbor_decode_limited(b.ptr, b.sz, &limits CONTEXT_NULL, &err);
+    ASSERT_NULL(cb);
+    ASSERT_EQUAL(CN_CBOR_ERR_MAX_ITEMS, err.err);
+    limits.max_items = 0;
+
+    limits.max_bytes = 7 * sizeof(cn_cbor);
+    cb = cn_cbor_decode_limited(b.ptr, b.sz, &limits CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(cb);
+    cn_cbor_free(cb CONTEXT_NULL);
+    limits.max_bytes--;
+    cb = cn_cbor_decode_limited(b.ptr, b.sz, &limits CONTEXT_NULL, &err);
+    ASSERT_NULL(cb);
+    ASSERT_EQUAL(CN_CBOR_ERR_MAX_BYTES, err.err);
+    limits.max_bytes = 0;
+
+    limits.max_string_length = 2;
+    cb = cn_cbor_decode_limited(b.ptr, b.sz, &limits CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(cb);
+    cn_cbor_free(cb CONTEXT_NULL);
+    limits.max_string_length = 1;
+    cb = cn_cbor_decode_limited(b.ptr, b.sz, &limits CONTEXT_NULL, &err);
+    ASSERT_NULL(cb);
+    ASSERT_EQUAL(CN_CBOR_ERR_MAX_STRING_LENGTH, err.err);
+    ASSERT_EQUAL(8, err.pos);
+    free(b.ptr);
+
+    /* A huge declared length fails on the limit, not on missing data */
+    ASSERT_TRUE(parse_hex("5affffffff", &b));
+    cb = cn_cbor_decode_limited(b.ptr, b.sz, &limits CONTEXT_NULL, &err);
+    ASSERT_NULL(cb);
+    ASSERT_EQUAL(CN_CBOR_ERR_MAX_STRING_LENGTH, err.err);
+    free(b.ptr);
+}
+
+CTEST(cbor, clone_equal_hash)
+{
+    cn_cbor_errback err;
+    buffer b, b2;
+    cn_cbor *cb, *cb2, *copy;
+    unsigned char encoded[64];
+    ssize_t enc_sz;
+
+    // {"a": [1, -2, h'0102'], "b": {_ 3: "xyz"}, "c": null}
+    ASSERT_TRUE(parse_hex("a361618301214201026162bf036378797aff6163f6", &b));
+    cb = cn_cbor_decode(b.ptr, b.sz CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(cb);
+
+    copy = cn_cbor_clone(cb CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(copy);
+    ASSERT_NULL(copy->parent);
+    ASSERT_TRUE(cn_cbor_equal(cb, copy));
+    ASSERT_TRUE(cn_cbor_hash(cb) == cn_cbor_hash(copy));
+    enc_sz = cn_cbor_encoder_write(encoded, 0, sizeof(encoded), copy);
+    ASSERT_DATA(b.ptr, b.sz, encoded, enc_sz);
+    cn_cbor_free(copy CONTEXT_NULL);
+
+    /* a subtree copies into a new root */
+    copy = cn_cbor_clone(cn_cbor_mapget_string(cb, "a") CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(copy);
+    ASSERT_NULL(copy->parent);
+    ASSERT_EQUAL(3, copy->length);
+    ASSERT_TRUE(cn_cbor_equal(cn_cbor_mapget_string(cb, "a"), copy));
+    ASSERT_FALSE(cn_cbor_equal(cb, copy));
+    cn_cbor_free(copy CONTEXT_NULL);
+
+    /* definite vs. indefinite */
+    ASSERT_TRUE(parse_hex("a361618301214201026162a1036378797a6163f6", &b2));
+    cb2 = cn_cbor_decode(b2.ptr, b2.sz CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(cb2);
+    ASSERT_TRUE(cn_cbor_equal(cb, cb2));
+    ASSERT_TRUE(cn_cbor_hash(cb) == cn_cbor_hash(cb2));
+    free(b2.ptr);
+    cn_cbor_free(cb2 CONTEXT_NULL);
+
+    /* one byte different */
+    ASSERT_TRUE(parse_hex("a361618301214201036162bf036378797aff6163f6", &b2));
+    cb2 = cn_cbor_decode(b2.ptr, b2.sz CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(cb2);
+    ASSERT_FALSE(cn_cbor_equal(cb, cb2));
+    ASSERT_FALSE(cn_cbor_hash(cb) == cn_cbor_hash(cb2));
+    free(b2.ptr);
+    cn_cbor_free(cb2 CONTEXT_NULL);
+
+    /* chunked vs. definite strings, however they are split */
+    {
+        char *same[] = {
+            "7f6361626366646566676869616aff",
+            "7f69616263646566676869616aff",
+            "7f606a6162636465666768696aff",
+        };
+        char *other[] = {
+            "7f6361626366646566676869616bff",
+            "7f6361626366646566676869ff",
+            "5f4361626346646566676869416aff",
+        };
+        cn_cbor *s;
+        buffer bs;
+        size_t i;
+
+        ASSERT_TRUE(parse_hex("6a6162636465666768696a", &bs));
+        s = cn_cbor_decode(bs.ptr, bs.sz CONTEXT_NULL, &err);
+        ASSERT_NOT_NULL(s);
+        for (i = 0; i < sizeof(same) / sizeof(same[0]); i++) {
+            ASSERT_TRUE(parse_hex(same[i], &b2));
+            cb2 = cn_cbor_decode(b2.ptr, b2.sz CONTEXT_NULL, &err);
+            ASSERT_NOT_NULL(cb2);
+            ASSERT_TRUE(cn_cbor_equal(s, cb2));
+            ASSERT_TRUE(cn_cbor_equal(cb2, s));
+            ASSERT_TRUE(cn_cbor_hash(s) == cn_cbor_hash(cb2));
+            free(b2.ptr);
+            cn_cbor_free(cb2 CONTEXT_NULL);
+        }
+        for (i = 0; i < sizeof(other) / sizeof(other[0]); i++) {
+            ASSERT_TRUE(parse_hex(other[i], &b2));
+            cb2 = cn_cbor_decode(b2.ptr, b2.sz CONTEXT_NULL, &err);
+            ASSERT_NOT_NULL(cb2);
+            ASSERT_FALSE(cn_cbor_equal(s, cb2));
+            ASSERT_FALSE(cn_cbor_hash(s) == cn_cbor_hash(cb2));
+            free(b2.ptr);
+            cn_cbor_free(cb2 CONTEXT_NULL);
+        }
+        /* the same on every host */
+        ASSERT_TRUE(cn_cbor_hash(s) == 0x00e614f695ee68e6ULL);
+        free(bs.ptr);
+        cn_cbor_free(s CONTEXT_NULL);
+    }
+
+#ifndef CBOR_NO_FLOAT
+    /* float vs. double */
+    cb2 = cn_cbor_float_create(1.5f CONTEXT_NULL, &err);
+    copy = cn_cbor_double_create(1.5 CONTEXT_NULL, &err);
+    ASSERT_TRUE(cn_cbor_equal(cb2, copy));
+    ASSERT_TRUE(cn_cbor_hash(cb2) == cn_cbor_hash(copy));
+    copy->v.dbl = -1.5;
+    ASSERT_FALSE(cn_cbor_equal(cb2, copy));
+    cn_cbor_free(cb2 CONTEXT_NULL);
+    cn_cbor_free(copy CONTEXT_NULL);
+#endif /* CBOR_NO_FLOAT */
+
+    ASSERT_TRUE(cn_cbor_equal(NULL, NULL));
+    ASSERT_FALSE(cn_cbor_equal(cb, NULL));
+    ASSERT_NULL(cn_cbor_clone(NULL CONTEXT_NULL, &err));
+    ASSERT_EQUAL(CN_CBOR_ERR_INVALID_PARAMETER, err.err);
+
+    free(b.ptr);
+    cn_cbor_free(cb CONTEXT_NULL);
+}
+
+CTEST(cbor, clone_deep)
+{
+    cn_cbor_errback err;
+    size_t depth = 100000;
+    unsigned char *in = malloc(depth + 1);
+    cn_cbor *cb, *copy;
+
+    memset(in, 0x81, depth);
+    in[depth] = 0x00;
+    cb = cn_cbor_decode(in, depth + 1 CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(cb);
+    copy = cn_cbor_clone(cb CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(copy);
+    ASSERT_TRUE(cn_cbor_equal(cb, copy));
+    ASSERT_TRUE(cn_cbor_hash(cb) == cn_cbor_hash(copy));
+    cn_cbor_free(copy CONTEXT_NULL);
+    cn_cbor_free(cb CONTEXT_NULL);
+    free(in);
+}
+
+CTEST(cbor, spans)
+{
+    cn_cbor_errback err;
+    cn_cbor_decode_options opts;
+    buffer b, b2;
+    cn_cbor *cb, *copy;
+    unsigned char encoded[64];
+    ssize_t enc_sz;
+
+    /* Not in preferred encoding, so re-encoding normally changes it:
+       {"a": [_ 1, 24], "b": {0: 2}, "c": [3]} */
+    ASSERT_TRUE(parse_hex("a361619f18011818ff6162a118000261638103", &b));
+    memset(&opts, 0, sizeof(opts));
+    opts.flags = CN_CBOR_DECODE_SPANS;
+    cb = cn_cbor_decode_opts(b.ptr, b.sz, &opts CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(cb);
+    ASSERT_TRUE(cb->flags & CN_CBOR_FL_SPAN);
+    enc_sz = cn_cbor_encoder_write(encoded, 0, sizeof(encoded), cb);
+    ASSERT_DATA(b.ptr, b.sz, encoded, enc_sz);
+
+    /* A clone keeps the spans */
+    copy = cn_cbor_clone(cb CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(copy);
+    ASSERT_TRUE(copy->flags & CN_CBOR_FL_SPAN);
+    enc_sz = cn_cbor_encoder_write(encoded, 0, sizeof(encoded), copy);
+    ASSERT_DATA(b.ptr, b.sz, encoded, enc_sz);
+    cn_cbor_free(copy CONTEXT_NULL);
+
+    /* Changing "c" re-encodes the root and "c", but copies "a" and "b" */
+    ASSERT_TRUE(cn_cbor_array_append(cn_cbor_mapget_string(cb, "c"),
+                                     cn_cbor_int_create(4 CONTEXT_NULL, &err),
+                                     &err));
+    ASSERT_FALSE(cb->flags & CN_CBOR_FL_SPAN);
+    ASSERT_TRUE(cn_cbor_mapget_string(cb, "a")->flags & CN_CBOR_FL_SPAN);
+    ASSERT_TRUE(parse_hex("a361619f18011818ff6162a11800026163820304", &b2));
+    enc_sz = cn_cbor_encoder_write(encoded, 0, sizeof(encoded), cb);
+    ASSERT_DATA(b2.ptr, b2.sz, encoded, enc_sz);
+    free(b2.ptr);
+
+    /* In-place changes need to be marked */
+    cn_cbor_mapget_string(cb, "a")->first_child->v.uint = 5;
+    cn_cbor_mark_dirty(cn_cbor_mapget_string(cb, "a")->first_child);
+    ASSERT_TRUE(parse_hex("a361619f051818ff6162a11800026163820304", &b2));
+    enc_sz = cn_cbor_encoder_write(encoded, 0, sizeof(encoded), cb);
+    ASSERT_DATA(b2.ptr, b2.sz, encoded, enc_sz);
+    free(b2.ptr);
+    cn_cbor_free(cb CONTEXT_NULL);
+
+    /* Without the flag, the preferred encoding is used */
+    cb = cn_cbor_decode(b.ptr, b.sz CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(cb);
+    ASSERT_FALSE(cb->flags & CN_CBOR_FL_SPAN);
+    ASSERT_TRUE(parse_hex("a361619f011818ff6162a1000261638103", &b2));
+    enc_sz = cn_cbor_encoder_write(encoded, 0, sizeof(encoded), cb);
+    ASSERT_DATA(b2.ptr, b2.sz, encoded, enc_sz);
+    free(b2.ptr);
+    cn_cbor_free(cb CONTEXT_NULL);
+    free(b.ptr);
+}
+
+CTEST(cbor, template_patch)
+{
+    cn_cbor_errback err;
+    cn_cbor_encoder_options opts;
+    cn_cbor_slot slots[2];
+    cn_cbor *map, *ts, *ctr, *cb;
+    unsigned char tmpl[64], frame[64];
+    ssize_t enc_sz;
+    buffer b;
+
+    map = cn_cbor_map_create(CONTEXT_NULL_COMMA &err);
+    ts = cn_cbor_int_create(0 CONTEXT_NULL, &err);
+    ctr = cn_cbor_int_create(-1 CONTEXT_NULL, &err);
+    ASSERT_TRUE(cn_cbor_mapput_int(map, 1, ts CONTEXT_NULL, &err));
+    ASSERT_TRUE(cn_cbor_mapput_string(map, "id",
+                                      cn_cbor_string_create("dev" CONTEXT_NULL, &err)
+                                      CONTEXT_NULL, &err));
+    ASSERT_TRUE(cn_cbor_mapput_int(map, 2, ctr CONTEXT_NULL, &err));
+
+    memset(&opts, 0, sizeof(opts));
+    slots[0].cb = ts;
+    slots[0].width = 4;
+    slots[1].cb = ctr;
+    slots[1].width = 2;
+    opts.slots = slots;
+    opts.slot_count = 2;
+    enc_sz = cn_cbor_encoder_write_opts(tmpl, 0, sizeof(tmpl), map, &opts);
+    // {1: 0, "id": "dev", 2: -1}, with fixed widths
+    ASSERT_TRUE(parse_hex("a3011a000000006269646364657602390000", &b));
+    ASSERT_DATA(b.ptr, b.sz, tmpl, enc_sz);
+    ASSERT_EQUAL(2, slots[0].offset);
+    ASSERT_EQUAL(15, slots[1].offset);
+    free(b.ptr);
+
+    memcpy(frame, tmpl, enc_sz);
+    ASSERT_TRUE(cn_cbor_patch_int(frame, &slots[0], 0x5f000001));
+    ASSERT_TRUE(cn_cbor_patch_int(frame, &slots[1], 1000));
+    ASSERT_FALSE(cn_cbor_patch_int(frame, &slots[1], 65536));
+    ASSERT_FALSE(cn_cbor_patch_int(frame, &slots[1], -65537));
+    cb = cn_cbor_decode(frame, enc_sz CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(cb);
+    ASSERT_EQUAL(0x5f000001, cn_cbor_mapget_int(cb, 1)->v.uint);
+    ASSERT_EQUAL(1000, cn_cbor_mapget_int(cb, 2)->v.uint);
+    cn_cbor_free(cb CONTEXT_NULL);
+
+    ASSERT_TRUE(cn_cbor_patch_int(frame, &slots[1], -65536));
+    cb = cn_cbor_decode(frame, enc_sz CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(cb);
+    ASSERT_EQUAL(CN_CBOR_INT, cn_cbor_mapget_int(cb, 2)->type);
+    ASSERT_EQUAL(-65536, cn_cbor_mapget_int(cb, 2)->v.sint);
+    cn_cbor_free(cb CONTEXT_NULL);
+
+    /* Values that do not fit fail the whole write */
+    ts->v.uint = 0x100000000ULL;
+    ASSERT_EQUAL(-1, cn_cbor_encoder_write_opts(tmpl, 0, sizeof(tmpl), map, &opts));
+    slots[0].cb = NULL;
+    ASSERT_EQUAL(enc_sz + 4, cn_cbor_encoder_write_opts(tmpl, 0, sizeof(tmpl), map, &opts));
+    ASSERT_EQUAL(-1, slots[0].offset);
+    ASSERT_FALSE(cn_cbor_patch_int(frame, &slots[0], 0));
+
+    cn_cbor_free(map CONTEXT_NULL);
+}
+
+CTEST(cbor, head_skip)
+{
+    cn_cbor_errback err;
+    cn_cbor_head head;
+    unsigned char out[16];
+    buffer b;
+
+    ASSERT_TRUE(parse_hex("1903e8", &b));
+    ASSERT_EQUAL(3, cn_cbor_head_decode(b.ptr, b.sz, &head, &err));
+    ASSERT_EQUAL(0, head.mt);
+    ASSERT_EQUAL(25, head.ai);
+    ASSERT_EQUAL(1000, head.val);
+    ASSERT_EQUAL(0, cn_cbor_head_decode(b.ptr, 2, &head, &err));
+    ASSERT_EQUAL(CN_CBOR_ERR_OUT_OF_DATA, err.err);
+    free(b.ptr);
+
+    ASSERT_TRUE(parse_hex("5f", &b));
+    ASSERT_EQUAL(1, cn_cbor_head_decode(b.ptr, b.sz, &head, &err));
+    ASSERT_EQUAL(2, head.mt);
+    ASSERT_EQUAL(31, head.ai);
+    b.ptr[0] = 0x1f;
+    ASSERT_EQUAL(0, cn_cbor_head_decode(b.ptr, b.sz, &head, &err));
+    ASSERT_EQUAL(CN_CBOR_ERR_MT_UNDEF_FOR_INDEF, err.err);
+    b.ptr[0] = 0x1c;
+    ASSERT_EQUAL(0, cn_cbor_head_decode(b.ptr, b.sz, &head, &err));
+    ASSERT_EQUAL(CN_CBOR_ERR_RESERVED_AI, err.err);
+    free(b.ptr);
+
+    // [1, [2, 3], [_ 4]], followed by 5
+    ASSERT_TRUE(parse_hex("83018202039f04ff05", &b));
+    ASSERT_EQUAL(8, cn_cbor_skip(b.ptr, b.sz, &err));
+    ASSERT_EQUAL(1, cn_cbor_skip(b.ptr + 8, 1, &err));
+    ASSERT_EQUAL(0, cn_cbor_skip(b.ptr, 7, &err));
+    ASSERT_EQUAL(CN_CBOR_ERR_OUT_OF_DATA, err.err);
+    ASSERT_EQUAL(0, cn_cbor_skip(b.ptr + 7, 1, &err));
+    ASSERT_EQUAL(CN_CBOR_ERR_BREAK_OUTSIDE_INDEF, err.err);
+    free(b.ptr);
+
+    ASSERT_EQUAL(3, cn_cbor_head_encode(out, 0, sizeof(out), 3, 300));
+    ASSERT_TRUE(parse_hex("79012c", &b));
+    ASSERT_DATA(b.ptr, b.sz, out, 3);
+    free(b.ptr);
+    ASSERT_EQUAL(1, cn_cbor_head_encode(out, 3, sizeof(out), 7, 21));
+    ASSERT_EQUAL(0xf5, out[3]);
+    ASSERT_EQUAL(-1, cn_cbor_head_encode(out, 0, sizeof(out), 8, 0));
+    ASSERT_EQUAL(-1, cn_cbor_head_encode(out, 0, 3, 0, 0x10000));
+#ifndef CBOR_NO_FLOAT
+    ASSERT_EQUAL(3, cn_cbor_double_encode(out, 0, sizeof(out), 1.5));
+    ASSERT_TRUE(parse_hex("f93e00", &b));
+    ASSERT_DATA(b.ptr, b.sz, out, 3);
+    free(b.ptr);
+#endif /* CBOR_NO_FLOAT */
+}
+
+struct config {
+    cn_cbor_string name;
+    int retries;
+    bool verbose;
+    int64_t id;
+    cn_cbor_string blob;
+    uint64_t mask;
+#ifndef CBOR_NO_FLOAT
+    double ratio;
+#endif /* CBOR_NO_FLOAT */
+};
+
+static const cn_cbor_field config_fields[] = {
+    { "name", 0, CN_CBOR_FIELD_TEXT, offsetof(struct config, name), CN_CBOR_FIELD_REQUIRED },
+    { NULL, 1, CN_CBOR_FIELD_INT, offsetof(struct config, retries), 0 },
+    { "verbose", 0, CN_CBOR_FIELD_BOOL, offsetof(struct config, verbose), 0 },
+    { NULL, -1, CN_CBOR_FIELD_INT64, offsetof(struct config, id), CN_CBOR_FIELD_REQUIRED },
+    { "blob", 0, CN_CBOR_FIELD_BYTES, offsetof(struct config, blob), 0 },
+    { NULL, 2, CN_CBOR_FIELD_UINT64, offsetof(struct config, mask), 0 },
+#ifndef CBOR_NO_FLOAT
+    { "ratio", 0, CN_CBOR_FIELD_DOUBLE, offsetof(struct config, ratio), 0 },
+#endif /* CBOR_NO_FLOAT */
+};
+
+CTEST(cbor, decode_into)
+{
+    cn_cbor_errback err;
+    cn_cbor_fields desc;
+    cn_cbor_field dup[2];
+    struct config c, c2;
+    uint64_t present;
+    unsigned char out[64];
+    ssize_t enc_sz;
+    buffer b;
+
+    ASSERT_TRUE(cn_cbor_fields_init(&desc, config_fields,
+                                    sizeof(config_fields) / sizeof(config_fields[0]),
+                                    &err));
+
+    // {"verbose": true, 1: 3, "x": [1, {}], -1: -100, "name": "dev", 2: 9}
+    ASSERT_TRUE(parse_hex("a66776657262" "6f7365f501036178" "8201a0203863646e616d6563646576" "0209", &b));
+    memset(&c, 0, sizeof(c));
+    c.retries = 5;
+    ASSERT_EQUAL(b.sz, cn_cbor_decode_into(b.ptr, b.sz, &desc, &c, &present, &err));
+    ASSERT_EQUAL(0x2f, present);
+    ASSERT_EQUAL(3, c.retries);
+    ASSERT_TRUE(c.verbose);
+    ASSERT_EQUAL(-100, c.id);
+    ASSERT_DATA((const unsigned char *)"dev", 3, c.name.ptr, c.name.length);
+    ASSERT_NULL(c.blob.ptr);
+    ASSERT_EQUAL(9, c.mask);
+    ASSERT_EQUAL(0, cn_cbor_decode_into(b.ptr, b.sz - 1, &desc, &c, &present, &err));
+    ASSERT_EQUAL(CN_CBOR_ERR_OUT_OF_DATA, err.err);
+
+    // Round trip, with an optional field left out
+    c.blob.ptr = (const uint8_t *)"\x01\x02";
+    c.blob.length = 2;
+    enc_sz = cn_cbor_encode_from(out, 0, sizeof(out), &desc, &c, 0x12);
+    ASSERT_TRUE(enc_sz > 0);
+    memset(&c2, 0, sizeof(c2));
+    ASSERT_EQUAL(enc_sz, cn_cbor_decode_into(out, enc_sz, &desc, &c2, &present, &err));
+    ASSERT_EQUAL(0x1b, present);
+    ASSERT_EQUAL(3, c2.retries);
+    ASSERT_FALSE(c2.verbose);
+    ASSERT_EQUAL(-100, c2.id);
+    ASSERT_DATA(c.name.ptr, c.name.length, c2.name.ptr, c2.name.length);
+    ASSERT_DATA(c.blob.ptr, c.blob.length, c2.blob.ptr, c2.blob.length);
+    ASSERT_EQUAL(-1, cn_cbor_encode_from(out, 0, enc_sz, &desc, &c, 0x12));
+#ifndef CBOR_NO_FLOAT
+    c.ratio = 0.5;
+    enc_sz = cn_cbor_encode_from(out, 0, sizeof(out), &desc, &c, 0x40);
+    ASSERT_EQUAL(enc_sz, cn_cbor_decode_into(out, enc_sz, &desc, &c2, &present, &err));
+    ASSERT_EQUAL(0x49, present);
+    ASSERT_TRUE(c2.ratio == 0.5);
+#endif /* CBOR_NO_FLOAT */
+    free(b.ptr);                /* c.name pointed into it */
+
+    // {_ "name": "dev", 1: 3, "x": [_ 1], -1: -100}
+    ASSERT_TRUE(parse_hex("bf646e616d6563646576010361789f01ff203863ff", &b));
+    memset(&c, 0, sizeof(c));
+    ASSERT_EQUAL(b.sz, cn_cbor_decode_into(b.ptr, b.sz, &desc, &c, &present, &err));
+    ASSERT_EQUAL(0x0b, present);
+    ASSERT_EQUAL(3, c.retries);
+    ASSERT_EQUAL(-100, c.id);
+    ASSERT_DATA((const unsigned char *)"dev", 3, c.name.ptr, c.name.length);
+    ASSERT_EQUAL(0, cn_cbor_decode_into(b.ptr, b.sz - 1, &desc, &c, NULL, &err));
+    ASSERT_EQUAL(CN_CBOR_ERR_OUT_OF_DATA, err.err);
+    free(b.ptr);
+    // {_ "name": "dev", -1: 0, 1}: a key without a value
+    ASSERT_TRUE(parse_hex("bf646e616d65636465762000" "01ff", &b));
+    ASSERT_EQUAL(0, cn_cbor_decode_into(b.ptr, b.sz, &desc, &c, NULL, &err));
+    ASSERT_EQUAL(CN_CBOR_ERR_ODD_SIZE_INDEF_MAP, err.err);
+    ASSERT_EQUAL(b.sz - 1, err.pos);
+    free(b.ptr);
+
+    // {-1: 0}: no "name"
+    ASSERT_TRUE(parse_hex("a12000", &b));
+    ASSERT_EQUAL(0, cn_cbor_decode_into(b.ptr, b.sz, &desc, &c, NULL, &err));
+    ASSERT_EQUAL(CN_CBOR_ERR_MISSING_FIELD, err.err);
+    free(b.ptr);
+    // {"name": 1}
+    ASSERT_TRUE(parse_hex("a1646e616d6501", &b));
+    ASSERT_EQUAL(0, cn_cbor_decode_into(b.ptr, b.sz, &desc, &c, NULL, &err));
+    ASSERT_EQUAL(CN_CBOR_ERR_WRONG_TYPE, err.err);
+    ASSERT_EQUAL(6, err.pos);
+    free(b.ptr);
+    // {1: 0x100000000} does not fit in an int
+    ASSERT_TRUE(parse_hex("a1011b0000000100000000", &b));
+    ASSERT_EQUAL(0, cn_cbor_decode_into(b.ptr, b.sz, &desc, &c, NULL, &err));
+    ASSERT_EQUAL(CN_CBOR_ERR_WRONG_TYPE, err.err);
+    free(b.ptr);
+    // []
+    ASSERT_TRUE(parse_hex("80", &b));
+    ASSERT_EQUAL(0, cn_cbor_decode_into(b.ptr, b.sz, &desc, &c, NULL, &err));
+    ASSERT_EQUAL(CN_CBOR_ERR_WRONG_TYPE, err.err);
+    free(b.ptr);
+
+    dup[0] = config_fields[1];
+    dup[1] = config_fields[1];
+    dup[1].offset = offsetof(struct config, mask);
+    ASSERT_FALSE(cn_cbor_fields_init(&desc, dup, 2, &err));
+    ASSERT_EQUAL(CN_CBOR_ERR_INVALID_PARAMETER, err.err);
+}
+
+CTEST(cbor, keydict)
+{
+    static const char * const keys[] = { "id", "temp", "unit" };
+    cn_cbor_errback err;
+    cn_cbor_decode_options opts;
+    cn_cbor_keydict dict;
+    int id, temp, unit;
+    cn_cbor *cb, *map;
+    buffer b;
+
+    ASSERT_TRUE(cn_cbor_keydict_init(&dict, keys, 3, &err));
+    id = cn_cbor_keydict_find(&dict, "id");
+    temp = cn_cbor_keydict_find(&dict, "temp");
+    unit = cn_cbor_keydict_find(&dict, "unit");
+    ASSERT_EQUAL(0, id);
+    ASSERT_EQUAL(1, temp);
+    ASSERT_EQUAL(2, unit);
+    ASSERT_EQUAL(-1, cn_cbor_keydict_find(&dict, "te"));
+
+    // {"id": 1, "temp": 2, "x": 3, 4: "id"}
+    ASSERT_TRUE(parse_hex("a4626964016474656d7002617803046269" "64", &b));
+    memset(&opts, 0, sizeof(opts));
+    opts.keys = &dict;
+    cb = cn_cbor_decode_opts(b.ptr, b.sz, &opts CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(cb);
+    ASSERT_EQUAL(1, cb->first_child->x.key_id);
+    ASSERT_EQUAL(UINT32_MAX, cn_cbor_index(cb, 4)->x.key_id);
+    ASSERT_EQUAL(0, cn_cbor_index(cb, 7)->x.key_id);
+    ASSERT_EQUAL(1, cn_cbor_mapget_key(cb, &dict, id)->v.uint);
+    ASSERT_EQUAL(2, cn_cbor_mapget_key(cb, &dict, temp)->v.uint);
+    ASSERT_NULL(cn_cbor_mapget_key(cb, &dict, unit));
+    cn_cbor_free(cb CONTEXT_NULL);
+    free(b.ptr);
+
+    /* Keys that were not decoded with the dictionary still match */
+    map = cn_cbor_map_create(CONTEXT_NULL_COMMA &err);
+    ASSERT_TRUE(cn_cbor_mapput_string(map, "unit",
+                                      cn_cbor_int_create(7 CONTEXT_NULL, &err)
+                                      CONTEXT_NULL, &err));
+    ASSERT_EQUAL(7, cn_cbor_mapget_key(map, &dict, unit)->v.uint);
+    ASSERT_NULL(cn_cbor_mapget_key(map, &dict, id));
+    cn_cbor_free(map CONTEXT_NULL);
+
+    ASSERT_FALSE(cn_cbor_keydict_init(&dict, keys, CN_CBOR_KEYDICT_MAX + 1, &err));
+    ASSERT_EQUAL(CN_CBOR_ERR_INVALID_PARAMETER, err.err);
+}
+
+CTEST(cbor, stringref)
+{
+    cn_cbor_errback err;
+    cn_cbor_decode_options opts;
+    cn_cbor *cb, *cb2, *arr;
+    unsigned char encoded[64];
+    ssize_t enc_sz;
+    buffer b, b2;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.flags = CN_CBOR_DECODE_STRINGREFS;
+
+    // ["aaa", "aaa", "bb", "bb", h'616161', {"aaa": "aaa"}]
+    ASSERT_TRUE(parse_hex("8663616161636161616262626262624361616" "1a163616161636161" "61", &b));
+    cb = cn_cbor_decode(b.ptr, b.sz CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(cb);
+    enc_sz = cn_cbor_encoder_write_stringref(encoded, 0, sizeof(encoded), cb CONTEXT_NULL);
+    // 256(["aaa", 25(0), "bb", "bb", h'616161', {25(0): 25(0)}])
+    ASSERT_TRUE(parse_hex("d901008663616161d81900626262626262436161" "61a1d81900d81900", &b2));
+    ASSERT_DATA(b2.ptr, b2.sz, encoded, enc_sz);
+    ASSERT_EQUAL(-1, cn_cbor_encoder_write_stringref(encoded, 0, enc_sz, cb CONTEXT_NULL));
+
+    cb2 = cn_cbor_decode_opts(encoded, enc_sz, &opts CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(cb2);
+    ASSERT_EQUAL(CN_CBOR_TAG, cb2->type);
+    ASSERT_EQUAL(256, cb2->v.uint);
+    arr = cb2->first_child;
+    ASSERT_TRUE(cn_cbor_equal(cb, arr));
+    /* references point at the first occurrence */
+    ASSERT_TRUE(cn_cbor_index(arr, 1)->v.str == cn_cbor_index(arr, 0)->v.str);
+    ASSERT_TRUE(cn_cbor_index(arr, 5)->first_child->v.str == cn_cbor_index(arr, 0)->v.str);
+    cn_cbor_free(cb2 CONTEXT_NULL);
+
+    /* Without the flag, the references are plain tags */
+    cb2 = cn_cbor_decode(encoded, enc_sz CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(cb2);
+    ASSERT_EQUAL(CN_CBOR_TAG, cn_cbor_index(cb2->first_child, 1)->type);
+    cn_cbor_free(cb2 CONTEXT_NULL);
+    cn_cbor_free(cb CONTEXT_NULL);
+    free(b.ptr);
+    free(b2.ptr);
+
+    /* A nested namespace starts over: ["aaa", 256(["aaa"]), "aaa"] */
+    ASSERT_TRUE(parse_hex("8363616161d9010081636161616361616" "1", &b));
+    cb = cn_cbor_decode(b.ptr, b.sz CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(cb);
+    enc_sz = cn_cbor_encoder_write_stringref(encoded, 0, sizeof(encoded), cb CONTEXT_NULL);
+    ASSERT_TRUE(parse_hex("d901008363616161d901008163616161d81900", &b2));
+    ASSERT_DATA(b2.ptr, b2.sz, encoded, enc_sz);
+    cb2 = cn_cbor_decode_opts(encoded, enc_sz, &opts CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(cb2);
+    ASSERT_TRUE(cn_cbor_equal(cb, cb2->first_child));
+    cn_cbor_free(cb2 CONTEXT_NULL);
+    cn_cbor_free(cb CONTEXT_NULL);
+    free(b.ptr);
+    free(b2.ptr);
+
+    // 256(["bbb", 256(["ccc", 25(0)]), 25(0)])
+    ASSERT_TRUE(parse_hex("d901008363626262d901008263636363d81900d81900", &b));
+    cb = cn_cbor_decode_opts(b.ptr, b.sz, &opts CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(cb);
+    ASSERT_DATA((const unsigned char *)"ccc", 3,
+                cn_cbor_index(cn_cbor_index(cb->first_child, 1)->first_child, 1)->v.bytes, 3);
+    ASSERT_DATA((const unsigned char *)"bbb", 3,
+                cn_cbor_index(cb->first_child, 2)->v.bytes, 3);
+    cn_cbor_free(cb CONTEXT_NULL);
+    free(b.ptr);
+
+    // 256([25(0)]), 256(["bb", 25(0)]), 256([25("a")])
+    ASSERT_TRUE(parse_hex("d9010081d81900", &b));
+    ASSERT_NULL(cn_cbor_decode_opts(b.ptr, b.sz, &opts CONTEXT_NULL, &err));
+    ASSERT_EQUAL(CN_CBOR_ERR_INVALID_STRINGREF, err.err);
+    free(b.ptr);
+    ASSERT_TRUE(parse_hex("d9010082626262d81900", &b));
+    ASSERT_NULL(cn_cbor_decode_opts(b.ptr, b.sz, &opts CONTEXT_NULL, &err));
+    ASSERT_EQUAL(CN_CBOR_ERR_INVALID_STRINGREF, err.err);
+    free(b.ptr);
+    ASSERT_TRUE(parse_hex("d9010081d8196161", &b));
+    ASSERT_NULL(cn_cbor_decode_opts(b.ptr, b.sz, &opts CONTEXT_NULL, &err));
+    ASSERT_EQUAL(CN_CBOR_ERR_INVALID_STRINGREF, err.err);
+    free(b.ptr);
+
+    /* Chunks are written as they are, and are not referred to:
+       [(_ "aaa", "aaa"), "aaa"] */
+    ASSERT_TRUE(parse_hex("827f6361616163616161ff63616161", &b));
+    cb = cn_cbor_decode(b.ptr, b.sz CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(cb);
+    enc_sz = cn_cbor_encoder_write_stringref(encoded, 0, sizeof(encoded), cb CONTEXT_NULL);
+    ASSERT_TRUE(parse_hex("d90100827f6361616163616161ff63616161", &b2));
+    ASSERT_DATA(b2.ptr, b2.sz, encoded, enc_sz);
+    free(b2.ptr);
+    enc_sz = cn_cbor_encoder_write_stringref(encoded, 0, sizeof(encoded),
+                                             cb->first_child CONTEXT_NULL);
+    ASSERT_TRUE(parse_hex("d901007f6361616163616161ff", &b2));
+    ASSERT_DATA(b2.ptr, b2.sz, encoded, enc_sz);
+    cn_cbor_free(cb CONTEXT_NULL);
+    free(b.ptr);
+    free(b2.ptr);
+
+    /* [256(["abc", [1]]), 0] with spans: the inner [1] has none, but
+       appending to it still clears the span of the outer array */
+    opts.flags = CN_CBOR_DECODE_SPANS | CN_CBOR_DECODE_STRINGREFS;
+    ASSERT_TRUE(parse_hex("82d901008263616263810100", &b));
+    cb = cn_cbor_decode_opts(b.ptr, b.sz, &opts CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(cb);
+    ASSERT_TRUE(cb->flags & CN_CBOR_FL_SPAN);
+    arr = cb->first_child->first_child->last_child;
+    ASSERT_FALSE(arr->flags & CN_CBOR_FL_SPAN);
+    ASSERT_TRUE(cn_cbor_array_append(arr, cn_cbor_int_create(2 CONTEXT_NULL, NULL),
+                                     NULL));
+    enc_sz = cn_cbor_encoder_write(encoded, 0, sizeof(encoded), cb);
+    ASSERT_TRUE(parse_hex("82d90100826361626382010200", &b2));
+    ASSERT_DATA(b2.ptr, b2.sz, encoded, enc_sz);
+    cn_cbor_free(cb CONTEXT_NULL);
+    free(b.ptr);
+    free(b2.ptr);
+}
+
+CTEST(cbor, unique_keys)
+{
+    cn_cbor_errback err;
+    cn_cbor_decode_options opts;
+    cn_cbor *cb;
+    buffer b;
+    size_t i;
+    unsigned char *big;
+    const size_t big_count = 100000;
+    char *good[] = {
+        "a0",
+        "a201010202",
+        "a2616101616202", // {"a": 1, "b": 2}
+        "a26161a1616101616202", // {"a": {"a": 1}, "b": 2}
+        "82a10101a10101", // [{1: 1}, {1: 1}]
+        "a2010120f7", // {1: 1, -1: undefined}
+        "bf01010202ff",
+        "a2623031017f61306132ff02", // {"01": 1, (_ "0", "2"): 2}
+        "a26230310142303102", // {"01": 1, h'3031': 2}
+        "a2623031017f613061316132ff02",
+        "a28162616201817f61616163ff02", // {["ab"]: 1, [(_ "a", "c")]: 2}
+        "a2c101010102", // {1(1): 1, 1: 2}
+    };
+    char *bad[] = {
+        "a201010102",
+        "a20101180102", // {1: 1, 1: 2}, with 1 encoded twice
+        "a3616101616202616103",
+        "a26161a1616101616102", // {"a": {"a": 1}, "a": 2}
+        "a28201020182010202", // {[1, 2]: 1, [1, 2]: 2}
+        "bf01016161010102ff",
+        "a2623031017f61306131ff02", // {"01": 1, (_ "0", "1"): 2}
+        "a27f6130623132ff017f6230316132ff02",
+        "a28162616201817f61616162ff02", // {["ab"]: 1, [(_ "a", "b")]: 2}
+        "a2a1616101f6a17f6161ff01f6", // {{"a": 1}: null, {(_ "a"): 1}: null}
+        "a2c10102c10103", // {1(1): 2, 1(1): 3}
+    };
+
+    memset(&opts, 0, sizeof(opts));
+    opts.flags = CN_CBOR_DECODE_UNIQUE_KEYS;
+    for (i = 0; i < sizeof(good) / sizeof(good[0]); i++) {
+        ASSERT_TRUE(parse_hex(good[i], &b));
+        cb = cn_cbor_decode_opts(b.ptr, b.sz, &opts CONTEXT_NULL, &err);
+        ASSERT_NOT_NULL(cb);
+        cn_cbor_free(cb CONTEXT_NULL);
+        free(b.ptr);
+    }
+    for (i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        ASSERT_TRUE(parse_hex(bad[i], &b));
+        cb = cn_cbor_decode(b.ptr, b.sz CONTEXT_NULL, &err);
+        ASSERT_NOT_NULL(cb);
+        cn_cbor_free(cb CONTEXT_NULL);
+        cb = cn_cbor_decode_opts(b.ptr, b.sz, &opts CONTEXT_NULL, &err);
+        ASSERT_NULL(cb);
+        ASSERT_EQUAL(CN_CBOR_ERR_DUPLICATE_KEY, err.err);
+        free(b.ptr);
+    }
+
+    /* {0: null, 1: null, ..., 99999: null}, and then the first key again */
+    big = malloc(8 + big_count * 6);
+    ASSERT_NOT_NULL(big);
+    big[0] = 0xba;
+    big[1] = 0;
+    big[2] = (big_count + 1) >> 16;
+    big[3] = ((big_count + 1) >> 8) & 0xff;
+    big[4] = (big_count + 1) & 0xff;
+    b.sz = 5;
+    for (i = 0; i < big_count; i++) {
+        b.sz += cn_cbor_head_encode(big, b.sz, 8 + big_count * 6,
+                                    0, i);
+        big[b.sz++] = 0xf6;
+    }
+    big[b.sz++] = 0xf6;
+    big[b.sz++] = 0xf6;
+    cb = cn_cbor_decode_opts(big, b.sz, &opts CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(cb);
+    cn_cbor_free(cb CONTEXT_NULL);
+    big[b.sz - 2] = 0x00;
+    cb = cn_cbor_decode_opts(big, b.sz, &opts CONTEXT_NULL, &err);
+    ASSERT_NULL(cb);
+    ASSERT_EQUAL(CN_CBOR_ERR_DUPLICATE_KEY, err.err);
+    ASSERT_EQUAL(b.sz - 1, err.pos);
+
+    /* {{{...{}: 0...}: 0}: 0}, and then two of them as keys of one map */
+    b.sz = 0;
+    big[b.sz++] = 0xa2;
+    for (i = 0; i < big_count; i++)
+        big[b.sz++] = 0xa1;
+    big[b.sz++] = 0xa0;
+    for (i = 0; i < big_count; i++)
+        big[b.sz++] = 0x00;
+    cb = cn_cbor_decode_opts(big + 1, b.sz - 1, &opts CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(cb);
+    cn_cbor_free(cb CONTEXT_NULL);
+    big[b.sz++] = 0x00;
+    memcpy(big + b.sz, big + 1, b.sz - 2);
+    b.sz += b.sz - 2;
+    big[b.sz++] = 0x01;
+    cb = cn_cbor_decode_opts(big, b.sz, &opts CONTEXT_NULL, &err);
+    ASSERT_NULL(cb);
+    ASSERT_EQUAL(CN_CBOR_ERR_DUPLICATE_KEY, err.err);
+    ASSERT_EQUAL(b.sz - 1, err.pos);
+    free(big);
+}
+
+#ifndef CBOR_NO_FLOAT
+CTEST(cbor, half)
+{
+    cn_cbor_errback err;
+    cn_cbor_decode_options opts;
+    cn_cbor *cb;
+    unsigned char enc[9];
+    static unsigned char halves[2 * 65536];
+    static float floats[65536];
+    double expected;
+    unsigned int h, exp, mant;
+    int i;
+    ssize_t enc_sz;
+    char *keep[] = {
+        "f93c00", "fa47c35000", "f90001", "fa33c00000", "f97c00", "f9fc00",
+    };
+    buffer b;
+
+    memset(&opts, 0, sizeof(opts));
+    for (h = 0; h < 65536; h++) {
+        halves[2 * h] = h >> 8;
+        halves[2 * h + 1] = h & 0xff;
+        enc[0] = 0xf9;
+        enc[1] = h >> 8;
+        enc[2] = h & 0xff;
+        cb = cn_cbor_decode(enc, 3 CONTEXT_NULL, &err);
+        ASSERT_NOT_NULL(cb);
+        ASSERT_EQUAL(CN_CBOR_DOUBLE, cb->type);
+        exp = (h >> 10) & 0x1f;
+        mant = h & 0x3ff;
+        if (exp == 31) {
+            ASSERT_TRUE(mant ? cb->v.dbl != cb->v.dbl
+                        : cb->v.dbl == ((h & 0x8000) ? -INFINITY : INFINITY));
+        } else {
+            expected = exp ? mant + 1024 : mant;
+            for (i = exp ? exp : 1; i < 25; i++)
+                expected /= 2;
+            for (; i > 25; i--)
+                expected *= 2;
+            ASSERT_TRUE(cb->v.dbl == ((h & 0x8000) ? -expected : expected));
+        }
+        floats[h] = cb->v.dbl;
+        cn_cbor_free(cb CONTEXT_NULL);
+    }
+
+    /* The bulk conversion agrees, bit for bit */
+    {
+        static float bulk[65536];
+        cn_cbor_half_array_decode(halves, 65536, bulk);
+        for (h = 0; h < 65536; h++)
+            ASSERT_TRUE(bulk[h] == floats[h] ||
+                        (bulk[h] != bulk[h] && floats[h] != floats[h]));
+        cn_cbor_half_array_decode(halves + 2, 5, bulk);
+        ASSERT_TRUE(bulk[0] == floats[1] && bulk[4] == floats[5]);
+    }
+
+    /* Halves and singles can stay single precision */
+    opts.flags = CN_CBOR_DECODE_FLOATS;
+    for (i = 0; i < (int)(sizeof(keep) / sizeof(keep[0])); i++) {
+        ASSERT_TRUE(parse_hex(keep[i], &b));
+        cb = cn_cbor_decode_opts(b.ptr, b.sz, &opts CONTEXT_NULL, &err);
+        ASSERT_NOT_NULL(cb);
+        ASSERT_EQUAL(CN_CBOR_FLOAT, cb->type);
+        enc_sz = cn_cbor_encoder_write(enc, 0, sizeof(enc), cb);
+        ASSERT_DATA(b.ptr, b.sz, enc, enc_sz);
+        cn_cbor_free(cb CONTEXT_NULL);
+        free(b.ptr);
+    }
+    ASSERT_TRUE(parse_hex("fb3ff0000000000000", &b));
+    cb = cn_cbor_decode_opts(b.ptr, b.sz, &opts CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(cb);
+    ASSERT_EQUAL(CN_CBOR_DOUBLE, cb->type);
+    cn_cbor_free(cb CONTEXT_NULL);
+    free(b.ptr);
+}
+#endif /* CBOR_NO_FLOAT */
+
+#ifndef CBOR_NO_FLOAT
+CTEST(cbor, float_width)
+{
+    cn_cbor_errback err;
+    cn_cbor_encoder_options opts;
+    cn_cbor_decode_options dopts;
+    cn_cbor_encoder_stream st;
+    cn_cbor *cb;
+    unsigned char enc[16];
+    unsigned char half[3];
+    ssize_t enc_sz;
+    buffer b;
+    unsigned int h;
+    uint32_t bits;
+    size_t i;
+    union {
+        float f;
+        uint32_t u;
+    } u32;
+    struct {
+        double val;
+        char *hex;
+    } widths[] = {
+        { 65504.0, "f97bff" },
+        { 65520.0, "fa477ff000" },
+        { -0.0, "f98000" },
+        { 1.0 / 16777216, "f90001" },            // 2^-24
+        { 1.0 / 33554432, "fa33000000" },        // 2^-25
+        { 3.0 / 16777216, "f90003" },
+        { 3.0 / 33554432, "fa33c00000" },
+        { 1.401298464324817e-45, "fa00000001" }, // 2^-149
+        { 7.006492321624085e-46, "fb3690000000000000" }, // 2^-150
+        { 3.4028234663852886e+38, "fa7f7fffff" },
+        { 1.0 + 1.0 / 1099511627776, "fb3ff0000000001000" },
+        { 1e300, "fb7e37e43c8800759c" },
+        { 4.9406564584124654e-324, "fb0000000000000001" },
+    };
+
+    /* Every half comes back as itself */
+    for (h = 0; h < 65536; h++) {
+        if ((h & 0x7c00) == 0x7c00 && (h & 0x3ff))
+            continue;           /* NaN */
+        half[0] = 0xf9;
+        half[1] = h >> 8;
+        half[2] = h & 0xff;
+        cb = cn_cbor_decode(half, 3 CONTEXT_NULL, &err);
+        ASSERT_NOT_NULL(cb);
+        enc_sz = cn_cbor_encoder_write(enc, 0, sizeof(enc), cb);
+        ASSERT_DATA(half, 3, enc, enc_sz);
+        cn_cbor_free(cb CONTEXT_NULL);
+    }
+
+    /* A sample of floats round-trips in at most 5 bytes */
+    for (bits = 0; bits < 0xff800000u; bits += 0x10001) {
+        u32.u = bits;
+        if (u32.f != u32.f)
+            continue;           /* NaN */
+        enc_sz = cn_cbor_double_encode(enc, 0, sizeof(enc), u32.f);
+        ASSERT_TRUE(enc_sz == 3 || enc_sz == 5);
+        cb = cn_cbor_decode(enc, enc_sz CONTEXT_NULL, &err);
+        ASSERT_NOT_NULL(cb);
+        ASSERT_TRUE(cb->v.dbl == u32.f);
+        cn_cbor_free(cb CONTEXT_NULL);
+    }
+
+    for (i = 0; i < sizeof(widths) / sizeof(widths[0]); i++) {
+        ASSERT_TRUE(parse_hex(widths[i].hex, &b));
+        enc_sz = cn_cbor_double_encode(enc, 0, sizeof(enc), widths[i].val);
+        ASSERT_DATA(b.ptr, b.sz, enc, enc_sz);
+        free(b.ptr);
+    }
+
+    /* Always a double */
+    memset(&opts, 0, sizeof(opts));
+    opts.flags = CN_CBOR_ENCODE_FLOAT64;
+    cb = cn_cbor_double_create(1.5 CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(cb);
+    enc_sz = cn_cbor_encoder_write_opts(enc, 0, sizeof(enc), cb, &opts);
+    ASSERT_TRUE(parse_hex("fb3ff8000000000000", &b));
+    ASSERT_DATA(b.ptr, b.sz, enc, enc_sz);
+    free(b.ptr);
+    cn_cbor_free(cb CONTEXT_NULL);
+    cb = cn_cbor_float_create(1.5f CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(cb);
+    enc_sz = cn_cbor_encoder_write_opts(enc, 0, sizeof(enc), cb, &opts);
+    ASSERT_TRUE(parse_hex("fb3ff8000000000000", &b));
+    ASSERT_DATA(b.ptr, b.sz, enc, enc_sz);
+    free(b.ptr);
+    cn_cbor_free(cb CONTEXT_NULL);
+
+    /* even in a container that still has its original encoding: [1.0] */
+    memset(&dopts, 0, sizeof(dopts));
+    dopts.flags = CN_CBOR_DECODE_SPANS;
+    ASSERT_TRUE(parse_hex("81f93c00", &b));
+    cb = cn_cbor_decode_opts(b.ptr, b.sz, &dopts CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(cb);
+    ASSERT_TRUE(cb->flags & CN_CBOR_FL_SPAN);
+    free(b.ptr);
+    ASSERT_TRUE(parse_hex("81fb3ff0000000000000", &b));
+    enc_sz = cn_cbor_encoder_write_opts(enc, 0, sizeof(enc), cb, &opts);
+    ASSERT_DATA(b.ptr, b.sz, enc, enc_sz);
+    ASSERT_TRUE(cn_cbor_encoder_stream_init(&st, cb, &opts));
+    ASSERT_EQUAL(b.sz, cn_cbor_encoder_stream_write(&st, enc, sizeof(enc)));
+    ASSERT_TRUE(cn_cbor_encoder_stream_done(&st));
+    ASSERT_DATA(b.ptr, b.sz, enc, b.sz);
+    free(b.ptr);
+    cn_cbor_free(cb CONTEXT_NULL);
+}
+#endif /* CBOR_NO_FLOAT */
+
+CTEST(cbor, bignum)
+{
+    cn_cbor_errback err;
+    cn_cbor_decode_options opts;
+    cn_cbor_limits limits;
+    cn_cbor *cb, *cb2;
+    unsigned char encoded[32];
+    ssize_t enc_sz;
+    buffer b, b2;
+    size_t i;
+    struct {
+        char *in;
+        cn_cbor_type type;
+        char *out;
+    } tests[] = {
+        { "1bffffffffffffffff", CN_CBOR_UINT, "1bffffffffffffffff" },
+        { "3b7fffffffffffffff", CN_CBOR_INT, "3b7fffffffffffffff" },
+        { "3b8000000000000000", CN_CBOR_NEGBIGNUM, "3b8000000000000000" },
+        { "3bffffffffffffffff", CN_CBOR_NEGBIGNUM, "3bffffffffffffffff" },
+        { "c240", CN_CBOR_UINT, "00" },
+        { "c243000001", CN_CBOR_UINT, "01" },
+        { "c34100", CN_CBOR_INT, "20" },
+        { "c348ffffffffffffffff", CN_CBOR_NEGBIGNUM, "3bffffffffffffffff" },
+        { "c249010000000000000000", CN_CBOR_BIGNUM, "c249010000000000000000" },
+        { "c24a00010000000000000000", CN_CBOR_BIGNUM, "c249010000000000000000" },
+        { "c349010000000000000000", CN_CBOR_NEGBIGNUM, "c349010000000000000000" },
+        { "c201", CN_CBOR_TAG, "c201" },
+        { "c25f4101ff", CN_CBOR_TAG, "c25f4101ff" },
+        { "c2c240", CN_CBOR_TAG, "c200" },
+    };
+
+    memset(&opts, 0, sizeof(opts));
+    opts.flags = CN_CBOR_DECODE_BIGNUMS;
+    for (i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+        ASSERT_TRUE(parse_hex(tests[i].in, &b));
+        ASSERT_TRUE(parse_hex(tests[i].out, &b2));
+        cb = cn_cbor_decode_opts(b.ptr, b.sz, &opts CONTEXT_NULL, &err);
+        ASSERT_NOT_NULL(cb);
+        ASSERT_EQUAL(tests[i].type, cb->type);
+        enc_sz = cn_cbor_encoder_write(encoded, 0, sizeof(encoded), cb);
+        ASSERT_DATA(b2.ptr, b2.sz, encoded, enc_sz);
+        cn_cbor_free(cb CONTEXT_NULL);
+        free(b.ptr);
+        free(b2.ptr);
+    }
+
+    /* Both encodings of -2^64 are the same value */
+    ASSERT_TRUE(parse_hex("3bffffffffffffffff", &b));
+    ASSERT_TRUE(parse_hex("c348ffffffffffffffff", &b2));
+    cb = cn_cbor_decode(b.ptr, b.sz CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(cb);
+    cb2 = cn_cbor_decode_opts(b2.ptr, b2.sz, &opts CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(cb2);
+    ASSERT_TRUE(cn_cbor_equal(cb, cb2));
+    ASSERT_EQUAL(cn_cbor_hash(cb), cn_cbor_hash(cb2));
+    cn_cbor_free(cb2 CONTEXT_NULL);
+    free(b2.ptr);
+
+    /* Without the flag, bignums stay tags */
+    cb2 = cn_cbor_decode(b.ptr, b.sz CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(cb2);
+    cn_cbor_free(cb2 CONTEXT_NULL);
+    cn_cbor_free(cb CONTEXT_NULL);
+    free(b.ptr);
+    ASSERT_TRUE(parse_hex("c249010000000000000000", &b));
+    cb = cn_cbor_decode(b.ptr, b.sz CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(cb);
+    ASSERT_EQUAL(CN_CBOR_TAG, cb->type);
+    cn_cbor_free(cb CONTEXT_NULL);
+
+    /* The byte string is subject to the limits */
+    memset(&limits, 0, sizeof(limits));
+    limits.max_string_length = 8;
+    opts.limits = &limits;
+    ASSERT_NULL(cn_cbor_decode_opts(b.ptr, b.sz, &opts CONTEXT_NULL, &err));
+    ASSERT_EQUAL(CN_CBOR_ERR_MAX_STRING_LENGTH, err.err);
+    free(b.ptr);
+    ASSERT_TRUE(parse_hex("c24901000000", &b));
+    opts.limits = NULL;
+    ASSERT_NULL(cn_cbor_decode_opts(b.ptr, b.sz, &opts CONTEXT_NULL, &err));
+    ASSERT_EQUAL(CN_CBOR_ERR_OUT_OF_DATA, err.err);
+    free(b.ptr);
+}
+
+#ifdef USE_CBOR_CONTEXT
+typedef struct {
+    unsigned char buf[4096];
+    size_t used;
+    int frees;
+    int tree_frees;
+} test_pool;
+
+static void *pool_calloc(size_t count, size_t size, void *context)
+{
+    test_pool *pool = context;
+    size_t n = (count * size + 15) & ~(size_t)15;
+    void *ret;
+
+    if (n > sizeof(pool->buf) - pool->used)
+        return NULL;
+    ret = pool->buf + pool->used;
+    memset(ret, 0, n);
+    pool->used += n;
+    return ret;
+}
+
+static void pool_free(void *ptr, void *context)
+{
+    (void)ptr;
+    ((test_pool *)context)->frees++;
+}
+
+static void pool_free_tree(cn_cbor *root, void *context)
+{
+    (void)root;
+    ((test_pool *)context)->tree_frees++;
+    ((test_pool *)context)->used = 0;
+}
+#endif /* USE_CBOR_CONTEXT */
+
+CTEST(cbor, arena)
+{
+    cn_cbor_errback err;
+    cn_cbor_decode_options opts;
+    cn_cbor *cb, *cb2;
+    unsigned char big[3 + 1000 * 3];
+    buffer b;
+    size_t i;
+    ssize_t sz;
+    int64_t vals[1000];
+
+    memset(&opts, 0, sizeof(opts));
+    opts.flags = CN_CBOR_DECODE_ARENA;
+    // {"a": 1, "b": [2, 3], "c": [4, 5], "d": "e", "f": {"g": {_ "h": "i"}}}
+    ASSERT_TRUE(parse_hex("a561610161628202036163820405616461656166a16167"
+                          "bf61686169ff", &b));
+    cb = cn_cbor_decode_opts(b.ptr, b.sz, &opts CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(cb);
+    ASSERT_TRUE(cb->flags & CN_CBOR_FL_ARENA);
+    cb2 = cn_cbor_decode(b.ptr, b.sz CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(cb2);
+    ASSERT_FALSE(cb2->flags & CN_CBOR_FL_ARENA);
+    ASSERT_TRUE(cn_cbor_equal(cb, cb2));
+    cn_cbor_free(cb2 CONTEXT_NULL);
+    cn_cbor_free(cb CONTEXT_NULL);
+    free(b.ptr);
+
+    /* Several blocks */
+    for (i = 0; i < 1000; i++)
+        vals[i] = (int64_t)i * 37 - 18000;
+    sz = cn_cbor_encoder_write_int_array(big, 0, sizeof(big), vals, 1000);
+    ASSERT_TRUE(sz > 0);
+    cb = cn_cbor_decode_opts(big, sz, &opts CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(cb);
+    ASSERT_EQUAL(1000, cb->length);
+    ASSERT_EQUAL(-18000 + 999 * 37, cn_cbor_index(cb, 999)->v.sint);
+    cn_cbor_free(cb CONTEXT_NULL);
+
+    /* A failed decode releases its blocks as well */
+    ASSERT_NULL(cn_cbor_decode_opts(big, sz - 1, &opts CONTEXT_NULL, &err));
+    ASSERT_EQUAL(CN_CBOR_ERR_OUT_OF_DATA, err.err);
+
+#ifdef USE_CBOR_CONTEXT
+    {
+        static test_pool pool;
+        cn_cbor_context ctx = { pool_calloc, pool_free, &pool, pool_free_tree };
+
+        ASSERT_TRUE(parse_hex("83010203", &b));
+        cb = cn_cbor_decode(b.ptr, b.sz, &ctx, &err);
+        ASSERT_NOT_NULL(cb);
+        ASSERT_TRUE(pool.used > 0);
+        cn_cbor_free(cb, &ctx);
+        ASSERT_EQUAL(0, pool.frees);
+        ASSERT_EQUAL(1, pool.tree_frees);
+        ASSERT_EQUAL(0, pool.used);
+        free(b.ptr);
+    }
+#endif /* USE_CBOR_CONTEXT */
+}
+
+/* Encodings that the decoders are checked against each other with */
+static char *well_formed[] = {
+    "00",
+    "3b7fffffffffffffff",
+    "3bffffffffffffffff",
+    "60",
+    "80",
+    "a0",
+    "9fff",
+    "8301820203820405",
+    "a26161016162820203",
+    "bf6161016162820203ff",
+    "7f616161626163ff",
+    "7fff",
+    "5f41014102ff",
+    "5fff",
+    "c1c2c3c4820102",
+    "9f9f9fffffff",
+    "8301a1616101bf61629f0102ffff",
+    "83f4f5f6",
+    "82f7f0",
+    "82f820f8ff",
+    "826568656c6c6f4b68656c6c6f20776f726c64",
+    "c249010000000000000000",
+    "c24201ff",
+#ifndef CBOR_NO_FLOAT
+    "fb3ff0000000000000",
+    "83f93c00fa47c35000fb3ff199999999999a",
+#endif /* CBOR_NO_FLOAT */
+};
+
+static char *malformed[] = {
+    "0000",
+    "bf6161016162ff",
+    "bf00ff",
+    "ff",
+    "df00",
+    "1c",
+    "7f4100",
+    "9f01ff01",
+    "78ff",
+    "6461",
+    "1a0000",
+};
+
+/* Decodes `len` bytes at `buf` in some other way than cn_cbor_decode,
+   which gave `cb`, and checks that the results agree */
+typedef bool (*decode_check)(uint8_t *buf, size_t len, const cn_cbor *cb,
+                             cn_cbor_errback *errp);
+
+/* Every prefix of every test vector decodes with `check` exactly when
+   it does with cn_cbor_decode, and otherwise fails in the same way at
+   the same position */
+static void check_prefixes(decode_check check)
+{
+    size_t good = sizeof(well_formed) / sizeof(well_formed[0]);
+    size_t all = good + sizeof(malformed) / sizeof(malformed[0]);
+    cn_cbor_errback err, err2;
+    cn_cbor *cb;
+    buffer b;
+    size_t i, len;
+
+    for (i = 0; i < all; i++) {
+        ASSERT_TRUE(parse_hex(i < good ? well_formed[i] : malformed[i - good],
+                              &b));
+        for (len = 0; len <= b.sz; len++) {
+            err.err = err2.err = CN_CBOR_NO_ERROR;
+            err.pos = err2.pos = -1;
+            cb = cn_cbor_decode(b.ptr, len CONTEXT_NULL, &err);
+            ASSERT_EQUAL(cb != NULL, check(b.ptr, len, cb, &err2));
+            ASSERT_EQUAL(err.err, err2.err);
+            ASSERT_EQUAL(err.pos, err2.pos);
+            cn_cbor_free(cb CONTEXT_NULL);
+        }
+        free(b.ptr);
+    }
+}
+
+static bool validate_check(uint8_t *buf, size_t len, const cn_cbor *cb,
+                           cn_cbor_errback *errp)
+{
+    cn_cbor_errback err, err2;
+    cn_cbor_limits limits;
+    cn_cbor_stats stats;
+    cn_cbor *cb2;
+
+    if (!cn_cbor_validate(buf, len, NULL, &stats, errp))
+        return false;
+    if (!cb)
+        return true;
+
+    /* the stats are exactly what decoding needs */
+    memset(&limits, 0, sizeof(limits));
+    limits.max_items = stats.items;
+    limits.max_depth = stats.max_depth ? stats.max_depth : -1;
+    cb2 = cn_cbor_decode_limited(buf, len, &limits CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(cb2);
+    cn_cbor_free(cb2 CONTEXT_NULL);
+    ASSERT_TRUE(cn_cbor_validate(buf, len, &limits, NULL, &err2));
+    limits.max_items = stats.items - 1;
+    if (limits.max_items) {
+        ASSERT_NULL(cn_cbor_decode_limited(buf, len, &limits CONTEXT_NULL, &err));
+        ASSERT_FALSE(cn_cbor_validate(buf, len, &limits, NULL, &err2));
+        ASSERT_EQUAL(CN_CBOR_ERR_MAX_ITEMS, err2.err);
+        ASSERT_EQUAL(err.pos, err2.pos);
+    }
+    limits.max_items = 0;
+    if (stats.max_depth > 1) {
+        limits.max_depth = stats.max_depth - 1;
+        ASSERT_NULL(cn_cbor_decode_limited(buf, len, &limits CONTEXT_NULL, &err));
+        ASSERT_FALSE(cn_cbor_validate(buf, len, &limits, NULL, &err2));
+        ASSERT_EQUAL(CN_CBOR_ERR_MAX_DEPTH, err2.err);
+        ASSERT_EQUAL(err.pos, err2.pos);
+    }
+    return true;
+}
+
+CTEST(cbor, validate)
+{
+    cn_cbor_errback err;
+    cn_cbor_limits limits;
+    cn_cbor_stats stats;
+    buffer b;
+
+    check_prefixes(validate_check);
+
+    ASSERT_TRUE(parse_hex("8301a1616101bf61629f0102ffff", &b));
+    ASSERT_TRUE(cn_cbor_validate(b.ptr, b.sz, NULL, &stats, &err));
+    ASSERT_EQUAL(10, stats.items);
+    ASSERT_EQUAL(3, stats.max_depth);
+    memset(&limits, 0, sizeof(limits));
+    limits.max_string_length = 1;
+    ASSERT_TRUE(cn_cbor_validate(b.ptr, b.sz, &limits, NULL, &err));
+    free(b.ptr);
+    ASSERT_TRUE(parse_hex("826161626262", &b));
+    ASSERT_FALSE(cn_cbor_validate(b.ptr, b.sz, &limits, NULL, &err));
+    ASSERT_EQUAL(CN_CBOR_ERR_MAX_STRING_LENGTH, err.err);
+    ASSERT_EQUAL(4, err.pos);
+    free(b.ptr);
+}
+
+static void tape_check(const cn_cbor_tape *tape, size_t at, const cn_cbor *cb)
+{
+    cn_cbor node;
+    const cn_cbor *cp;
+    size_t child;
+
+    cn_cbor_tape_get(tape, at, &node);
+    ASSERT_EQUAL(cb->type, node.type);
+    ASSERT_EQUAL(cb->type, cn_cbor_tape_type(tape, at));
+    ASSERT_EQUAL(cb->length, node.length);
+    switch (cb->type) {
+    case CN_CBOR_UINT: case CN_CBOR_SIMPLE: case CN_CBOR_TAG:
+        ASSERT_TRUE(cb->v.uint == node.v.uint);
+        break;
+    case CN_CBOR_INT:
+        ASSERT_TRUE(cb->v.sint == node.v.sint);
+        break;
+    case CN_CBOR_BYTES: case CN_CBOR_TEXT: case CN_CBOR_NEGBIGNUM:
+        ASSERT_TRUE(cb->v.bytes == node.v.bytes);
+        break;
+    case CN_CBOR_DOUBLE:
+        ASSERT_DATA((const unsigned char *)&cb->v.dbl, sizeof(double),
+                    (const unsigned char *)&node.v.dbl, sizeof(double));
+        break;
+    default:;
+    }
+    child = at + 2;
+    for (cp = cb->first_child; cp; cp = cp->next) {
+        tape_check(tape, child, cp);
+        child = cn_cbor_tape_next(tape, child);
+    }
+    if (cb->first_child || cn_cbor_tape_next(tape, at) != at + 1)
+        ASSERT_EQUAL(child, cn_cbor_tape_next(tape, at));
+}
+
+static bool tape_decode_check(uint8_t *buf, size_t len, const cn_cbor *cb,
+                              cn_cbor_errback *errp)
+{
+    cn_cbor_tape tape;
+
+    if (!cn_cbor_tape_decode(buf, len, NULL, &tape CONTEXT_NULL, errp))
+        return false;
+    /* the same items in the same order */
+    if (cb) {
+        tape_check(&tape, 0, cb);
+        ASSERT_EQUAL(tape.count, cn_cbor_tape_next(&tape, 0));
+    }
+    cn_cbor_tape_free(&tape CONTEXT_NULL);
+    return true;
+}
+
+CTEST(cbor, tape)
+{
+    cn_cbor_errback err;
+    cn_cbor_limits limits;
+    cn_cbor_tape tape;
+    buffer b;
+    size_t i;
+
+    check_prefixes(tape_decode_check);
+
+    /* {"a": [1, 2], 3: "b", -4: {}, "cd": 5} */
+    ASSERT_TRUE(parse_hex("a4616182010203616223a062636405", &b));
+    ASSERT_TRUE(cn_cbor_tape_decode(b.ptr, b.sz, NULL, &tape CONTEXT_NULL, &err));
+    ASSERT_EQUAL(14, tape.count);
+    ASSERT_EQUAL(CN_CBOR_MAP, cn_cbor_tape_type(&tape, 0));
+    i = cn_cbor_tape_mapget_string(&tape, 0, "a");
+    ASSERT_EQUAL(3, i);
+    ASSERT_EQUAL(CN_CBOR_ARRAY, cn_cbor_tape_type(&tape, i));
+    ASSERT_EQUAL(6, cn_cbor_tape_index(&tape, i, 1));
+    ASSERT_EQUAL(0, cn_cbor_tape_index(&tape, i, 2));
+    ASSERT_EQUAL(8, cn_cbor_tape_mapget_int(&tape, 0, 3));
+    ASSERT_EQUAL(10, cn_cbor_tape_mapget_int(&tape, 0, -4));
+    ASSERT_EQUAL(13, cn_cbor_tape_mapget_string(&tape, 0, "cd"));
+    ASSERT_EQUAL(0, cn_cbor_tape_mapget_string(&tape, 0, "b"));
+    ASSERT_EQUAL(0, cn_cbor_tape_mapget_int(&tape, 0, 5));
+    ASSERT_EQUAL(0, cn_cbor_tape_mapget_int(&tape, 12, 5));
+    ASSERT_EQUAL(0, cn_cbor_tape_index(&tape, 10, 0));
+    /* skipping a container is a single jump */
+    ASSERT_EQUAL(7, cn_cbor_tape_next(&tape, 3));
+    cn_cbor_tape_free(&tape CONTEXT_NULL);
+    ASSERT_NULL(tape.words);
+
+    /* limits apply as for cn_cbor_validate */
+    memset(&limits, 0, sizeof(limits));
+    limits.max_items = 9;
+    ASSERT_FALSE(cn_cbor_tape_decode(b.ptr, b.sz, &limits, &tape CONTEXT_NULL, &err));
+    ASSERT_EQUAL(CN_CBOR_ERR_MAX_ITEMS, err.err);
+    ASSERT_EQUAL(12, err.pos);
+    ASSERT_NULL(tape.words);
+    free(b.ptr);
+}
+
+CTEST(cbor, tape_image)
+{
+    cn_cbor_errback err;
+    cn_cbor_tape tape, image_tape;
+    cn_cbor *cb;
+    buffer b;
+    uint64_t *image, *moved;
+    size_t size;
+
+    /* {"a": [1, 2], 3: "b", -4: {}, "cd": 5} */
+    ASSERT_TRUE(parse_hex("a4616182010203616223a062636405", &b));
+    cb = cn_cbor_decode(b.ptr, b.sz CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(cb);
+    ASSERT_TRUE(cn_cbor_tape_decode(b.ptr, b.sz, NULL, &tape CONTEXT_NULL, &err));
+    size = cn_cbor_tape_image_size(&tape);
+    ASSERT_EQUAL(24 + 14 * 8 + b.sz, size);
+    image = malloc(size + 8);
+    moved = malloc(size + 8);
+    ASSERT_EQUAL(-1, cn_cbor_tape_image_write((uint8_t *)image, size - 1, &tape));
+    ASSERT_EQUAL(size, cn_cbor_tape_image_write((uint8_t *)image, size, &tape));
+    cn_cbor_tape_free(&tape CONTEXT_NULL);
+
+    /* the image is independent of where it is, and of the input */
+    memcpy(moved, image, size);
+    memset(image, 0, size);
+    free(b.ptr);
+    ASSERT_TRUE(cn_cbor_tape_image_open((uint8_t *)moved, size, &image_tape, &err));
+    ASSERT_EQUAL(14, image_tape.count);
+    ASSERT_TRUE(image_tape.buf == (uint8_t *)moved + 24 + 14 * 8);
+    ASSERT_EQUAL(13, cn_cbor_tape_mapget_string(&image_tape, 0, "cd"));
+    ASSERT_EQUAL(10, cn_cbor_tape_mapget_int(&image_tape, 0, -4));
+
+    /* the same items as decoding the copy of the input it holds */
+    cn_cbor_free(cb CONTEXT_NULL);
+    cb = cn_cbor_decode(image_tape.buf, image_tape.len CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(cb);
+    tape_check(&image_tape, 0, cb);
+    cn_cbor_free(cb CONTEXT_NULL);
+
+    ASSERT_FALSE(cn_cbor_tape_image_open((uint8_t *)moved, size - 1, &image_tape, &err));
+    ASSERT_EQUAL(CN_CBOR_ERR_OUT_OF_DATA, err.err);
+    ASSERT_FALSE(cn_cbor_tape_image_open((uint8_t *)moved, 23, &image_tape, &err));
+    ASSERT_EQUAL(CN_CBOR_ERR_OUT_OF_DATA, err.err);
+    memmove((uint8_t *)moved + 1, moved, size);
+    ASSERT_FALSE(cn_cbor_tape_image_open((uint8_t *)moved + 1, size, &image_tape, &err));
+    ASSERT_EQUAL(CN_CBOR_ERR_INVALID_PARAMETER, err.err);
+    ASSERT_FALSE(cn_cbor_tape_image_open((uint8_t *)image, size, &image_tape, &err));
+    ASSERT_EQUAL(CN_CBOR_ERR_INVALID_PARAMETER, err.err);
+    ASSERT_NULL(image_tape.words);
+    free(image);
+    free(moved);
+}
+
+#ifdef CBOR_PUBLISH
+#define PUBLISHED_READERS 4
+
+static cn_cbor_published published;
+static cn_cbor_reader published_slots[PUBLISHED_READERS];
+static volatile int published_done;
+static volatile int published_left;
+
+/* A tree whose two elements are always equal. */
+static cn_cbor *published_tree(int64_t gen)
+{
+    cn_cbor *cb = cn_cbor_array_create(CONTEXT_NULL_COMMA NULL);
+    cn_cbor_array_append(cb, cn_cbor_int_create(gen CONTEXT_NULL, NULL), NULL);
+    cn_cbor_array_append(cb, cn_cbor_int_create(gen CONTEXT_NULL, NULL), NULL);
+    return cb;
+}
+
+static void *published_reader(void *arg)
+{
+    size_t reader = (size_t)arg;
+    const cn_cbor *cb;
+    uint64_t last = 0, bad = 0;
+
+    while (!__atomic_load_n(&published_done, __ATOMIC_ACQUIRE)) {
+        cb = cn_cbor_published_enter(&published, reader);
+        if (cb->first_child->v.uint != cb->last_child->v.uint ||
+            cb->first_child->v.uint < last)
+            bad++;
+        last = cb->first_child->v.uint;
+        cn_cbor_published_exit(&published, reader);
+        sched_yield();          /* the updater may share our CPU */
+    }
+    return (void *)(uintptr_t)bad;
+}
+
+static void *published_slow_reader(void *arg)
+{
+    const cn_cbor *cb = cn_cbor_published_enter(&published, 0);
+    __atomic_store_n(&published_left, 1, __ATOMIC_RELEASE);
+    usleep(50000);
+    __atomic_store_n(&published_left, 2, __ATOMIC_RELEASE);
+    (void)cb;
+    cn_cbor_published_exit(&published, 0);
+    return arg;
+}
+
+CTEST(cbor, published)
+{
+    pthread_t threads[PUBLISHED_READERS];
+    const cn_cbor *cb;
+    void *bad;
+    size_t i;
+    int64_t gen;
+
+    /* each slot on a cache line of its own */
+    ASSERT_EQUAL(64, sizeof(published_slots[0]));
+    ASSERT_EQUAL(0, (uintptr_t)published_slots % 64);
+    cn_cbor_published_init(&published, published_slots, PUBLISHED_READERS,
+                           published_tree(0));
+    cb = cn_cbor_published_enter(&published, 1);
+    ASSERT_EQUAL(0, cb->first_child->v.sint);
+    cn_cbor_published_exit(&published, 1);
+    cn_cbor_published_update(&published, published_tree(1) CONTEXT_NULL);
+    cb = cn_cbor_published_enter(&published, 1);
+    ASSERT_EQUAL(1, cb->first_child->v.sint);
+    cn_cbor_published_exit(&published, 1);
+
+    /* an update waits for readers that can still see the old tree */
+    published_left = 0;
+    ASSERT_EQUAL(0, pthread_create(&threads[0], NULL, published_slow_reader, NULL));
+    while (!__atomic_load_n(&published_left, __ATOMIC_ACQUIRE))
+        sched_yield();
+    cn_cbor_published_update(&published, published_tree(2) CONTEXT_NULL);
+    ASSERT_EQUAL(2, __atomic_load_n(&published_left, __ATOMIC_ACQUIRE));
+    pthread_join(threads[0], NULL);
+
+    /* readers only ever see whole trees, in order */
+    published_done = 0;
+    for (i = 0; i < PUBLISHED_READERS; i++)
+        ASSERT_EQUAL(0, pthread_create(&threads[i], NULL, published_reader,
+                                       (void *)i));
+    for (gen = 3; gen < 200; gen++)
+        cn_cbor_published_update(&published, published_tree(gen) CONTEXT_NULL);
+    __atomic_store_n(&published_done, 1, __ATOMIC_RELEASE);
+    for (i = 0; i < PUBLISHED_READERS; i++) {
+        pthread_join(threads[i], &bad);
+        ASSERT_TRUE(bad == NULL);
+    }
+    cn_cbor_published_update(&published, NULL CONTEXT_NULL);
+    ASSERT_NULL(cn_cbor_published_enter(&published, 0));
+    cn_cbor_published_exit(&published, 0);
+}
+#endif /* CBOR_PUBLISH */
+
+/* Join the segments of an iovec array */
+static size_t iov_join(const struct iovec *iov, int count, uint8_t *out)
+{
+    size_t len = 0;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        memcpy(out + len, iov[i].iov_base, iov[i].iov_len);
+        len += iov[i].iov_len;
+    }
+    return len;
+}
+
+CTEST(cbor, encode_iov)
+{
+    static uint8_t blob[1000], small[300];
+    uint8_t buf[2048], scratch[64], big_scratch[512], joined[2048];
+    struct iovec iov[8];
+    cn_cbor_decode_options opts;
+    cn_cbor_errback err;
+    cn_cbor *map, *arr, *cb;
+    ssize_t len, iov_len;
+    int count;
+
+    memset(blob, 'b', sizeof(blob));
+    memset(small, 's', sizeof(small));
+    map = cn_cbor_map_create(CONTEXT_NULL_COMMA NULL);
+    ASSERT_TRUE(cn_cbor_mapput_string(map, "small",
+                                      cn_cbor_string_create("ab" CONTEXT_NULL, NULL)
+                                      CONTEXT_NULL, NULL));
+    ASSERT_TRUE(cn_cbor_mapput_string(map, "blob",
+                                      cn_cbor_data_create(blob, sizeof(blob) CONTEXT_NULL, NULL)
+                                      CONTEXT_NULL, NULL));
+    arr = cn_cbor_array_create(CONTEXT_NULL_COMMA NULL);
+    cn_cbor_array_append(arr, cn_cbor_data_create(small, sizeof(small) CONTEXT_NULL, NULL), NULL);
+    cn_cbor_array_append(arr, cn_cbor_int_create(7 CONTEXT_NULL, NULL), NULL);
+    ASSERT_TRUE(cn_cbor_mapput_string(map, "arr", arr CONTEXT_NULL, NULL));
+
+    len = cn_cbor_encoder_write(buf, 0, sizeof(buf), map);
+    ASSERT_TRUE(len > 1300);
+
+    /* the same bytes, with both large strings referenced in place */
+    count = 8;
+    iov_len = cn_cbor_encoder_write_iov(scratch, sizeof(scratch), iov, &count,
+                                        256, map, NULL);
+    ASSERT_EQUAL(len, iov_len);
+    ASSERT_EQUAL(5, count);
+    ASSERT_TRUE(iov[0].iov_base == scratch);
+    ASSERT_TRUE(iov[1].iov_base == blob);
+    ASSERT_EQUAL(sizeof(blob), iov[1].iov_len);
+    ASSERT_TRUE(iov[3].iov_base == small);
+    ASSERT_EQUAL(1, iov[4].iov_len);
+    ASSERT_EQUAL(len, iov_join(iov, count, joined));
+    ASSERT_DATA(buf, len, joined, len);
+
+    /* a higher threshold copies the smaller one, and the trailing int
+       goes into the last segment */
+    count = 8;
+    ASSERT_EQUAL(len, cn_cbor_encoder_write_iov(big_scratch, sizeof(big_scratch),
+                                                iov, &count, 500, map, NULL));
+    ASSERT_EQUAL(3, count);
+    ASSERT_TRUE(iov[1].iov_base == blob);
+    ASSERT_EQUAL(len, iov_join(iov, count, joined));
+    ASSERT_DATA(buf, len, joined, len);
+
+    /* too few iovecs, too little scratch space, no threshold */
+    count = 4;
+    ASSERT_EQUAL(-1, cn_cbor_encoder_write_iov(scratch, sizeof(scratch), iov, &count,
+                                               256, map, NULL));
+    count = 8;
+    ASSERT_EQUAL(-1, cn_cbor_encoder_write_iov(scratch, 8, iov, &count,
+                                               256, map, NULL));
+    ASSERT_EQUAL(-1, cn_cbor_encoder_write_iov(scratch, sizeof(scratch), iov, &count,
+                                               0, map, NULL));
+
+    /* an unchanged decoded container is referenced as a whole */
+    memset(&opts, 0, sizeof(opts));
+    opts.flags = CN_CBOR_DECODE_SPANS;
+    cb = cn_cbor_decode_opts(buf, len, &opts CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(cb);
+    count = 8;
+    ASSERT_EQUAL(len, cn_cbor_encoder_write_iov(scratch, sizeof(scratch), iov, &count,
+                                                256, cb, NULL));
+    ASSERT_EQUAL(1, count);
+    ASSERT_TRUE(iov[0].iov_base == buf);
+    cn_cbor_free(cb CONTEXT_NULL);
+    cn_cbor_free(map CONTEXT_NULL);
+}
+
+static bool iov_check(uint8_t *buf, size_t len, const cn_cbor *cb,
+                      cn_cbor_errback *errp)
+{
+    struct iovec iov[40];
+    cn_cbor_errback err;
+    cn_cbor *cb2;
+    size_t split, n;
+    bool ok;
+
+    /* one byte per fragment */
+    ASSERT_TRUE(len <= sizeof(iov) / sizeof(iov[0]));
+    for (n = 0; n < len; n++) {
+        iov[n].iov_base = buf + n;
+        iov[n].iov_len = 1;
+    }
+    cb2 = cn_cbor_decode_iov(iov, (int)len, NULL CONTEXT_NULL, errp);
+    ASSERT_TRUE(cn_cbor_equal(cb, cb2));
+    ok = cb2 != NULL;
+    cn_cbor_free(cb2 CONTEXT_NULL);
+
+    /* split in two at every point, with an empty fragment between */
+    for (split = 0; split <= len; split++) {
+        iov[0].iov_base = buf;
+        iov[0].iov_len = split;
+        iov[1].iov_base = NULL;
+        iov[1].iov_len = 0;
+        iov[2].iov_base = buf + split;
+        iov[2].iov_len = len - split;
+        err.err = CN_CBOR_NO_ERROR;
+        err.pos = -1;
+        cb2 = cn_cbor_decode_iov(iov, 3, NULL CONTEXT_NULL, &err);
+        ASSERT_TRUE(cn_cbor_equal(cb, cb2));
+        ASSERT_EQUAL(errp->err, err.err);
+        ASSERT_EQUAL(errp->pos, err.pos);
+        cn_cbor_free(cb2 CONTEXT_NULL);
+    }
+    return ok;
+}
+
+CTEST(cbor, decode_iov)
+{
+    cn_cbor_errback err;
+    cn_cbor_limits limits;
+    cn_cbor_decode_options opts;
+    struct iovec iov[2];
+    cn_cbor *cb;
+    buffer b;
+
+    check_prefixes(iov_check);
+
+    /* ["hello", h'hello world'], split inside the second string */
+    ASSERT_TRUE(parse_hex("826568656c6c6f4b68656c6c6f20776f726c64", &b));
+    iov[0].iov_base = b.ptr;
+    iov[0].iov_len = 12;
+    iov[1].iov_base = b.ptr + 12;
+    iov[1].iov_len = b.sz - 12;
+    cb = cn_cbor_decode_iov(iov, 2, NULL CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(cb);
+    /* the first string is used in place, the second is copied */
+    ASSERT_TRUE(cb->first_child->v.bytes == b.ptr + 2);
+    ASSERT_TRUE(cb->last_child->v.bytes < b.ptr ||
+                cb->last_child->v.bytes >= b.ptr + b.sz);
+    ASSERT_DATA(b.ptr + 8, 11, cb->last_child->v.bytes, 11);
+    cn_cbor_free(cb CONTEXT_NULL);
+
+    /* the copy counts towards max_bytes */
+    memset(&limits, 0, sizeof(limits));
+    memset(&opts, 0, sizeof(opts));
+    opts.limits = &limits;
+    limits.max_bytes = 3 * sizeof(cn_cbor) + 10;
+    ASSERT_NULL(cn_cbor_decode_iov(iov, 2, &opts CONTEXT_NULL, &err));
+    ASSERT_EQUAL(CN_CBOR_ERR_MAX_BYTES, err.err);
+    ASSERT_EQUAL(8, err.pos);
+    limits.max_bytes = 3 * sizeof(cn_cbor) + 11;
+    cb = cn_cbor_decode_iov(iov, 2, &opts CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(cb);
+    cn_cbor_free(cb CONTEXT_NULL);
+
+    ASSERT_NULL(cn_cbor_decode_iov(NULL, 0, NULL CONTEXT_NULL, &err));
+    ASSERT_EQUAL(CN_CBOR_ERR_OUT_OF_DATA, err.err);
+    free(b.ptr);
+
+    /* {"ab": 1, (_ "a", "b"): 2}, split inside the first key */
+    ASSERT_TRUE(parse_hex("a2626162017f61616162ff02", &b));
+    iov[0].iov_base = b.ptr;
+    iov[0].iov_len = 3;
+    iov[1].iov_base = b.ptr + 3;
+    iov[1].iov_len = b.sz - 3;
+    memset(&opts, 0, sizeof(opts));
+    opts.flags = CN_CBOR_DECODE_UNIQUE_KEYS;
+    ASSERT_NULL(cn_cbor_decode_iov(iov, 2, &opts CONTEXT_NULL, &err));
+    ASSERT_EQUAL(CN_CBOR_ERR_DUPLICATE_KEY, err.err);
+    ASSERT_EQUAL(b.sz - 1, err.pos);
+
+    /* options that need the input in one piece */
+    opts.flags = CN_CBOR_DECODE_SPANS;
+    ASSERT_NULL(cn_cbor_decode_iov(iov, 2, &opts CONTEXT_NULL, &err));
+    ASSERT_EQUAL(CN_CBOR_ERR_INVALID_PARAMETER, err.err);
+    opts.flags = 0;
+    opts.raw_depth = 1;
+    ASSERT_NULL(cn_cbor_decode_iov(iov, 2, &opts CONTEXT_NULL, &err));
+    ASSERT_EQUAL(CN_CBOR_ERR_INVALID_PARAMETER, err.err);
+    free(b.ptr);
+}
+
+CTEST(cbor, encode_stream)
+{
+    cn_cbor_encoder_stream st;
+    cn_cbor_encoder_options opts;
+    cn_cbor_decode_options dopts;
+    cn_cbor_errback err;
+    cn_cbor_slot slot;
+    uint8_t out[256], streamed[256];
+    cn_cbor *cb;
+    buffer b;
+    ssize_t len, n;
+    size_t i, chunk, total;
+    int pass;
+
+    memset(&dopts, 0, sizeof(dopts));
+    for (i = 0; i < sizeof(well_formed) / sizeof(well_formed[0]); i++) {
+        ASSERT_TRUE(parse_hex(well_formed[i], &b));
+        /* with and without bignums and spans */
+        for (pass = 0; pass < 2; pass++) {
+            dopts.flags = pass ? CN_CBOR_DECODE_SPANS | CN_CBOR_DECODE_BIGNUMS : 0;
+            cb = cn_cbor_decode_opts(b.ptr, b.sz, &dopts CONTEXT_NULL, &err);
+            ASSERT_NOT_NULL(cb);
+            len = cn_cbor_encoder_write(out, 0, sizeof(out), cb);
+            ASSERT_TRUE(len > 0);
+            /* every piece size gives the same bytes */
+            for (chunk = 1; chunk <= (size_t)len + 1; chunk++) {
+                ASSERT_TRUE(cn_cbor_encoder_stream_init(&st, cb, NULL));
+                total = 0;
+                while (!cn_cbor_encoder_stream_done(&st)) {
+                    n = cn_cbor_encoder_stream_write(&st, streamed + total, chunk);
+                    ASSERT_TRUE(n >= 0);
+                    total += n;
+                    ASSERT_TRUE(total <= (size_t)len);
+                    if (!cn_cbor_encoder_stream_done(&st))
+                        ASSERT_EQUAL(chunk, n);
+                }
+                ASSERT_EQUAL(len, total);
+                ASSERT_DATA(out, len, streamed, len);
+                ASSERT_EQUAL(0, cn_cbor_encoder_stream_write(&st, streamed, chunk));
+            }
+            cn_cbor_free(cb CONTEXT_NULL);
+        }
+        free(b.ptr);
+    }
+
+    /* the depth limit, and slots, which need one buffer */
+    ASSERT_TRUE(parse_hex("8181818100", &b));
+    cb = cn_cbor_decode(b.ptr, b.sz CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(cb);
+    memset(&opts, 0, sizeof(opts));
+    opts.max_depth = 3;
+    ASSERT_TRUE(cn_cbor_encoder_stream_init(&st, cb, &opts));
+    ASSERT_EQUAL(-1, cn_cbor_encoder_stream_write(&st, streamed, sizeof(streamed)));
+    ASSERT_EQUAL(-1, cn_cbor_encoder_stream_write(&st, streamed, sizeof(streamed)));
+    ASSERT_FALSE(cn_cbor_encoder_stream_done(&st));
+    opts.max_depth = 4;
+    ASSERT_TRUE(cn_cbor_encoder_stream_init(&st, cb, &opts));
+    ASSERT_EQUAL(5, cn_cbor_encoder_stream_write(&st, streamed, sizeof(streamed)));
+    ASSERT_TRUE(cn_cbor_encoder_stream_done(&st));
+    slot.cb = cb;
+    slot.width = 1;
+    opts.slots = &slot;
+    opts.slot_count = 1;
+    ASSERT_FALSE(cn_cbor_encoder_stream_init(&st, cb, &opts));
+    ASSERT_EQUAL(-1, cn_cbor_encoder_stream_write(&st, streamed, sizeof(streamed)));
+    cn_cbor_free(cb CONTEXT_NULL);
+    free(b.ptr);
+
+    ASSERT_TRUE(cn_cbor_encoder_stream_init(&st, NULL, NULL));
+    ASSERT_TRUE(cn_cbor_encoder_stream_done(&st));
+}
+
+CTEST(cbor, raw)
+{
+    cn_cbor_decode_options dopts;
+    cn_cbor_limits limits;
+    cn_cbor_errback err, err2;
+    cn_cbor_encoder_stream st;
+    struct iovec iov[4];
+    int iovcnt;
+    uint8_t out[64], joined[64];
+    cn_cbor *cb, *cb2, *raw, *env;
+    buffer b, cert;
+    ssize_t len;
+    size_t i;
+    char *bad[] = {
+        "a26161820161",
+        "a161618201ff",
+        "a16161c4",
+        "8281ff",
+        "829f5f01ffff",
+        "8281fc",
+    };
+
+    /* {"a": [1, 2], "b": 24({1: 2}), "c": 3} */
+    ASSERT_TRUE(parse_hex("a361618201026162d818a10102616303", &b));
+    memset(&dopts, 0, sizeof(dopts));
+    dopts.raw_depth = 1;
+    cb = cn_cbor_decode_opts(b.ptr, b.sz, &dopts CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(cb);
+    ASSERT_EQUAL(CN_CBOR_MAP, cb->type);
+    raw = cn_cbor_mapget_string(cb, "a");
+    ASSERT_NOT_NULL(raw);
+    ASSERT_EQUAL(CN_CBOR_RAW, raw->type);
+    ASSERT_EQUAL(3, raw->length);
+    ASSERT_TRUE(raw->v.bytes == b.ptr + 3);
+    ASSERT_NULL(raw->first_child);
+    raw = cn_cbor_mapget_string(cb, "b");
+    ASSERT_EQUAL(CN_CBOR_RAW, raw->type);
+    ASSERT_EQUAL(5, raw->length);
+    ASSERT_EQUAL(CN_CBOR_UINT, cn_cbor_mapget_string(cb, "c")->type);
+    len = cn_cbor_encoder_write(out, 0, sizeof(out), cb);
+    ASSERT_DATA(b.ptr, b.sz, out, len);
+
+    /* written as a reference, and streamed */
+    iovcnt = 4;
+    len = cn_cbor_encoder_write_iov(out, sizeof(out), iov, &iovcnt, 5, cb, NULL);
+    ASSERT_EQUAL((ssize_t)b.sz, len);
+    ASSERT_EQUAL(3, iovcnt);
+    ASSERT_TRUE(iov[1].iov_base == raw->v.bytes);
+    len = 0;
+    for (i = 0; i < (size_t)iovcnt; i++) {
+        memcpy(joined + len, iov[i].iov_base, iov[i].iov_len);
+        len += iov[i].iov_len;
+    }
+    ASSERT_DATA(b.ptr, b.sz, joined, len);
+    ASSERT_TRUE(cn_cbor_encoder_stream_init(&st, cb, NULL));
+    len = 0;
+    while (!cn_cbor_encoder_stream_done(&st)) {
+        ASSERT_EQUAL(1, cn_cbor_encoder_stream_write(&st, out + len, 1));
+        len++;
+    }
+    ASSERT_DATA(b.ptr, b.sz, out, len);
+    /* the strings inside would be missing from the table */
+    ASSERT_EQUAL(-1, cn_cbor_encoder_write_stringref(out, 0, sizeof(out), cb CONTEXT_NULL));
+
+    /* compared by their encoding */
+    cb2 = cn_cbor_decode_opts(b.ptr, b.sz, &dopts CONTEXT_NULL, &err);
+    ASSERT_TRUE(cn_cbor_equal(cb, cb2));
+    ASSERT_EQUAL(cn_cbor_hash(cb), cn_cbor_hash(cb2));
+    cn_cbor_free(cb2 CONTEXT_NULL);
+    cb2 = cn_cbor_decode(b.ptr, b.sz CONTEXT_NULL, &err);
+    ASSERT_FALSE(cn_cbor_equal(cb, cb2));
+    cn_cbor_free(cb2 CONTEXT_NULL);
+
+    /* deeper, with spans and in an arena */
+    dopts.raw_depth = 2;
+    dopts.flags = CN_CBOR_DECODE_SPANS | CN_CBOR_DECODE_ARENA;
+    cn_cbor_free(cb CONTEXT_NULL);
+    cb = cn_cbor_decode_opts(b.ptr, b.sz, &dopts CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(cb);
+    ASSERT_EQUAL(CN_CBOR_ARRAY, cn_cbor_mapget_string(cb, "a")->type);
+    raw = cn_cbor_mapget_string(cb, "b")->first_child;
+    ASSERT_EQUAL(CN_CBOR_RAW, raw->type);
+    ASSERT_EQUAL(3, raw->length);
+    len = cn_cbor_encoder_write(out, 0, sizeof(out), cb);
+    ASSERT_DATA(b.ptr, b.sz, out, len);
+    cn_cbor_free(cb CONTEXT_NULL);
+
+    /* errors and limits are the same as when decoding all of it */
+    for (i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        ASSERT_TRUE(parse_hex(bad[i], &cert));
+        dopts.raw_depth = 1;
+        dopts.flags = 0;
+        ASSERT_NULL(cn_cbor_decode_opts(cert.ptr, cert.sz, &dopts CONTEXT_NULL, &err));
+        ASSERT_NULL(cn_cbor_decode(cert.ptr, cert.sz CONTEXT_NULL, &err2));
+        ASSERT_EQUAL(err2.err, err.err);
+        ASSERT_EQUAL(err2.pos, err.pos);
+        free(cert.ptr);
+    }
+    memset(&limits, 0, sizeof(limits));
+    dopts.limits = &limits;
+    dopts.raw_depth = 1;
+    limits.max_depth = 2;
+    ASSERT_NULL(cn_cbor_decode_opts(b.ptr, b.sz, &dopts CONTEXT_NULL, &err));
+    ASSERT_NULL(cn_cbor_decode_limited(b.ptr, b.sz, &limits CONTEXT_NULL, &err2));
+    ASSERT_EQUAL(CN_CBOR_ERR_MAX_DEPTH, err.err);
+    ASSERT_EQUAL(err2.pos, err.pos);
+    limits.max_depth = 0;
+    limits.max_items = 11;
+    ASSERT_NULL(cn_cbor_decode_opts(b.ptr, b.sz, &dopts CONTEXT_NULL, &err));
+    ASSERT_EQUAL(CN_CBOR_ERR_MAX_ITEMS, err.err);
+    limits.max_items = 12;
+    cb = cn_cbor_decode_opts(b.ptr, b.sz, &dopts CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(cb);
+    cn_cbor_free(cb CONTEXT_NULL);
+
+    /* deeper than cn_cbor_skip goes: [[_ [_ ... 0 ] ... ]] */
+    cert.sz = 1 + 300 + 1 + 300;
+    cert.ptr = malloc(cert.sz);
+    cert.ptr[0] = 0x81;
+    memset(cert.ptr + 1, 0x9f, 300);
+    cert.ptr[301] = 0x00;
+    memset(cert.ptr + 302, 0xff, 300);
+    limits.max_items = 0;
+    cb = cn_cbor_decode_opts(cert.ptr, cert.sz, &dopts CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(cb);
+    ASSERT_EQUAL(CN_CBOR_RAW, cb->first_child->type);
+    ASSERT_EQUAL(cert.sz - 1, cb->first_child->length);
+    cn_cbor_free(cb CONTEXT_NULL);
+    limits.max_depth = 200;
+    ASSERT_NULL(cn_cbor_decode_opts(cert.ptr, cert.sz, &dopts CONTEXT_NULL, &err));
+    ASSERT_NULL(cn_cbor_decode_limited(cert.ptr, cert.sz, &limits CONTEXT_NULL, &err2));
+    ASSERT_EQUAL(CN_CBOR_ERR_MAX_DEPTH, err.err);
+    ASSERT_EQUAL(err2.err, err.err);
+    ASSERT_EQUAL(err2.pos, err.pos);
+    limits.max_depth = 0;
+    free(cert.ptr);
+
+    /* splicing a pre-encoded value into a new envelope */
+    ASSERT_TRUE(parse_hex("d818a10102", &cert));
+    raw = cn_cbor_raw_create(cert.ptr, cert.sz CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(raw);
+    env = cn_cbor_map_create(CONTEXT_NULL_COMMA &err);
+    ASSERT_TRUE(cn_cbor_mapput_int(env, 1, raw CONTEXT_NULL, &err));
+    len = cn_cbor_encoder_write(out, 0, sizeof(out), env);
+    ASSERT_DATA((const uint8_t *)"\xa1\x01\xd8\x18\xa1\x01\x02", 7, out, len);
+    cn_cbor_free(env CONTEXT_NULL);
+    ASSERT_NULL(cn_cbor_raw_create(cert.ptr, cert.sz - 1 CONTEXT_NULL, &err));
+    ASSERT_EQUAL(CN_CBOR_ERR_OUT_OF_DATA, err.err);
+    ASSERT_NULL(cn_cbor_raw_create(b.ptr + 3, 4 CONTEXT_NULL, &err));
+    ASSERT_EQUAL(CN_CBOR_ERR_NOT_ALL_DATA_CONSUMED, err.err);
+    ASSERT_EQUAL(3, err.pos);
+    ASSERT_NULL(cn_cbor_raw_create(NULL, 0 CONTEXT_NULL, &err));
+    ASSERT_EQUAL(CN_CBOR_ERR_INVALID_PARAMETER, err.err);
+    free(cert.ptr);
+    free(b.ptr);
+}
+
+CTEST(cbor, bulk_create)
+{
+    cn_cbor_errback err;
+    uint8_t out[64];
+    cn_cbor *cb, *copy, *env;
+    cn_cbor values[3];
+    ssize_t len;
+    int64_t ints[] = { 1, -2, 1000 };
+    const char *strs[] = { "a", "bc" };
+    const uint8_t *data[] = { (const uint8_t *)"\x01\x02", (const uint8_t *)"" };
+    int lengths[] = { 2, 0 };
+
+    cb = cn_cbor_int_array_create(ints, 3 CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(cb);
+    ASSERT_EQUAL(3, cb->length);
+    ASSERT_EQUAL(1000, cn_cbor_index(cb, 2)->v.uint);
+    ASSERT_TRUE(cb->last_child == cn_cbor_index(cb, 2));
+    len = cn_cbor_encoder_write(out, 0, sizeof(out), cb);
+    ASSERT_DATA((const uint8_t *)"\x83\x01\x21\x19\x03\xe8", 6, out, len);
+    /* more elements can still be appended, and are freed one by one */
+    ASSERT_TRUE(cn_cbor_array_append(cb, cn_cbor_int_create(7 CONTEXT_NULL, &err), &err));
+    len = cn_cbor_encoder_write(out, 0, sizeof(out), cb);
+    ASSERT_DATA((const uint8_t *)"\x84\x01\x21\x19\x03\xe8\x07", 7, out, len);
+    copy = cn_cbor_clone(cb CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(copy);
+    ASSERT_FALSE(copy->first_child->flags & CN_CBOR_FL_BLOCK);
+    ASSERT_TRUE(cn_cbor_equal(cb, copy));
+    cn_cbor_free(copy CONTEXT_NULL);
+
+    /* inside another tree */
+    env = cn_cbor_map_create(CONTEXT_NULL_COMMA &err);
+    ASSERT_TRUE(cn_cbor_mapput_int(env, 1, cb CONTEXT_NULL, &err));
+    cb = cn_cbor_string_array_create(strs, 2 CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(cb);
+    ASSERT_TRUE(cn_cbor_mapput_int(env, 2, cb CONTEXT_NULL, &err));
+    cb = cn_cbor_data_array_create(data, lengths, 2 CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(cb);
+    ASSERT_TRUE(cn_cbor_mapput_int(env, 3, cb CONTEXT_NULL, &err));
+    len = cn_cbor_encoder_write(out, 0, sizeof(out), env);
+    ASSERT_DATA((const uint8_t *)"\xa3\x01\x84\x01\x21\x19\x03\xe8\x07"
+                "\x02\x82\x61\x61\x62\x62\x63\x03\x82\x42\x01\x02\x40", 22, out, len);
+    cn_cbor_free(env CONTEXT_NULL);
+
+    /* maps, with the values copied in */
+    memset(values, 0, sizeof(values));
+    values[0].type = CN_CBOR_UINT;
+    values[0].v.uint = 1;
+    values[1].type = CN_CBOR_TEXT;
+    values[1].v.str = "x";
+    values[1].length = 1;
+    cb = cn_cbor_map_create_from_pairs(strs, values, 2 CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(cb);
+    ASSERT_EQUAL(4, cb->length);
+    ASSERT_EQUAL(CN_CBOR_TEXT, cn_cbor_mapget_string(cb, "bc")->type);
+    len = cn_cbor_encoder_write(out, 0, sizeof(out), cb);
+    ASSERT_DATA((const uint8_t *)"\xa2\x61\x61\x01\x62\x62\x63\x61\x78", 9, out, len);
+    ASSERT_TRUE(cn_cbor_mapput_int(cb, 5, cn_cbor_int_create(6 CONTEXT_NULL, &err) CONTEXT_NULL, &err));
+    ASSERT_EQUAL(6, cn_cbor_mapget_int(cb, 5)->v.uint);
+    cn_cbor_free(cb CONTEXT_NULL);
+    values[2].type = CN_CBOR_ARRAY;
+    values[2].flags = CN_CBOR_FL_INDEF;
+    cb = cn_cbor_map_create_from_int_pairs(ints, values, 3 CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(cb);
+    ASSERT_EQUAL(CN_CBOR_UINT, cn_cbor_mapget_int(cb, 1)->type);
+    ASSERT_EQUAL(CN_CBOR_TEXT, cn_cbor_mapget_int(cb, -2)->type);
+    len = cn_cbor_encoder_write(out, 0, sizeof(out), cb);
+    ASSERT_DATA((const uint8_t *)"\xa3\x01\x01\x21\x61\x78\x19\x03\xe8\x9f\xff", 11, out, len);
+    /* the indefinite array can be filled later */
+    ASSERT_TRUE(cn_cbor_array_append(cn_cbor_mapget_int(cb, 1000),
+                                     cn_cbor_int_create(1 CONTEXT_NULL, &err), &err));
+    len = cn_cbor_encoder_write(out, 0, sizeof(out), cb);
+    ASSERT_DATA((const uint8_t *)"\xa3\x01\x01\x21\x61\x78\x19\x03\xe8\x9f\x01\xff", 12, out, len);
+    cn_cbor_free(cb CONTEXT_NULL);
+
+    /* values with children cannot be copied */
+    values[2].first_child = values;
+    ASSERT_NULL(cn_cbor_map_create_from_int_pairs(ints, values, 3 CONTEXT_NULL, &err));
+    ASSERT_EQUAL(CN_CBOR_ERR_INVALID_PARAMETER, err.err);
+
+    cb = cn_cbor_int_array_create(NULL, 0 CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(cb);
+    ASSERT_NULL(cb->first_child);
+    len = cn_cbor_encoder_write(out, 0, sizeof(out), cb);
+    ASSERT_DATA((const uint8_t *)"\x80", 1, out, len);
+    cn_cbor_free(cb CONTEXT_NULL);
+}
+
+CTEST(cbor, owned_strings)
+{
+    cn_cbor_errback err;
+    cn_cbor_keydict dict;
+    const char *keys[] = { "unit", "temperature" };
+    char temp[32];
+    uint8_t out[64];
+    cn_cbor *cb, *map, *copy;
+    cn_cbor values[2];
+    const char *pair_keys[] = { "k", "l" };
+    ssize_t len;
+
+    /* short strings are kept in the node */
+    strcpy(temp, "unit");
+    cb = cn_cbor_string_create_copy(temp CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(cb);
+    ASSERT_TRUE(cb->flags & CN_CBOR_FL_OWNER);
+    ASSERT_TRUE(cb->v.str == cb->x.str);
+    memset(temp, 'x', sizeof(temp));
+    ASSERT_STR("unit", cb->v.str);
+    ASSERT_EQUAL(4, cb->length);
+    map = cn_cbor_map_create(CONTEXT_NULL_COMMA &err);
+    ASSERT_TRUE(cn_cbor_map_put(map, cb, cn_cbor_int_create(1 CONTEXT_NULL, &err), &err));
+
+    /* longer ones right after it */
+    strcpy(temp, "temperature");
+    cb = cn_cbor_string_create_copy(temp CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(cb);
+    ASSERT_TRUE(cb->flags & CN_CBOR_FL_OWNER);
+    ASSERT_TRUE(cb->v.str == (const char *)(cb + 1));
+    memset(temp, 'x', sizeof(temp));
+    ASSERT_STR("temperature", cb->v.str);
+    ASSERT_TRUE(cn_cbor_map_put(map, cb, cn_cbor_int_create(2 CONTEXT_NULL, &err), &err));
+    ASSERT_TRUE(cn_cbor_mapput_string(map, "data",
+        cn_cbor_data_create_copy((const uint8_t *)"\x00\x01\x02\x03\x04\x05\x06\x07", 8
+                                 CONTEXT_NULL, &err) CONTEXT_NULL, &err));
+    ASSERT_TRUE(cn_cbor_mapput_string(map, "empty",
+        cn_cbor_data_create_copy(NULL, 0 CONTEXT_NULL, &err) CONTEXT_NULL, &err));
+
+    len = cn_cbor_encoder_write(out, 0, sizeof(out), map);
+    ASSERT_DATA((const uint8_t *)"\xa4\x64unit\x01\x6btemperature\x02"
+                "\x64" "data\x48\x00\x01\x02\x03\x04\x05\x06\x07\x65" "empty\x40",
+                41, out, len);
+    ASSERT_EQUAL(1, cn_cbor_mapget_string(map, "unit")->v.uint);
+    /* the stored characters are not mistaken for a key id */
+    ASSERT_TRUE(cn_cbor_keydict_init(&dict, keys, 2, &err));
+    ASSERT_EQUAL(1, cn_cbor_mapget_key(map, &dict, 0)->v.uint);
+    ASSERT_EQUAL(2, cn_cbor_mapget_key(map, &dict, 1)->v.uint);
+
+    /* a clone takes the short strings along */
+    copy = cn_cbor_clone(map CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(copy);
+    ASSERT_TRUE(copy->first_child->v.str == copy->first_child->x.str);
+    ASSERT_TRUE(cn_cbor_equal(map, copy));
+    cn_cbor_free(copy CONTEXT_NULL);
+    cn_cbor_free(map CONTEXT_NULL);
+
+    /* so does a map built from pairs, also from a struct copy */
+    cb = cn_cbor_string_create_copy("abc" CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(cb);
+    map = cn_cbor_map_create_from_pairs(pair_keys, cb, 1 CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(map);
+    values[0] = *cb;
+    values[1] = *cb;
+    cn_cbor_free(cb CONTEXT_NULL);
+    copy = cn_cbor_map_create_from_pairs(pair_keys, values, 2 CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(copy);
+    memset(values, 0, sizeof(values));
+    ASSERT_STR("abc", cn_cbor_mapget_string(map, "k")->v.str);
+    ASSERT_STR("abc", cn_cbor_mapget_string(copy, "l")->v.str);
+    len = cn_cbor_encoder_write(out, 0, sizeof(out), copy);
+    ASSERT_DATA((const uint8_t *)"\xa2\x61k\x63" "abc\x61l\x63" "abc", 13, out, len);
+    cn_cbor_free(copy CONTEXT_NULL);
+    cn_cbor_free(map CONTEXT_NULL);
+
+    ASSERT_NULL(cn_cbor_data_create_copy(NULL, 1 CONTEXT_NULL, &err));
+    ASSERT_EQUAL(CN_CBOR_ERR_INVALID_PARAMETER, err.err);
+    ASSERT_NULL(cn_cbor_data_create_copy(out, -1 CONTEXT_NULL, &err));
+    ASSERT_EQUAL(CN_CBOR_ERR_INVALID_PARAMETER, err.err);
+}
@@ -0,0 +1,168 @@
+/*
+ * Copyright (c) 2015 SPUDlib authors.  See LICENSE file.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "cn-cbor/cn-cbor.h"
+#include "sensor-cddl.h"
+
+#define CTEST_MAIN
+#include "ctest.h"
+
+int main(int argc, const char *argv[])
+{
+    return ctest_main(argc, argv);
+}
+
+#ifdef USE_CBOR_CONTEXT
+#define CONTEXT_NULL , NULL
+#else
+#define CONTEXT_NULL
+#endif
+
+typedef struct _buffer {
+    size_t sz;
+    unsigned char *ptr;
+} buffer;
+
+static bool parse_hex(char *inp, buffer *b)
+{
+    int len = strlen(inp);
+    size_t i;
+    if (len%2 != 0) {
+        b->sz = -1;
+        b->ptr = NULL;
+        return false;
+    }
+    b->sz  = len / 2;
+    b->ptr = malloc(b->sz);
+    for (i=0; i<b->sz; i++) {
+        sscanf(inp+(2*i), "%02hhx", &b->ptr[i]);
+    }
+    return true;
+}
+
+CTEST(cddl, decode)
+{
+    cn_cbor_errback err;
+    struct reading r;
+    buffer b;
+
+    // {"ok": true, 1: 7, "sensor-id": "t1", 2: 1.5, "junk": [1, 2],
+    //  -1: -5, "location": [1.0, 2.5, 100]}
+    ASSERT_TRUE(parse_hex("a7626f6bf501076973656e736f722d69646274310"
+                          "2f93e00646a756e6b8201022024686c6f636174696f"
+                          "6e83f93c00f941001864", &b));
+    ASSERT_EQUAL(b.sz, reading_decode(b.ptr, b.sz, &r, &err));
+    ASSERT_TRUE(r.ok);
+    ASSERT_EQUAL(7, r.seq);
+    ASSERT_EQUAL(2, r.sensor_id_len);
+    ASSERT_TRUE(memcmp(r.sensor_id, "t1", 2) == 0);
+    ASSERT_TRUE(r.value == 1.5);
+    ASSERT_FALSE(r.has_unit);
+    ASSERT_FALSE(r.has_raw);
+    ASSERT_TRUE(r.has_key_m1);
+    ASSERT_EQUAL(-5, r.key_m1);
+    ASSERT_TRUE(r.has_location);
+    ASSERT_TRUE(r.location.lat == 1.0);
+    ASSERT_TRUE(r.location.lon == 2.5);
+    ASSERT_TRUE(r.location.has_alt);
+    ASSERT_EQUAL(100, r.location.alt);
+
+    ASSERT_EQUAL(0, reading_decode(b.ptr, b.sz - 1, &r, &err));
+    ASSERT_EQUAL(CN_CBOR_ERR_OUT_OF_DATA, err.err);
+    free(b.ptr);
+}
+
+CTEST(cddl, decode_errors)
+{
+    cn_cbor_errback err;
+    struct reading r;
+    struct position p;
+    buffer b;
+
+    // {1: 7}: no "sensor-id", 2 or "ok"
+    ASSERT_TRUE(parse_hex("a10107", &b));
+    ASSERT_EQUAL(0, reading_decode(b.ptr, b.sz, &r, &err));
+    ASSERT_EQUAL(CN_CBOR_ERR_MISSING_FIELD, err.err);
+    free(b.ptr);
+
+    // {1: "x"}
+    ASSERT_TRUE(parse_hex("a1016178", &b));
+    ASSERT_EQUAL(0, reading_decode(b.ptr, b.sz, &r, &err));
+    ASSERT_EQUAL(CN_CBOR_ERR_WRONG_TYPE, err.err);
+    ASSERT_EQUAL(2, err.pos);
+    free(b.ptr);
+
+    // [1.0]: too short; [_ 1.0, 2.0]: indefinite
+    ASSERT_TRUE(parse_hex("81f93c00", &b));
+    ASSERT_EQUAL(0, position_decode(b.ptr, b.sz, &p, &err));
+    ASSERT_EQUAL(CN_CBOR_ERR_WRONG_TYPE, err.err);
+    free(b.ptr);
+    ASSERT_TRUE(parse_hex("9ff93c00f94000ff", &b));
+    ASSERT_EQUAL(0, position_decode(b.ptr, b.sz, &p, &err));
+    ASSERT_EQUAL(CN_CBOR_ERR_WRONG_TYPE, err.err);
+    free(b.ptr);
+
+    // [1.0, 2.0] leaves out the optional altitude
+    ASSERT_TRUE(parse_hex("82f93c00f94000", &b));
+    ASSERT_EQUAL(b.sz, position_decode(b.ptr, b.sz, &p, &err));
+    ASSERT_FALSE(p.has_alt);
+    free(b.ptr);
+}
+
+CTEST(cddl, roundtrip)
+{
+    cn_cbor_errback err;
+    struct reading in, out;
+    static const uint8_t raw[] = { 0xde, 0xad };
+    unsigned char buf[128];
+    ssize_t sz;
+    cn_cbor *cb;
+
+    memset(&in, 0, sizeof(in));
+    in.sensor_id = "thermo-7";
+    in.sensor_id_len = 8;
+    in.seq = 100000;
+    in.value = -21.25;
+    in.has_unit = true;
+    in.unit = "C";
+    in.unit_len = 1;
+    in.ok = false;
+    in.has_raw = true;
+    in.raw = raw;
+    in.raw_len = sizeof(raw);
+    in.has_location = true;
+    in.location.lat = 52.5;
+    in.location.lon = 13.25;
+
+    sz = reading_encode(buf, 0, sizeof(buf), &in);
+    ASSERT_TRUE(sz > 0);
+    ASSERT_EQUAL(-1, reading_encode(buf, 0, sz - 1, &in));
+
+    ASSERT_EQUAL(sz, reading_decode(buf, sz, &out, &err));
+    ASSERT_EQUAL(8, out.sensor_id_len);
+    ASSERT_TRUE(memcmp(out.sensor_id, "thermo-7", 8) == 0);
+    ASSERT_EQUAL(100000, out.seq);
+    ASSERT_TRUE(out.value == -21.25);
+    ASSERT_TRUE(out.has_unit);
+    ASSERT_EQUAL(1, out.unit_len);
+    ASSERT_FALSE(out.ok);
+    ASSERT_TRUE(out.has_raw);
+    ASSERT_DATA(raw, sizeof(raw), out.raw, out.raw_len);
+    ASSERT_FALSE(out.has_key_m1);
+    ASSERT_TRUE(out.has_location);
+    ASSERT_FALSE(out.location.has_alt);
+    ASSERT_TRUE(out.location.lon == 13.25);
+
+    // the generic decoder reads the same thing
+    cb = cn_cbor_decode(buf, sz CONTEXT_NULL, &err);
+    ASSERT_NOT_NULL(cb);
+    ASSERT_EQUAL(100000, cn_cbor_mapget_int(cb, 1)->v.uint);
+    ASSERT_EQUAL(CN_CBOR_FALSE, cn_cbor_mapget_string(cb, "ok")->type);
+    cn_cbor_free(cb CONTEXT_NULL);
+}
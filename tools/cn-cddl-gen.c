@@ -0,0 +1,1162 @@
+/*
+ * cn-cddl-gen: generate schema-specific C decoders and encoders from a
+ * subset of CDDL (RFC 8610).
+ *
+ *   cn-cddl-gen <input.cddl> <output.h> <output.c>
+ *
+ * Supported:
+ *   name = { members }     a map, decoded into `struct name`
+ *   name = [ members ]     an array of fixed positions (a record)
+ *   name = 1 / "text"      a value, usable as a map key with `name => type`
+ *   name = type            an alias for another type
+ *
+ * Map members are `? key: type` or `? key => type`, where the key is a
+ * bareword (a text key), an integer, a quoted text string or the name of
+ * a value rule.  Array members are `? label: type` or just `type`; only
+ * trailing array members may be optional.  The types are uint, nint, int,
+ * bool, tstr/text, bstr/bytes, float/float16/float32/float64 and the names
+ * of other map and array rules.  Only definite-length containers and
+ * strings are accepted; unknown map keys are skipped.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_NAME 64
+#define MAX_RULES 256
+#define MAX_FIELDS 64            /* the presence of fields is a uint64_t */
+
+typedef enum {
+  K_NONE,
+  K_UINT,
+  K_INT,
+  K_NINT,
+  K_BOOL,
+  K_TSTR,
+  K_BSTR,
+  K_FLOAT,
+  K_RULE,
+  K_COUNT
+} kind;
+
+typedef enum {
+  KEY_NONE,
+  KEY_INT,
+  KEY_TEXT,
+  KEY_RULE                      /* name of a value rule, resolved later */
+} key_kind;
+
+typedef struct {
+  char name[MAX_NAME];
+  bool optional;
+  key_kind key;
+  int64_t ikey;
+  char tkey[MAX_NAME];
+  char type[MAX_NAME];
+  kind kind;
+  int rule;                     /* for K_RULE */
+  int line;
+} field;
+
+typedef enum {
+  R_MAP,
+  R_ARRAY,
+  R_INT,
+  R_TEXT,
+  R_ALIAS
+} rule_form;
+
+typedef struct {
+  char name[MAX_NAME];
+  char cname[MAX_NAME];
+  rule_form form;
+  int nfields;
+  field fields[MAX_FIELDS];
+  int64_t ival;
+  char tval[MAX_NAME];
+  char alias[MAX_NAME];
+  int line;
+  int mark;                     /* 0 new, 1 visiting, 2 emitted */
+} rule;
+
+static const char *in_name;
+static rule rules[MAX_RULES];
+static int nrules;
+static bool used[K_COUNT];
+static bool used_maps, used_int_keys, used_text_keys;
+
+static void die(int line, const char *fmt, ...)
+{
+  va_list ap;
+
+  fprintf(stderr, "%s:%d: ", in_name, line);
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+  fputc('\n', stderr);
+  exit(1);
+}
+
+/* ---- tokenizer ---- */
+
+typedef enum {
+  T_EOF,
+  T_ID,
+  T_INT,
+  T_STR,
+  T_ARROW,
+  T_PUNCT
+} tok_type;
+
+typedef struct {
+  tok_type type;
+  char text[MAX_NAME];
+  int64_t ival;
+  int line;
+} token;
+
+static const char *src;
+static int line = 1;
+static token tok, peek;
+static bool have_peek;
+
+static bool id_start(int c)
+{
+  return isalpha(c) || c == '_' || c == '@' || c == '$';
+}
+
+static bool id_char(int c)
+{
+  return id_start(c) || isdigit(c) || c == '-' || c == '.';
+}
+
+static token lex(void)
+{
+  token t;
+  size_t n = 0;
+
+  memset(&t, 0, sizeof(t));
+  for (;;) {
+    while (isspace((unsigned char)*src)) {
+      if (*src++ == '\n')
+        line++;
+    }
+    if (*src != ';')
+      break;
+    while (*src && *src != '\n')
+      src++;
+  }
+  t.line = line;
+  if (!*src) {
+    t.type = T_EOF;
+  } else if (id_start((unsigned char)*src)) {
+    t.type = T_ID;
+    while (id_char((unsigned char)*src)) {
+      if (n == MAX_NAME - 1)
+        die(line, "name too long");
+      t.text[n++] = *src++;
+    }
+    /* a trailing hyphen or dot is not part of a CDDL name */
+    while (n && (t.text[n-1] == '-' || t.text[n-1] == '.')) {
+      t.text[--n] = 0;
+      src--;
+    }
+  } else if (isdigit((unsigned char)*src) ||
+             (*src == '-' && isdigit((unsigned char)src[1]))) {
+    char *end;
+    t.type = T_INT;
+    errno = 0;
+    t.ival = strtoll(src, &end, 0);
+    if (errno)
+      die(line, "integer out of range");
+    src = end;
+  } else if (*src == '"') {
+    t.type = T_STR;
+    src++;
+    while (*src && *src != '"') {
+      if (*src == '\\' || *src == '\n')
+        die(line, "escapes and line breaks in text keys are not supported");
+      if (n == MAX_NAME - 1)
+        die(line, "text too long");
+      t.text[n++] = *src++;
+    }
+    if (*src++ != '"')
+      die(line, "unterminated text");
+  } else if (src[0] == '=' && src[1] == '>') {
+    t.type = T_ARROW;
+    strcpy(t.text, "=>");
+    src += 2;
+  } else {
+    t.type = T_PUNCT;
+    t.text[0] = *src++;
+  }
+  return t;
+}
+
+static void next(void)
+{
+  if (have_peek) {
+    tok = peek;
+    have_peek = false;
+  } else {
+    tok = lex();
+  }
+}
+
+static const token *lookahead(void)
+{
+  if (!have_peek) {
+    peek = lex();
+    have_peek = true;
+  }
+  return &peek;
+}
+
+static bool is_punct(const token *t, char c)
+{
+  return t->type == T_PUNCT && t->text[0] == c;
+}
+
+/* ---- parser ---- */
+
+static const char *keywords[] = {
+  "auto", "bool", "break", "case", "char", "const", "continue", "default",
+  "do", "double", "else", "enum", "extern", "float", "for", "goto", "if",
+  "inline", "int", "long", "register", "restrict", "return", "short",
+  "signed", "sizeof", "static", "struct", "switch", "typedef", "union",
+  "unsigned", "void", "volatile", "while", NULL
+};
+
+static void c_name(char *out, const char *in)
+{
+  size_t n = 0;
+  const char **k;
+
+  if (isdigit((unsigned char)*in))
+    out[n++] = '_';
+  for (; *in && n < MAX_NAME - 2; in++)
+    out[n++] = isalnum((unsigned char)*in) ? *in : '_';
+  out[n] = 0;
+  for (k = keywords; *k; k++) {
+    if (!strcmp(out, *k)) {
+      out[n++] = '_';
+      out[n] = 0;
+    }
+  }
+}
+
+static int find_rule(const char *name)
+{
+  int i;
+
+  for (i = 0; i < nrules; i++) {
+    if (!strcmp(rules[i].name, name))
+      return i;
+  }
+  return -1;
+}
+
+static void parse_member(rule *r)
+{
+  field *f;
+  const token *la;
+  bool arrow;
+
+  if (r->nfields == MAX_FIELDS)
+    die(tok.line, "more than %d members in %s", MAX_FIELDS, r->name);
+  f = &r->fields[r->nfields];
+  memset(f, 0, sizeof(*f));
+  f->line = tok.line;
+  if (is_punct(&tok, '?')) {
+    f->optional = true;
+    next();
+  }
+  if (is_punct(&tok, '*') || is_punct(&tok, '+'))
+    die(tok.line, "occurrence indicators other than '?' are not supported");
+
+  la = lookahead();
+  arrow = la->type == T_ARROW;
+  if (arrow || is_punct(la, ':')) {
+    switch (tok.type) {
+    case T_ID:
+      f->key = arrow ? KEY_RULE : KEY_TEXT;
+      strcpy(f->tkey, tok.text);
+      c_name(f->name, tok.text);
+      break;
+    case T_INT:
+      f->key = KEY_INT;
+      f->ikey = tok.ival;
+      if (tok.ival < 0)
+        snprintf(f->name, MAX_NAME, "key_m%" PRIu64, -(uint64_t)tok.ival);
+      else
+        snprintf(f->name, MAX_NAME, "key_%" PRId64, tok.ival);
+      break;
+    case T_STR:
+      f->key = KEY_TEXT;
+      strcpy(f->tkey, tok.text);
+      c_name(f->name, tok.text);
+      break;
+    default:
+      die(tok.line, "unsupported member key");
+    }
+    next();
+    next();
+    if (r->form == R_ARRAY) {
+      if (f->key != KEY_TEXT || arrow)
+        die(f->line, "array members can only have bareword labels");
+      f->key = KEY_NONE;
+    }
+  } else if (r->form == R_ARRAY) {
+    snprintf(f->name, MAX_NAME, "item_%d", r->nfields);
+  } else {
+    die(tok.line, "map members need a key");
+  }
+
+  if (tok.type != T_ID)
+    die(tok.line, "expected a type name");
+  strcpy(f->type, tok.text);
+  next();
+  r->nfields++;
+}
+
+static void parse_rule(void)
+{
+  rule *r;
+  char close;
+
+  if (tok.type != T_ID)
+    die(tok.line, "expected a rule name");
+  if (find_rule(tok.text) >= 0)
+    die(tok.line, "%s is defined twice", tok.text);
+  if (nrules == MAX_RULES)
+    die(tok.line, "too many rules");
+  r = &rules[nrules++];
+  memset(r, 0, sizeof(*r));
+  strcpy(r->name, tok.text);
+  c_name(r->cname, tok.text);
+  r->line = tok.line;
+  next();
+  if (!is_punct(&tok, '='))
+    die(tok.line, "expected '=' (only plain rules are supported)");
+  next();
+
+  switch (tok.type) {
+  case T_INT:
+    r->form = R_INT;
+    r->ival = tok.ival;
+    next();
+    return;
+  case T_STR:
+    r->form = R_TEXT;
+    strcpy(r->tval, tok.text);
+    next();
+    return;
+  case T_ID:
+    r->form = R_ALIAS;
+    strcpy(r->alias, tok.text);
+    next();
+    return;
+  default:
+    if (is_punct(&tok, '{')) {
+      r->form = R_MAP;
+      close = '}';
+    } else if (is_punct(&tok, '[')) {
+      r->form = R_ARRAY;
+      close = ']';
+    } else {
+      die(tok.line, "unsupported rule");
+    }
+  }
+  next();
+  while (!is_punct(&tok, close)) {
+    if (tok.type == T_EOF)
+      die(r->line, "unterminated %s", r->name);
+    parse_member(r);
+    if (is_punct(&tok, ','))
+      next();
+  }
+  next();
+}
+
+/* ---- resolution ---- */
+
+static kind prim_kind(const char *type)
+{
+  static const struct {
+    const char *name;
+    kind kind;
+  } prims[] = {
+    { "uint", K_UINT }, { "int", K_INT }, { "nint", K_NINT },
+    { "bool", K_BOOL },
+    { "tstr", K_TSTR }, { "text", K_TSTR },
+    { "bstr", K_BSTR }, { "bytes", K_BSTR },
+    { "float", K_FLOAT }, { "float16", K_FLOAT }, { "float32", K_FLOAT },
+    { "float64", K_FLOAT }, { "float16-32", K_FLOAT },
+    { "float32-64", K_FLOAT },
+  };
+  size_t i;
+
+  for (i = 0; i < sizeof(prims) / sizeof(prims[0]); i++) {
+    if (!strcmp(prims[i].name, type))
+      return prims[i].kind;
+  }
+  return K_NONE;
+}
+
+static void resolve_type(field *f)
+{
+  const char *type = f->type;
+  int hops, i;
+
+  for (hops = 0; hops < MAX_RULES; hops++) {
+    if ((f->kind = prim_kind(type)) != K_NONE)
+      return;
+    if ((i = find_rule(type)) < 0)
+      die(f->line, "unknown type %s", type);
+    switch (rules[i].form) {
+    case R_ALIAS:
+      type = rules[i].alias;
+      continue;
+    case R_MAP: case R_ARRAY:
+      f->kind = K_RULE;
+      f->rule = i;
+      return;
+    default:
+      die(f->line, "value rule %s cannot be used as a type", type);
+    }
+  }
+  die(f->line, "alias loop in %s", f->type);
+}
+
+static void resolve(void)
+{
+  int i, j, k;
+
+  for (i = 0; i < nrules; i++) {
+    rule *r = &rules[i];
+    bool optional = false;
+    if (r->form == R_MAP)
+      used_maps = true;
+    for (j = 0; j < r->nfields; j++) {
+      field *f = &r->fields[j];
+      resolve_type(f);
+      used[f->kind] = true;
+      if (f->key == KEY_RULE) {
+        k = find_rule(f->tkey);
+        if (k < 0)
+          die(f->line, "unknown key %s", f->tkey);
+        if (rules[k].form == R_INT) {
+          f->key = KEY_INT;
+          f->ikey = rules[k].ival;
+        } else if (rules[k].form == R_TEXT) {
+          f->key = KEY_TEXT;
+          strcpy(f->tkey, rules[k].tval);
+        } else {
+          die(f->line, "%s is not a value rule", f->tkey);
+        }
+      }
+      if (f->key == KEY_INT)
+        used_int_keys = true;
+      else if (f->key == KEY_TEXT)
+        used_text_keys = true;
+      if (r->form == R_ARRAY) {
+        if (optional && !f->optional)
+          die(f->line, "only trailing array members can be optional");
+        optional = f->optional;
+      }
+      for (k = 0; k < j; k++) {
+        field *g = &r->fields[k];
+        if (!strcmp(g->name, f->name))
+          die(f->line, "duplicate member %s", f->name);
+        if (r->form == R_MAP && g->key == f->key &&
+            (f->key == KEY_INT ? g->ikey == f->ikey :
+             !strcmp(g->tkey, f->tkey)))
+          die(f->line, "duplicate key for %s", f->name);
+      }
+    }
+  }
+}
+
+/* ---- output ---- */
+
+static FILE *h_out, *c_out;
+
+static void emit_struct(int i)
+{
+  rule *r = &rules[i];
+  int j;
+
+  if (r->mark == 2)
+    return;
+  if (r->mark == 1)
+    die(r->line, "%s contains itself", r->name);
+  r->mark = 1;
+  for (j = 0; j < r->nfields; j++) {
+    if (r->fields[j].kind == K_RULE)
+      emit_struct(r->fields[j].rule);
+  }
+  r->mark = 2;
+
+  fprintf(h_out, "/** Decoded from the %s `%s` */\nstruct %s {\n",
+          r->form == R_MAP ? "map" : "array", r->name, r->cname);
+  for (j = 0; j < r->nfields; j++) {
+    field *f = &r->fields[j];
+    if (f->optional)
+      fprintf(h_out, "  bool has_%s;\n", f->name);
+    switch (f->kind) {
+    case K_UINT:
+      fprintf(h_out, "  uint64_t %s;\n", f->name);
+      break;
+    case K_INT: case K_NINT:
+      fprintf(h_out, "  int64_t %s;\n", f->name);
+      break;
+    case K_BOOL:
+      fprintf(h_out, "  bool %s;\n", f->name);
+      break;
+    case K_TSTR:
+      fprintf(h_out, "  const char *%s;\n  size_t %s_len;\n",
+              f->name, f->name);
+      break;
+    case K_BSTR:
+      fprintf(h_out, "  const uint8_t *%s;\n  size_t %s_len;\n",
+              f->name, f->name);
+      break;
+    case K_FLOAT:
+      fprintf(h_out, "  double %s;\n", f->name);
+      break;
+    case K_RULE:
+      fprintf(h_out, "  struct %s %s;\n", rules[f->rule].cname, f->name);
+      break;
+    default:
+      break;
+    }
+  }
+  if (!r->nfields)
+    fprintf(h_out, "  char unused;\n");
+  fprintf(h_out, "};\n\n");
+}
+
+static const char *base_name(const char *path)
+{
+  const char *base = strrchr(path, '/');
+  return base ? base + 1 : path;
+}
+
+static void emit_header(const char *guard_src)
+{
+  char guard[MAX_NAME * 2];
+  size_t n;
+  int i;
+
+  for (n = 0; guard_src[n] && n < sizeof(guard) - 1; n++)
+    guard[n] = isalnum((unsigned char)guard_src[n]) ?
+      toupper((unsigned char)guard_src[n]) : '_';
+  guard[n] = 0;
+
+  fprintf(h_out,
+          "/* Generated by cn-cddl-gen from %s.  Do not edit. */\n\n"
+          "#ifndef %s\n#define %s\n\n"
+          "#include <stdbool.h>\n#include <stdint.h>\n\n"
+          "#include \"cn-cbor/cn-cbor.h\"\n\n"
+          "#ifdef  __cplusplus\nextern \"C\" {\n#endif\n\n",
+          base_name(in_name), guard, guard);
+  for (i = 0; i < nrules; i++) {
+    if (rules[i].form == R_MAP || rules[i].form == R_ARRAY)
+      emit_struct(i);
+  }
+  for (i = 0; i < nrules; i++) {
+    rule *r = &rules[i];
+    if (r->form != R_MAP && r->form != R_ARRAY)
+      continue;
+    fprintf(h_out,
+            "/**\n"
+            " * Decode a `%s` from the start of a buffer.  Strings point into\n"
+            " * the buffer.\n"
+            " *\n"
+            " * @param[in]  buf   The array of bytes to parse\n"
+            " * @param[in]  len   The number of bytes in the array\n"
+            " * @param[out] out   The decoded value\n"
+            " * @param[out] errp  Error, if 0 is returned\n"
+            " * @return           The number of bytes consumed, or 0 on error\n"
+            " */\n"
+            "size_t %s_decode(const uint8_t *buf, size_t len,\n"
+            "    struct %s *out, cn_cbor_errback *errp);\n\n",
+            r->name, r->cname, r->cname);
+    fprintf(h_out,
+            "/**\n"
+            " * Encode a `%s`.\n"
+            " *\n"
+            " * @param[in]  buf        The buffer into which to write\n"
+            " * @param[in]  buf_offset The offset (in bytes) from the beginning of the buffer\n"
+            " *                        to start writing at\n"
+            " * @param[in]  buf_size   The total length (in bytes) of the buffer\n"
+            " * @param[in]  in         The value to encode\n"
+            " * @return                -1 on fail, or number of bytes written\n"
+            " */\n"
+            "ssize_t %s_encode(uint8_t *buf, size_t buf_offset, size_t buf_size,\n"
+            "    const struct %s *in);\n\n",
+            r->name, r->cname, r->cname);
+  }
+  fprintf(h_out,
+          "#ifdef  __cplusplus\n}\n#endif\n\n#endif  /* %s */\n", guard);
+}
+
+static void emit_helpers(void)
+{
+  fputs("static size_t _cddl_fail(cn_cbor_errback *errp, cn_cbor_error err,\n"
+        "    size_t pos)\n"
+        "{\n"
+        "  if (errp) {\n"
+        "    errp->err = err;\n"
+        "    errp->pos = (int)pos;\n"
+        "  }\n"
+        "  return 0;\n"
+        "}\n\n"
+        "/* Decode the head at pos, which must have major type mt (if mt is not\n"
+        "   -1) and a definite length.  Returns the position after the head. */\n"
+        "static size_t _cddl_head(const uint8_t *buf, size_t len, size_t pos,\n"
+        "    int mt, cn_cbor_head *h, cn_cbor_errback *errp)\n"
+        "{\n"
+        "  size_t n = cn_cbor_head_decode(buf + pos, len - pos, h, errp);\n"
+        "  if (!n) {\n"
+        "    if (errp) { errp->pos += (int)pos; }\n"
+        "    return 0;\n"
+        "  }\n"
+        "  if (mt >= 0 && (h->mt != mt || h->ai == 31))\n"
+        "    return _cddl_fail(errp, CN_CBOR_ERR_WRONG_TYPE, pos);\n"
+        "  return pos + n;\n"
+        "}\n\n", c_out);
+  if (used_maps)
+    fputs("static size_t _cddl_skip(const uint8_t *buf, size_t len, size_t pos,\n"
+        "    cn_cbor_errback *errp)\n"
+        "{\n"
+        "  size_t n = cn_cbor_skip(buf + pos, len - pos, errp);\n"
+        "  if (!n) {\n"
+        "    if (errp) { errp->pos += (int)pos; }\n"
+        "    return 0;\n"
+        "  }\n"
+        "  return pos + n;\n"
+        "}\n\n", c_out);
+  fputs("static ssize_t _cddl_head_out(uint8_t *buf, ssize_t off, size_t size,\n"
+        "    int mt, uint64_t val)\n"
+        "{\n"
+        "  ssize_t n;\n"
+        "  if (off < 0) { return -1; }\n"
+        "  n = cn_cbor_head_encode(buf, (size_t)off, size, mt, val);\n"
+        "  return n < 0 ? -1 : off + n;\n"
+        "}\n\n", c_out);
+
+  if (used[K_UINT])
+    fputs("static size_t _cddl_uint(const uint8_t *buf, size_t len, size_t pos,\n"
+          "    uint64_t *out, cn_cbor_errback *errp)\n"
+          "{\n"
+          "  cn_cbor_head h;\n"
+          "  if (!(pos = _cddl_head(buf, len, pos, 0, &h, errp))) { return 0; }\n"
+          "  *out = h.val;\n"
+          "  return pos;\n"
+          "}\n\n", c_out);
+  if (used[K_INT] || used[K_NINT])
+    fputs("static size_t _cddl_int(const uint8_t *buf, size_t len, size_t pos,\n"
+          "    bool neg_only, int64_t *out, cn_cbor_errback *errp)\n"
+          "{\n"
+          "  cn_cbor_head h;\n"
+          "  size_t start = pos;\n"
+          "  if (!(pos = _cddl_head(buf, len, pos, -1, &h, errp))) { return 0; }\n"
+          "  if (h.mt > 1 || (neg_only && h.mt == 0) || h.val > INT64_MAX)\n"
+          "    return _cddl_fail(errp, CN_CBOR_ERR_WRONG_TYPE, start);\n"
+          "  *out = h.mt == 0 ? (int64_t)h.val : -1 - (int64_t)h.val;\n"
+          "  return pos;\n"
+          "}\n\n", c_out);
+  if (used[K_INT] || used[K_NINT] || used_int_keys)
+    fputs("static ssize_t _cddl_int_out(uint8_t *buf, ssize_t off, size_t size,\n"
+          "    int64_t val)\n"
+          "{\n"
+          "  if (val < 0)\n"
+          "    return _cddl_head_out(buf, off, size, 1, (uint64_t)(-1 - val));\n"
+          "  return _cddl_head_out(buf, off, size, 0, (uint64_t)val);\n"
+          "}\n\n", c_out);
+  if (used[K_BOOL])
+    fputs("static size_t _cddl_bool(const uint8_t *buf, size_t len, size_t pos,\n"
+          "    bool *out, cn_cbor_errback *errp)\n"
+          "{\n"
+          "  cn_cbor_head h;\n"
+          "  size_t start = pos;\n"
+          "  if (!(pos = _cddl_head(buf, len, pos, 7, &h, errp))) { return 0; }\n"
+          "  if (h.ai != 20 && h.ai != 21)\n"
+          "    return _cddl_fail(errp, CN_CBOR_ERR_WRONG_TYPE, start);\n"
+          "  *out = h.ai == 21;\n"
+          "  return pos;\n"
+          "}\n\n", c_out);
+  if (used[K_TSTR] || used[K_BSTR])
+    fputs("static size_t _cddl_string(const uint8_t *buf, size_t len, size_t pos,\n"
+          "    int mt, size_t *str, size_t *str_len, cn_cbor_errback *errp)\n"
+          "{\n"
+          "  cn_cbor_head h;\n"
+          "  if (!(pos = _cddl_head(buf, len, pos, mt, &h, errp))) { return 0; }\n"
+          "  if (h.val > len - pos)\n"
+          "    return _cddl_fail(errp, CN_CBOR_ERR_OUT_OF_DATA, len);\n"
+          "  *str = pos;\n"
+          "  *str_len = (size_t)h.val;\n"
+          "  return pos + (size_t)h.val;\n"
+          "}\n\n", c_out);
+  if (used[K_TSTR] || used[K_BSTR] || used_text_keys)
+    fputs("static ssize_t _cddl_string_out(uint8_t *buf, ssize_t off, size_t size,\n"
+        "    int mt, const void *p, size_t n)\n"
+        "{\n"
+        "  off = _cddl_head_out(buf, off, size, mt, n);\n"
+        "  if (off < 0 || (size_t)off + n >= size) { return -1; }\n"
+        "  memcpy(buf + off, p, n);\n"
+        "  return off + (ssize_t)n;\n"
+        "}\n\n", c_out);
+  if (used[K_FLOAT])
+    fputs("#ifdef CBOR_NO_FLOAT\n"
+          "#error \"this schema uses floating point types\"\n"
+          "#endif\n\n"
+          "static double _cddl_half(uint16_t half)\n"
+          "{\n"
+          "  uint32_t sign = (uint32_t)(half & 0x8000) << 16;\n"
+          "  uint32_t exp = (half >> 10) & 0x1f;\n"
+          "  uint32_t mant = half & 0x3ff;\n"
+          "  uint32_t bits;\n"
+          "  float f;\n"
+          "  if (exp == 0x1f) {\n"
+          "    bits = sign | 0x7f800000 | (mant << 13);\n"
+          "  } else if (exp) {\n"
+          "    bits = sign | ((exp + 112) << 23) | (mant << 13);\n"
+          "  } else if (mant) {\n"
+          "    exp = 113;\n"
+          "    while (!(mant & 0x400)) {\n"
+          "      mant <<= 1;\n"
+          "      exp--;\n"
+          "    }\n"
+          "    bits = sign | (exp << 23) | ((mant & 0x3ff) << 13);\n"
+          "  } else {\n"
+          "    bits = sign;\n"
+          "  }\n"
+          "  memcpy(&f, &bits, sizeof(f));\n"
+          "  return f;\n"
+          "}\n\n"
+          "static size_t _cddl_float(const uint8_t *buf, size_t len, size_t pos,\n"
+          "    double *out, cn_cbor_errback *errp)\n"
+          "{\n"
+          "  cn_cbor_head h;\n"
+          "  size_t start = pos;\n"
+          "  uint32_t bits;\n"
+          "  float f;\n"
+          "  if (!(pos = _cddl_head(buf, len, pos, 7, &h, errp))) { return 0; }\n"
+          "  switch (h.ai) {\n"
+          "  case 25:\n"
+          "    *out = _cddl_half((uint16_t)h.val);\n"
+          "    break;\n"
+          "  case 26:\n"
+          "    bits = (uint32_t)h.val;\n"
+          "    memcpy(&f, &bits, sizeof(f));\n"
+          "    *out = f;\n"
+          "    break;\n"
+          "  case 27:\n"
+          "    memcpy(out, &h.val, sizeof(*out));\n"
+          "    break;\n"
+          "  default:\n"
+          "    return _cddl_fail(errp, CN_CBOR_ERR_WRONG_TYPE, start);\n"
+          "  }\n"
+          "  return pos;\n"
+          "}\n\n"
+          "static ssize_t _cddl_float_out(uint8_t *buf, ssize_t off, size_t size,\n"
+          "    double val)\n"
+          "{\n"
+          "  ssize_t n;\n"
+          "  if (off < 0) { return -1; }\n"
+          "  n = cn_cbor_double_encode(buf, (size_t)off, size, val);\n"
+          "  return n < 0 ? -1 : off + n;\n"
+          "}\n\n", c_out);
+}
+
+static void emit_decode_field(const field *f, const char *indent)
+{
+  fprintf(c_out, "%sif (!(pos = ", indent);
+  switch (f->kind) {
+  case K_UINT:
+    fprintf(c_out, "_cddl_uint(buf, len, pos, &out->%s, errp)", f->name);
+    break;
+  case K_INT: case K_NINT:
+    fprintf(c_out, "_cddl_int(buf, len, pos, %s, &out->%s, errp)",
+            f->kind == K_NINT ? "true" : "false", f->name);
+    break;
+  case K_BOOL:
+    fprintf(c_out, "_cddl_bool(buf, len, pos, &out->%s, errp)", f->name);
+    break;
+  case K_TSTR: case K_BSTR:
+    fprintf(c_out, "_cddl_string(buf, len, pos, %d, &str, &out->%s_len,\n"
+            "%s    errp)",
+            f->kind == K_TSTR ? 3 : 2, f->name, indent);
+    break;
+  case K_FLOAT:
+    fprintf(c_out, "_cddl_float(buf, len, pos, &out->%s, errp)", f->name);
+    break;
+  case K_RULE:
+    fprintf(c_out, "_%s_decode_at(buf, len, pos, &out->%s, errp)",
+            rules[f->rule].cname, f->name);
+    break;
+  default:
+    break;
+  }
+  fprintf(c_out, ")) { return 0; }\n");
+  if (f->kind == K_TSTR)
+    fprintf(c_out, "%sout->%s = (const char *)buf + str;\n", indent, f->name);
+  else if (f->kind == K_BSTR)
+    fprintf(c_out, "%sout->%s = buf + str;\n", indent, f->name);
+}
+
+static void emit_encode_field(const field *f, const char *indent)
+{
+  fprintf(c_out, "%soff = ", indent);
+  switch (f->kind) {
+  case K_UINT:
+    fprintf(c_out, "_cddl_head_out(buf, off, size, 0, in->%s)", f->name);
+    break;
+  case K_INT: case K_NINT:
+    fprintf(c_out, "_cddl_int_out(buf, off, size, in->%s)", f->name);
+    break;
+  case K_BOOL:
+    fprintf(c_out, "_cddl_head_out(buf, off, size, 7, in->%s ? 21 : 20)",
+            f->name);
+    break;
+  case K_TSTR: case K_BSTR:
+    fprintf(c_out, "_cddl_string_out(buf, off, size, %d, in->%s, in->%s_len)",
+            f->kind == K_TSTR ? 3 : 2, f->name, f->name);
+    break;
+  case K_FLOAT:
+    fprintf(c_out, "_cddl_float_out(buf, off, size, in->%s)", f->name);
+    break;
+  case K_RULE:
+    fprintf(c_out, "_%s_encode_at(buf, off, size, &in->%s)",
+            rules[f->rule].cname, f->name);
+    break;
+  default:
+    break;
+  }
+  fprintf(c_out, ";\n");
+}
+
+static void emit_text(const char *s)
+{
+  fputc('"', c_out);
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\')
+      fputc('\\', c_out);
+    fputc(*s, c_out);
+  }
+  fputc('"', c_out);
+}
+
+static void emit_key_cases(const rule *r, key_kind key, bool neg)
+{
+  int j;
+
+  for (j = 0; j < r->nfields; j++) {
+    const field *f = &r->fields[j];
+    if (f->key != key || (key == KEY_INT && (f->ikey < 0) != neg))
+      continue;
+    fprintf(c_out, "      case %" PRIu64 "u: field = %d; break;\n",
+            neg ? (uint64_t)(-1 - f->ikey) : (uint64_t)f->ikey, j);
+  }
+}
+
+static void emit_map_decode(const rule *r)
+{
+  bool has_uint = false, has_nint = false, has_text = false;
+  uint64_t required = 0;
+  size_t lens[MAX_FIELDS];
+  int nlens = 0;
+  int j, k;
+
+  for (j = 0; j < r->nfields; j++) {
+    const field *f = &r->fields[j];
+    if (f->key == KEY_INT) {
+      if (f->ikey < 0)
+        has_nint = true;
+      else
+        has_uint = true;
+    } else {
+      has_text = true;
+    }
+    if (!f->optional)
+      required |= (uint64_t)1 << j;
+  }
+
+  fprintf(c_out,
+          "  uint64_t seen = 0;\n"
+          "  uint64_t count;\n"
+          "  size_t key;\n"
+          "  int field;\n\n"
+          "  memset(out, 0, sizeof(*out));\n"
+          "  if (!(pos = _cddl_head(buf, len, pos, 5, &h, errp))) { return 0; }\n"
+          "  for (count = h.val; count; count--) {\n"
+          "    key = pos;\n"
+          "    field = -1;\n"
+          "    if (!(pos = _cddl_head(buf, len, pos, -1, &h, errp))) { return 0; }\n"
+          "    switch (h.mt) {\n");
+  if (has_uint) {
+    fprintf(c_out, "    case 0:\n      switch (h.val) {\n");
+    emit_key_cases(r, KEY_INT, false);
+    fprintf(c_out, "      }\n      break;\n");
+  }
+  if (has_nint) {
+    fprintf(c_out, "    case 1:\n      switch (h.val) {\n");
+    emit_key_cases(r, KEY_INT, true);
+    fprintf(c_out, "      }\n      break;\n");
+  }
+  if (has_text) {
+    fprintf(c_out,
+            "    case 3:\n"
+            "      if (h.ai == 31) {\n"
+            "        if (!(pos = _cddl_skip(buf, len, key, errp))) { return 0; }\n"
+            "        break;\n"
+            "      }\n"
+            "      if (h.val > len - pos)\n"
+            "        return _cddl_fail(errp, CN_CBOR_ERR_OUT_OF_DATA, len);\n"
+            "      switch (h.val) {\n");
+    for (j = 0; j < r->nfields; j++) {
+      size_t n;
+      bool first = true;
+      if (r->fields[j].key != KEY_TEXT)
+        continue;
+      n = strlen(r->fields[j].tkey);
+      for (k = 0; k < nlens && lens[k] != n; k++)
+        ;
+      if (k < nlens)
+        continue;
+      lens[nlens++] = n;
+      fprintf(c_out, "      case %zu:\n", n);
+      for (k = j; k < r->nfields; k++) {
+        const field *f = &r->fields[k];
+        if (f->key != KEY_TEXT || strlen(f->tkey) != n)
+          continue;
+        fprintf(c_out, "        %sif (!memcmp(buf + pos, ",
+                first ? "" : "else ");
+        emit_text(f->tkey);
+        fprintf(c_out, ", %zu)) { field = %d; }\n", n, k);
+        first = false;
+      }
+      fprintf(c_out, "        break;\n");
+    }
+    fprintf(c_out,
+            "      }\n"
+            "      pos += (size_t)h.val;\n"
+            "      break;\n");
+  }
+  fprintf(c_out,
+          "    default:\n"
+          "      if (!(pos = _cddl_skip(buf, len, key, errp))) { return 0; }\n"
+          "    }\n"
+          "    switch (field) {\n");
+  for (j = 0; j < r->nfields; j++) {
+    fprintf(c_out, "    case %d:\n", j);
+    emit_decode_field(&r->fields[j], "      ");
+    fprintf(c_out, "      break;\n");
+  }
+  fprintf(c_out,
+          "    default:\n"
+          "      if (!(pos = _cddl_skip(buf, len, pos, errp))) { return 0; }\n"
+          "      continue;\n"
+          "    }\n"
+          "    seen |= (uint64_t)1 << field;\n"
+          "  }\n"
+          "  if ((seen & UINT64_C(0x%" PRIx64 ")) != UINT64_C(0x%" PRIx64 "))\n"
+          "    return _cddl_fail(errp, CN_CBOR_ERR_MISSING_FIELD, pos);\n",
+          required, required);
+  for (j = 0; j < r->nfields; j++) {
+    if (r->fields[j].optional)
+      fprintf(c_out, "  out->has_%s = (seen >> %d) & 1;\n",
+              r->fields[j].name, j);
+  }
+  fprintf(c_out, "  return pos;\n");
+}
+
+static void emit_array_decode(const rule *r)
+{
+  int min = 0, j;
+
+  while (min < r->nfields && !r->fields[min].optional)
+    min++;
+  fprintf(c_out,
+          "  size_t start = pos;\n\n"
+          "  memset(out, 0, sizeof(*out));\n"
+          "  if (!(pos = _cddl_head(buf, len, pos, 4, &h, errp))) { return 0; }\n");
+  if (min)
+    fprintf(c_out, "  if (h.val < %d || h.val > %d)\n", min, r->nfields);
+  else
+    fprintf(c_out, "  if (h.val > %d)\n", r->nfields);
+  fprintf(c_out,
+          "    return _cddl_fail(errp, CN_CBOR_ERR_WRONG_TYPE, start);\n");
+  for (j = 0; j < r->nfields; j++) {
+    const field *f = &r->fields[j];
+    if (f->optional) {
+      fprintf(c_out, "  if (h.val > %d) {\n", j);
+      emit_decode_field(f, "    ");
+      fprintf(c_out, "    out->has_%s = true;\n  }\n", f->name);
+    } else {
+      emit_decode_field(f, "  ");
+    }
+  }
+  fprintf(c_out, "  return pos;\n");
+}
+
+static void emit_encode(const rule *r)
+{
+  int required = 0, j;
+
+  for (j = 0; j < r->nfields; j++) {
+    if (!r->fields[j].optional)
+      required++;
+  }
+  fprintf(c_out, "  off = _cddl_head_out(buf, off, size, %d, %d",
+          r->form == R_MAP ? 5 : 4, required);
+  for (j = 0; j < r->nfields; j++) {
+    if (r->fields[j].optional)
+      fprintf(c_out, "\n      + in->has_%s", r->fields[j].name);
+  }
+  fprintf(c_out, ");\n");
+  for (j = 0; j < r->nfields; j++) {
+    const field *f = &r->fields[j];
+    const char *indent = f->optional ? "    " : "  ";
+    if (f->optional)
+      fprintf(c_out, "  if (in->has_%s) {\n", f->name);
+    if (f->key == KEY_INT) {
+      fprintf(c_out, "%soff = _cddl_int_out(buf, off, size, INT64_C(%" PRId64
+              "));\n", indent, f->ikey);
+    } else if (f->key == KEY_TEXT) {
+      fprintf(c_out, "%soff = _cddl_string_out(buf, off, size, 3, ", indent);
+      emit_text(f->tkey);
+      fprintf(c_out, ", %zu);\n", strlen(f->tkey));
+    }
+    emit_encode_field(f, indent);
+    if (f->optional)
+      fprintf(c_out, "  }\n");
+  }
+  fprintf(c_out, "  return off;\n");
+}
+
+static void emit_source(const char *header)
+{
+  int i, j;
+
+  fprintf(c_out,
+          "/* Generated by cn-cddl-gen from %s.  Do not edit. */\n\n"
+          "#include <string.h>\n\n"
+          "#include \"%s\"\n\n",
+          base_name(in_name), base_name(header));
+  emit_helpers();
+
+  for (i = 0; i < nrules; i++) {
+    const rule *r = &rules[i];
+    if (r->form != R_MAP && r->form != R_ARRAY)
+      continue;
+    fprintf(c_out,
+            "static size_t _%s_decode_at(const uint8_t *buf, size_t len,\n"
+            "    size_t pos, struct %s *out, cn_cbor_errback *errp);\n"
+            "static ssize_t _%s_encode_at(uint8_t *buf, ssize_t off, size_t size,\n"
+            "    const struct %s *in);\n",
+            r->cname, r->cname, r->cname, r->cname);
+  }
+  fputc('\n', c_out);
+
+  for (i = 0; i < nrules; i++) {
+    const rule *r = &rules[i];
+    if (r->form != R_MAP && r->form != R_ARRAY)
+      continue;
+    fprintf(c_out,
+            "static size_t _%s_decode_at(const uint8_t *buf, size_t len,\n"
+            "    size_t pos, struct %s *out, cn_cbor_errback *errp)\n"
+            "{\n"
+            "  cn_cbor_head h;\n",
+            r->cname, r->cname);
+    for (j = 0; j < r->nfields; j++) {
+      if (r->fields[j].kind == K_TSTR || r->fields[j].kind == K_BSTR) {
+        fprintf(c_out, "  size_t str;\n");
+        break;
+      }
+    }
+    if (r->form == R_MAP)
+      emit_map_decode(r);
+    else
+      emit_array_decode(r);
+    fprintf(c_out,
+            "}\n\n"
+            "size_t %s_decode(const uint8_t *buf, size_t len,\n"
+            "    struct %s *out, cn_cbor_errback *errp)\n"
+            "{\n"
+            "  return _%s_decode_at(buf, len, 0, out, errp);\n"
+            "}\n\n"
+            "static ssize_t _%s_encode_at(uint8_t *buf, ssize_t off, size_t size,\n"
+            "    const struct %s *in)\n"
+            "{\n",
+            r->cname, r->cname, r->cname, r->cname, r->cname);
+    emit_encode(r);
+    fprintf(c_out,
+            "}\n\n"
+            "ssize_t %s_encode(uint8_t *buf, size_t buf_offset, size_t buf_size,\n"
+            "    const struct %s *in)\n"
+            "{\n"
+            "  ssize_t off = _%s_encode_at(buf, (ssize_t)buf_offset, buf_size, in);\n"
+            "  return off < 0 ? -1 : off - (ssize_t)buf_offset;\n"
+            "}\n\n",
+            r->cname, r->cname, r->cname);
+  }
+}
+
+static char *read_file(const char *name)
+{
+  FILE *f = fopen(name, "rb");
+  char *text;
+  long n;
+
+  if (!f || fseek(f, 0, SEEK_END) || (n = ftell(f)) < 0 ||
+      fseek(f, 0, SEEK_SET)) {
+    perror(name);
+    exit(1);
+  }
+  text = malloc((size_t)n + 1);
+  if (!text || fread(text, 1, (size_t)n, f) != (size_t)n) {
+    perror(name);
+    exit(1);
+  }
+  text[n] = 0;
+  fclose(f);
+  return text;
+}
+
+int main(int argc, char **argv)
+{
+  if (argc != 4) {
+    fprintf(stderr, "usage: %s <input.cddl> <output.h> <output.c>\n", argv[0]);
+    return 2;
+  }
+  in_name = argv[1];
+  src = read_file(in_name);
+  next();
+  while (tok.type != T_EOF)
+    parse_rule();
+  resolve();
+
+  h_out = fopen(argv[2], "w");
+  c_out = fopen(argv[3], "w");
+  if (!h_out || !c_out) {
+    perror(h_out ? argv[3] : argv[2]);
+    return 1;
+  }
+  emit_header(base_name(argv[2]));
+  emit_source(argv[2]);
+  if (fclose(h_out) || fclose(c_out)) {
+    perror("write");
+    return 1;
+  }
+  return 0;
+}